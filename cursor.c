@@ -0,0 +1,672 @@
+/*-------------------------------------------------------------------------
+ *
+ * cursor.c
+ *		  Document-at-a-time qual evaluation for document collections
+ *		  foreign-data wrapper.
+ *
+ * Copyright (c) 2012, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Zheng Yang <zhengyang4k@gmail.com>
+ *
+ * IDENTIFICATION
+ *		  contrib/dc_fdw/cursor.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "qual_pushdown.h"
+
+/*
+ * A qual tree is evaluated by a tree of cursors, each positioned on a
+ * doc id matched by its node. cursorAdvance(c, target) moves a cursor
+ * to its first doc id not below target, and the scan pulls the doc ids
+ * of the root one at a time with cursorNext(). Leaves decode their
+ * postings lists in place a block at a time, so a scan stopped early by
+ * a LIMIT only decodes the blocks it went into and memory does not grow
+ * with the number of matches.
+ *
+ * A term is the OR of its postings lists in every segment; an OR keeps
+ * its children in a min-heap by doc id. An AND intersects blocks of the
+ * doc ids of its two first children, the rarest after estimateQualTree(),
+ * with the intersectPostings() kernel, leapfrogs the others from the
+ * doc ids in common, and skips the doc ids its negated children are
+ * positioned on; a NOT is the AND of the ALL postings and its
+ * negated child. "id = n" is n itself, if the ALL postings have it.
+ *
+ * Every cursor returns its doc ids in ascending order, once each even if
+ * several segments have them, so the scan is ordered by id and needs no
+ * Sort for ORDER BY id or a merge join on id.
+ */
+
+static QualCursor * newCursor(int type, int nchildren, int nnegated);
+static QualCursor * openTermCursor(char *term, IndexReader *index);
+static QualCursor * openPostingsCursor(IndexSegment *seg, PostingInfo *info);
+static void advancePostings(QualCursor *c, int32 target);
+static int decodeBlock(QualCursor *c);
+static int gallop(int32 *ids, int lo, int n, int32 target);
+static void advanceAnd(QualCursor *c, int32 target);
+static void advanceAndBlocks(QualCursor *c, int32 target);
+static bool nextAndBlock(QualCursor *c, int32 target);
+static int fillBlock(QualCursor *c, int32 lower, int32 *buf);
+static void advanceOr(QualCursor *c, int32 target);
+static void siftDownOr(QualCursor **heap, int n, int i);
+
+/*
+ * open a cursor on the docs matched by a qual tree, whose df have been
+ * set by estimateQualTree()
+ */
+QualCursor *
+openQualCursor(PushableQualNode *node, IndexReader *index)
+{
+    QualCursor  *c;
+    ListCell    *cell;
+
+#ifdef DEBUG
+    elog(NOTICE, "openQualCursor");
+#endif
+
+    /* terms not in the dictionary match nothing */
+    if (node->df == 0)
+        return newCursor(CURSOR_OR, 0, 0);
+
+    if (strcmp(node->optype.data, "op_node") == 0)
+    {
+        if (strcmp(node->opname.data, "@@") == 0)
+        {
+            char *term = normalizeTerm(node->rightOperand.data);
+
+            /* stop word */
+            if (term == NULL)
+                return newCursor(CURSOR_OR, 0, 0);
+            c = openTermCursor(term, index);
+            pfree(term);
+            return c;
+        }
+
+        /* the doc may have been deleted */
+        c = newCursor(CURSOR_CONST, 0, 0);
+        c->id = atoi(node->rightOperand.data);
+        if (!isLiveDoc(index, c->id))
+            c->doc = CURSOR_END;
+        return c;
+    }
+
+    if (strcmp(node->opname.data, "AND") == 0)
+    {
+        int npositive = 0;
+        int nnegated = 0;
+
+        foreach(cell, node->childNodes)
+        {
+            PushableQualNode *childNode = (PushableQualNode *) lfirst(cell);
+
+            if (childNode->df == 0)
+                return newCursor(CURSOR_OR, 0, 0);
+            if (strcmp(childNode->opname.data, "NOT") == 0)
+                nnegated ++;
+            else
+                npositive ++;
+        }
+
+        /* only NOTs, start from every document */
+        c = newCursor(CURSOR_AND, Max(npositive, 1), nnegated);
+        if (npositive == 0)
+            c->children[0] = openAllCursor(index);
+        npositive = nnegated = 0;
+        foreach(cell, node->childNodes)
+        {
+            PushableQualNode *childNode = (PushableQualNode *) lfirst(cell);
+
+            if (strcmp(childNode->opname.data, "NOT") == 0)
+                c->negated[nnegated++] = openQualCursor(
+                        (PushableQualNode *) linitial(childNode->childNodes), index);
+            else
+                c->children[npositive++] = openQualCursor(childNode, index);
+        }
+        if (npositive >= 2)
+        {
+            c->ids = (int32 *) palloc(sizeof(int32) * (CURSOR_BLOCK + POSTINGS_SIMD_SLACK));
+            c->blocks[0] = (int32 *) palloc(sizeof(int32) * CURSOR_BLOCK);
+            c->blocks[1] = (int32 *) palloc(sizeof(int32) * CURSOR_BLOCK);
+        }
+    }
+    else if (strcmp(node->opname.data, "OR") == 0)
+    {
+        c = newCursor(CURSOR_OR, list_length(node->childNodes), 0);
+        c->nchildren = 0;
+        foreach(cell, node->childNodes)
+        {
+            PushableQualNode *childNode = (PushableQualNode *) lfirst(cell);
+
+            if (childNode->df != 0)
+                c->children[c->nchildren++] = openQualCursor(childNode, index);
+        }
+    }
+    else
+    {
+        /* NOT */
+        c = newCursor(CURSOR_AND, 1, 1);
+        c->children[0] = openAllCursor(index);
+        c->negated[0] = openQualCursor(
+                (PushableQualNode *) linitial(node->childNodes), index);
+    }
+    return c;
+}
+
+/*
+ * open a cursor on every live document of the index
+ */
+QualCursor *
+openAllCursor(IndexReader *index)
+{
+    return openTermCursor(ALL, index);
+}
+
+/*
+ * whether a doc id is a live document of the index. The ALL postings
+ * are walked by a cursor kept with the reader rather than decoded into
+ * an array, so ascending lookups, as the rescans of a join on id do,
+ * decode them once; a lookup below the cursor starts it over.
+ */
+bool
+isLiveDoc(IndexReader *index, int32 id)
+{
+    if (id < 0 || id == CURSOR_END)
+        return FALSE;
+
+    if (index->allCursor != NULL && index->allCursor->doc > id)
+    {
+        closeQualCursor(index->allCursor);
+        index->allCursor = NULL;
+    }
+    if (index->allCursor == NULL)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(index->cxt);
+
+        index->allCursor = openAllCursor(index);
+        MemoryContextSwitchTo(oldcontext);
+    }
+    return cursorAdvance(index->allCursor, id) == id;
+}
+
+/*
+ * move a cursor to its next doc id, CURSOR_END when there is none
+ */
+int32
+cursorNext(QualCursor *c)
+{
+    if (c->doc == CURSOR_END)
+        return CURSOR_END;
+    return cursorAdvance(c, c->doc + 1);
+}
+
+/*
+ * move a cursor to its first doc id not below target, CURSOR_END when
+ * there is none. A cursor never moves back.
+ */
+int32
+cursorAdvance(QualCursor *c, int32 target)
+{
+    if (c->doc >= target)
+        return c->doc;
+
+    switch (c->type)
+    {
+        case CURSOR_POSTINGS:
+            advancePostings(c, target);
+            break;
+        case CURSOR_CONST:
+            c->doc = (target <= c->id) ? c->id : CURSOR_END;
+            break;
+        case CURSOR_AND:
+            advanceAnd(c, target);
+            break;
+        case CURSOR_OR:
+            advanceOr(c, target);
+            break;
+        default:
+            elog(ERROR, "Unknown qual cursor type %d!", c->type);
+    }
+    return c->doc;
+}
+
+/*
+ * free a cursor tree
+ */
+void
+closeQualCursor(QualCursor *c)
+{
+    int i;
+
+    for (i = 0; i < c->nchildren; i++)
+        closeQualCursor(c->children[i]);
+    for (i = 0; i < c->nnegated; i++)
+        closeQualCursor(c->negated[i]);
+    if (c->children != NULL)
+        pfree(c->children);
+    if (c->negated != NULL)
+        pfree(c->negated);
+    if (c->copy != NULL)
+        pfree(c->copy);
+    if (c->ids != NULL)
+        pfree(c->ids);
+    for (i = 0; i < 2; i++)
+    {
+        if (c->blocks[i] != NULL)
+            pfree(c->blocks[i]);
+    }
+    pfree(c);
+}
+
+static QualCursor *
+newCursor(int type, int nchildren, int nnegated)
+{
+    QualCursor *c = (QualCursor *) palloc0(sizeof(QualCursor));
+
+    c->type = type;
+    c->doc = -1;
+    c->nchildren = nchildren;
+    c->nnegated = nnegated;
+    if (nchildren > 0)
+        c->children = (QualCursor **) palloc0(sizeof(QualCursor *) * nchildren);
+    if (nnegated > 0)
+        c->negated = (QualCursor **) palloc0(sizeof(QualCursor *) * nnegated);
+    return c;
+}
+
+/*
+ * cursor on the live postings of a term in n segments, from the dict
+ * entries of the term the caller has read, for segment merges
+ */
+QualCursor *
+openMergeCursor(IndexSegment **segs, PostingInfo *infos, int n)
+{
+    QualCursor  *c;
+    int         i;
+
+    if (n == 1)
+        return openPostingsCursor(segs[0], &infos[0]);
+    c = newCursor(CURSOR_OR, n, 0);
+    for (i = 0; i < n; i++)
+        c->children[i] = openPostingsCursor(segs[i], &infos[i]);
+    return c;
+}
+
+/*
+ * cursor on the postings of a normalized term in every segment
+ */
+static QualCursor *
+openTermCursor(char *term, IndexReader *index)
+{
+    QualCursor  *c;
+    PostingInfo info;
+    int         i;
+
+    c = newCursor(CURSOR_OR, index->nsegments, 0);
+    c->nchildren = 0;
+    for (i = 0; i < index->nsegments; i++)
+    {
+        if (lookupTerm(index->segments[i].dict, term, &info))
+            c->children[c->nchildren++] = openPostingsCursor(&index->segments[i], &info);
+    }
+
+    /* no need for an OR of a single list */
+    if (c->nchildren == 1)
+    {
+        QualCursor *child = c->children[0];
+
+        c->nchildren = 0;
+        closeQualCursor(c);
+        return child;
+    }
+    return c;
+}
+
+static QualCursor *
+openPostingsCursor(IndexSegment *seg, PostingInfo *info)
+{
+    QualCursor  *c = newCursor(CURSOR_POSTINGS, 0, 0);
+    bool        copied;
+
+    c->seg = seg;
+    c->version = seg->post->version;
+    c->ptr = loadPostings(seg->post, info, &copied);
+    c->end = c->ptr + info->len;
+    if (copied)
+        c->copy = c->ptr;
+    c->ids = (int32 *) palloc(sizeof(int32) * CURSOR_BLOCK);
+    return c;
+}
+
+/*
+ * move to the first live doc id not below target. Postings are decoded
+ * a block of CURSOR_BLOCK live doc ids at a time: a block ending below
+ * target is skipped with a single comparison, and the others are
+ * searched by galloping from the current position, so long skips do not
+ * compare every doc id.
+ */
+static void
+advancePostings(QualCursor *c, int32 target)
+{
+    for (;;)
+    {
+        if (c->pos < c->nids && c->ids[c->nids - 1] >= target)
+        {
+            c->pos = gallop(c->ids, c->pos, c->nids, target);
+            c->doc = c->ids[c->pos++];
+            return;
+        }
+        if (decodeBlock(c) == 0)
+        {
+            c->doc = CURSOR_END;
+            return;
+        }
+    }
+}
+
+/*
+ * decode the next block of live doc ids of a postings cursor, return
+ * their number, 0 at the end of the postings
+ */
+static int
+decodeBlock(QualCursor *c)
+{
+    c->nids = 0;
+    c->pos = 0;
+    while (c->nids < CURSOR_BLOCK && c->ptr < c->end)
+    {
+        int32 id;
+
+        if (c->version == POST_FORMAT_VARINT)
+        {
+            c->prev += readVarint(&c->ptr, c->end);
+            id = (int32) c->prev;
+        }
+        else
+        {
+            /* legacy text layout, a NUL terminated copy */
+            char *next;
+
+            id = (int32) strtol(c->ptr, &next, 10);
+            if (next == c->ptr)
+            {
+                c->ptr = c->end;
+                break;
+            }
+            c->ptr = next;
+        }
+        if (!IS_TOMBSTONED(c->seg, id))
+            c->ids[c->nids++] = id;
+    }
+    return c->nids;
+}
+
+/*
+ * position of the first doc id >= target in ids[lo, n), or n. Probe
+ * lo + 1, 3, 7, ... and binary search the last step, so the cost is
+ * logarithmic in the distance skipped rather than in n.
+ */
+static int
+gallop(int32 *ids, int lo, int n, int32 target)
+{
+    int hi = lo;
+    int step = 1;
+
+    while (hi < n && ids[hi] < target)
+    {
+        lo = hi + 1;
+        hi += step;
+        step <<= 1;
+    }
+    if (hi > n)
+        hi = n;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (ids[mid] < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * leapfrog the children to a doc id they are all positioned on, and
+ * that none of the negated children is positioned on
+ */
+static void
+advanceAnd(QualCursor *c, int32 target)
+{
+    int32 doc = target;
+
+    if (c->nchildren >= 2)
+    {
+        advanceAndBlocks(c, target);
+        return;
+    }
+
+    while (doc != CURSOR_END)
+    {
+        int32   next;
+        int     i;
+
+        doc = cursorAdvance(c->children[0], doc);
+        next = doc;
+        for (i = 1; i < c->nchildren && next == doc && doc != CURSOR_END; i++)
+            next = cursorAdvance(c->children[i], doc);
+        /* a child is past doc, the first catches up */
+        if (next != doc)
+        {
+            doc = next;
+            continue;
+        }
+        if (doc == CURSOR_END)
+            break;
+        for (i = 0; i < c->nnegated && next == doc; i++)
+        {
+            if (cursorAdvance(c->negated[i], doc) == doc)
+                next = doc + 1;
+        }
+        if (next == doc)
+            break;
+        doc = next;
+    }
+    c->doc = doc;
+}
+
+/*
+ * advanceAnd() for two children or more: the candidates are the doc ids
+ * of the intersection of the blocks of the first two children, checked
+ * against the other children and the negated ones
+ */
+static void
+advanceAndBlocks(QualCursor *c, int32 target)
+{
+    int32 doc = target;
+
+    for (;;)
+    {
+        int32   next;
+        int     i;
+
+        c->pos = gallop(c->ids, c->pos, c->nids, doc);
+        if (c->pos == c->nids)
+        {
+            if (!nextAndBlock(c, doc))
+            {
+                c->doc = CURSOR_END;
+                return;
+            }
+            continue;
+        }
+        doc = c->ids[c->pos];
+
+        next = doc;
+        for (i = 2; i < c->nchildren && next == doc; i++)
+            next = cursorAdvance(c->children[i], doc);
+        if (next == CURSOR_END)
+        {
+            c->doc = CURSOR_END;
+            return;
+        }
+        for (i = 0; i < c->nnegated && next == doc; i++)
+        {
+            if (cursorAdvance(c->negated[i], doc) == doc)
+                next = doc + 1;
+        }
+        if (next == doc)
+        {
+            c->doc = doc;
+            return;
+        }
+        doc = next;
+    }
+}
+
+/*
+ * intersect the blocks of the first two children of an AND into its ids
+ * until some doc id not below target is in common, false when a child
+ * ends first. A block is refilled from the first doc id left in the
+ * other one, so a child skips what the other has not, and the doc ids
+ * up to the lower last doc id of both blocks are dropped after each
+ * intersection: a doc id in common is found once.
+ */
+static bool
+nextAndBlock(QualCursor *c, int32 target)
+{
+    int32   *a = c->blocks[0];
+    int32   *b = c->blocks[1];
+
+    for (;;)
+    {
+        int32   last;
+        int     n;
+
+        c->iblocks[0] = gallop(a, c->iblocks[0], c->nblocks[0], target);
+        c->iblocks[1] = gallop(b, c->iblocks[1], c->nblocks[1], target);
+        if (c->iblocks[0] == c->nblocks[0])
+        {
+            int32 lower = (c->iblocks[1] < c->nblocks[1]) ? b[c->iblocks[1]] : target;
+
+            c->nblocks[0] = fillBlock(c->children[0], lower, a);
+            c->iblocks[0] = 0;
+            if (c->nblocks[0] == 0)
+                return FALSE;
+        }
+        if (c->iblocks[1] == c->nblocks[1])
+        {
+            c->nblocks[1] = fillBlock(c->children[1], a[c->iblocks[0]], b);
+            c->iblocks[1] = 0;
+            if (c->nblocks[1] == 0)
+                return FALSE;
+        }
+
+        n = intersectPostings(a + c->iblocks[0], c->nblocks[0] - c->iblocks[0],
+                              b + c->iblocks[1], c->nblocks[1] - c->iblocks[1], c->ids);
+        last = Min(a[c->nblocks[0] - 1], b[c->nblocks[1] - 1]);
+        c->iblocks[0] = gallop(a, c->iblocks[0], c->nblocks[0], last + 1);
+        c->iblocks[1] = gallop(b, c->iblocks[1], c->nblocks[1], last + 1);
+        c->nids = n;
+        c->pos = 0;
+        if (n > 0)
+            return TRUE;
+    }
+}
+
+/*
+ * fill buf with the next CURSOR_BLOCK doc ids at most of a cursor, from
+ * the first not below lower, and return their number. The cursor is
+ * left on the last one; the live doc ids a postings cursor has decoded
+ * are copied at once.
+ */
+static int
+fillBlock(QualCursor *c, int32 lower, int32 *buf)
+{
+    int     n = 0;
+    int32   id;
+
+    /* the doc id the cursor is on was the last one of the previous block */
+    if (c->doc == CURSOR_END)
+        return 0;
+    if (c->doc >= lower)
+        lower = c->doc + 1;
+
+    id = cursorAdvance(c, lower);
+    while (id != CURSOR_END)
+    {
+        buf[n++] = id;
+        if (c->type == CURSOR_POSTINGS)
+        {
+            int k = Min(c->nids - c->pos, CURSOR_BLOCK - n);
+
+            memcpy(buf + n, c->ids + c->pos, sizeof(int32) * k);
+            n += k;
+            c->pos += k;
+            c->doc = buf[n - 1];
+        }
+        if (n == CURSOR_BLOCK)
+            break;
+        id = cursorNext(c);
+    }
+    return n;
+}
+
+/*
+ * the smallest doc id of the children, which are kept in a min-heap by
+ * doc id: only the children below target are advanced, each re-sifted in
+ * log(nchildren) steps, so ORs of many terms cost little more than the
+ * doc ids they return. Exhausted children sink to the bottom.
+ */
+static void
+advanceOr(QualCursor *c, int32 target)
+{
+    int i;
+
+    if (c->nchildren == 0)
+    {
+        c->doc = CURSOR_END;
+        return;
+    }
+    /* first advance, a child may have been opened exhausted */
+    if (c->doc == -1)
+    {
+        for (i = c->nchildren / 2 - 1; i >= 0; i--)
+            siftDownOr(c->children, c->nchildren, i);
+    }
+    while (c->children[0]->doc < target)
+    {
+        cursorAdvance(c->children[0], target);
+        siftDownOr(c->children, c->nchildren, 0);
+    }
+    c->doc = c->children[0]->doc;
+}
+
+/*
+ * move child i of an OR down the heap until no child below it is smaller
+ */
+static void
+siftDownOr(QualCursor **heap, int n, int i)
+{
+    for (;;)
+    {
+        int         smallest = i;
+        int         left = 2 * i + 1;
+        int         right = left + 1;
+        QualCursor  *tmp;
+
+        if (left < n && heap[left]->doc < heap[smallest]->doc)
+            smallest = left;
+        if (right < n && heap[right]->doc < heap[smallest]->doc)
+            smallest = right;
+        if (smallest == i)
+            break;
+        tmp = heap[smallest];
+        heap[smallest] = heap[i];
+        heap[i] = tmp;
+        i = smallest;
+    }
+}
@@ -0,0 +1,24 @@
+/* contrib/dc_fdw/dc_fdw--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION dc_fdw UPDATE TO '1.1'" to load this file. \quit
+
+CREATE FUNCTION dc_fdw_build_index(regclass, wait boolean DEFAULT false)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION dc_fdw_index_status(regclass,
+    OUT current_generation int,
+    OUT build_generation int,
+    OUT phase text,
+    OUT pid int,
+    OUT files_total int,
+    OUT files_done int,
+    OUT bytes_done bigint,
+    OUT runs_written int,
+    OUT runs_total int,
+    OUT terms_merged int)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -0,0 +1,9 @@
+/* contrib/dc_fdw/dc_fdw--1.1--1.2.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION dc_fdw UPDATE TO '1.2'" to load this file. \quit
+
+CREATE FUNCTION dc_fdw_update_index(regclass, wait boolean DEFAULT false)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -0,0 +1,43 @@
+/* contrib/dc_fdw/dc_fdw--1.2.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION dc_fdw" to load this file. \quit
+
+CREATE FUNCTION dc_fdw_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION dc_fdw_validator(text[], oid)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER dc_fdw
+  HANDLER dc_fdw_handler
+  VALIDATOR dc_fdw_validator;
+
+CREATE FUNCTION dc_fdw_build_index(regclass, wait boolean DEFAULT false)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION dc_fdw_update_index(regclass, wait boolean DEFAULT false)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION dc_fdw_index_status(regclass,
+    OUT current_generation int,
+    OUT build_generation int,
+    OUT phase text,
+    OUT pid int,
+    OUT files_total int,
+    OUT files_done int,
+    OUT bytes_done bigint,
+    OUT runs_written int,
+    OUT runs_total int,
+    OUT terms_merged int)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -20,26 +20,55 @@
  
 #include "postgres.h"
 
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if PG_VERSION_NUM >= 90300
+#include "access/htup_details.h"
+#endif
 #include "access/reloptions.h"
+#include "access/sysattr.h"
+#include "access/xact.h"
+#if PG_VERSION_NUM >= 90600
+#include "catalog/pg_aggregate.h"
+#endif
 #include "catalog/pg_foreign_server.h"
 #include "catalog/pg_foreign_table.h"
+#include "catalog/pg_type.h"
 #include "catalog/pg_user_mapping.h"
+#include "commands/dbcommands.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
+#include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
 #include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#if PG_VERSION_NUM >= 90600
+#include "optimizer/tlist.h"
+#endif
 #include "optimizer/var.h"
+#if PG_VERSION_NUM >= 90500
+#include "postmaster/bgworker.h"
+#endif
+#include "storage/ipc.h"
+#include "storage/lock.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/typcache.h"
 
 
 #include "qual_pushdown.h"
@@ -47,6 +76,20 @@
 
 PG_MODULE_MAGIC;
 
+/* task file of an index build worker, relative to the data directory */
+#define BUILD_TASK_FILE "dc_fdw.build.%d.task"
+
+/*
+ * advisory lock taken on (database, table) around the start of an index
+ * build, in a lock space apart from the SQL advisory lock functions'
+ */
+#define BUILD_LOCK_SPACE 3
+
+/* aggregates computed from the doc ids, see dcGetForeignUpperPaths() */
+#define DC_AGG_COUNT    0
+#define DC_AGG_MIN      1
+#define DC_AGG_MAX      2
+
 /*
  * Describes the valid options for objects that use this wrapper.
  */
@@ -73,6 +116,18 @@ static struct DcFdwOption valid_options[] = {
 	{"index_method", ForeignTableRelationId},
 	/* buffer size for SPIM in MB */
 	{"buffer_size", ForeignTableRelationId},
+	/* number of background workers building the index */
+	{"index_workers", ForeignTableRelationId},
+	/* segments of similar size merged together, 0 to never merge */
+	{"merge_factor", ForeignTableRelationId},
+	/* copy the documents into the index, read from there by scans */
+	{"pack_docs", ForeignTableRelationId},
+	/* compress the documents copied into the index */
+	{"compress_docs", ForeignTableRelationId},
+	/* recheck the quals evaluated exactly by the index too */
+	{"recheck", ForeignTableRelationId},
+	/* bytes read from each document at most, 0 for all of it */
+	{"max_doc_bytes", ForeignTableRelationId},
 	
 	/* column mapping options */
 	{"id_col", ForeignTableRelationId},
@@ -87,13 +142,20 @@ static struct DcFdwOption valid_options[] = {
  */
 typedef struct DcFdwPlanState
 {
+    Oid             relid;          /* the foreign table */
 	char            *data_dir;      /* documents to read */
     char            *index_dir;     /* index to output */
     List            *mapping;       /* column mapping function */
     CollectionStats *stats;         /* collection-wise stats */
 	BlockNumber     pages;			/* estimate of collection's physical size */
 	double		    ntuples;		/* estimate of number of rows in collection */
-    List *          rlist;          /* reduced list of doc ids by quals pushdown */
+    PushableQualNode *qual_tree;    /* quals pushed down, NULL if none */
+    List            *params;        /* run time operands of the quals, fdw_exprs */
+    List            *pushed;        /* RestrictInfos pushed down */
+    List            *exact;         /* RestrictInfos not to recheck */
+    bool            need_text;      /* whether the documents are read */
+    QualCost        recheck_cost;   /* cost of the RestrictInfos rechecked */
+    Selectivity     quals_sel;      /* selectivity of the quals pushed down */
 } DcFdwPlanState;
 
 
@@ -103,25 +165,51 @@ typedef struct DcFdwPlanState
 typedef struct DcFdwExecutionState
 {
 	char            *data_dir;	/* dc to read */
+    char            *index_dir; /* index to search */
     DIR             *dir_state; /* for sequential scan only */
+    bool            need_text;  /* whether the documents are read, see scan_needs_text() */
+    int             max_doc_bytes;  /* bytes read from a document at most, 0 for all */
     AttInMetadata   *attinmeta;
     CollectionStats *stats;     /* collection-wise stats */
     int             dc_size;    /* collection size in bytes */
 	double          ntuples;	/* estimate of number of rows in file */
-    List            *rlist;     /* reduced list of doc ids by quals pushdown */
-    int             rlistptr;   /* for looping through the rList */
+    IndexReader     *index;     /* segments of the index */
+    List            *mapping;   /* column mapping */
+    PushableQualNode *quals;    /* quals pushed down, NULL if none */
+    List            *params;    /* states of the fdw_exprs */
+    PushableQualNode *bound;    /* quals with the operands of the scan */
+    QualCursor      *cursor;    /* doc ids matching the quals, NULL until read */
+    MemoryContext   scancxt;    /* bound quals and cursor of the current scan */
+    MemoryContext   tupcxt;     /* the row returned, reset for each row */
+    List            *aggs;      /* DC_AGG_* of the aggregates pushed down, NIL if none */
+    bool            aggs_done;  /* whether the row of the aggregates was returned */
     int             *mask;      /* mask for column mapping */
     int             ncols;      /* number of columns in the table */   
 } DcFdwExecutionState;
 
+/*
+ * Module load
+ */
+void _PG_init(void);
+
 /*
  * SQL functions
  */
 extern Datum dc_fdw_handler(PG_FUNCTION_ARGS);
 extern Datum dc_fdw_validator(PG_FUNCTION_ARGS);
+extern Datum dc_fdw_build_index(PG_FUNCTION_ARGS);
+extern Datum dc_fdw_update_index(PG_FUNCTION_ARGS);
+extern Datum dc_fdw_index_status(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(dc_fdw_handler);
 PG_FUNCTION_INFO_V1(dc_fdw_validator);
+PG_FUNCTION_INFO_V1(dc_fdw_build_index);
+PG_FUNCTION_INFO_V1(dc_fdw_update_index);
+PG_FUNCTION_INFO_V1(dc_fdw_index_status);
+
+#if PG_VERSION_NUM >= 90500
+extern PGDLLEXPORT void dc_fdw_build_worker_main(Datum main_arg);
+#endif
 
 /*
  * FDW callback routines
@@ -143,6 +231,12 @@ static void dcBeginForeignScan(ForeignScanState *node, int eflags);
 static TupleTableSlot *dcIterateForeignScan(ForeignScanState *node);
 static void dcReScanForeignScan(ForeignScanState *node);
 static void dcEndForeignScan(ForeignScanState *node);
+#if PG_VERSION_NUM >= 90600
+static void dcGetForeignUpperPaths(PlannerInfo *root,
+                                    UpperRelationKind stage,
+                                    RelOptInfo *input_rel,
+                                    RelOptInfo *output_rel);
+#endif
 static bool dcAnalyzeForeignTable(Relation relation, 
                                     AcquireSampleRowsFunc *func, 
                                     BlockNumber *totalpages);
@@ -155,6 +249,29 @@ static void dcGetOptions(Oid foreigntableid,
                         char **data_dir,
                         char **index_dir,
                         List **col_mapping);
+static void dcGetBuildOptions(Oid foreigntableid,
+                        char **data_dir,
+                        char **index_dir,
+                        char **index_method,
+                        int *buffer_size,
+                        int *index_workers,
+                        int *merge_factor,
+                        int *pack_docs);
+static void dcGetScanOptions(Oid foreigntableid,
+                        bool *recheck,
+                        int *max_doc_bytes);
+static bool scan_needs_text(RelOptInfo *baserel,
+                        Oid foreigntableid,
+                        List *mapping,
+                        List *clauses);
+static void start_index_build(Oid relid, bool wait, bool incremental);
+static void open_scan_cursor(ForeignScanState *node, DcFdwExecutionState *festate);
+static void close_scan_cursor(DcFdwExecutionState *festate);
+static TupleTableSlot *aggregate_scan(ForeignScanState *node, DcFdwExecutionState *festate);
+static Datum id_datum(DcFdwExecutionState *festate, int i, int32 doc_id);
+static Datum text_datum(DcFdwExecutionState *festate, int i, text *content);
+static Oid scan_table_oid(ForeignScanState *node);
+static bool is_build_running(IndexProgress *progress);
 static void estimate_size(PlannerInfo *root,
                         RelOptInfo *baserel,
                         DcFdwPlanState *fdw_private,
@@ -162,8 +279,20 @@ static void estimate_size(PlannerInfo *root,
 static void estimate_costs(PlannerInfo *root,
                         RelOptInfo *baserel,
                         DcFdwPlanState *fdw_private,
+                        double ndocs,
                         Cost *startup_cost,
                         Cost *total_cost);
+static List *id_pathkeys(PlannerInfo *root,
+                        RelOptInfo *baserel,
+                        Oid foreigntableid,
+                        List *mapping);
+#if PG_VERSION_NUM >= 90400
+static bool ec_member_matches_id(PlannerInfo *root,
+                        RelOptInfo *rel,
+                        EquivalenceClass *ec,
+                        EquivalenceMember *em,
+                        void *arg);
+#endif
 static int dc_acquire_sample_rows(Relation onerel,
                                 int elevel,
                                 HeapTuple *rows,
@@ -173,6 +302,24 @@ static int dc_acquire_sample_rows(Relation onerel,
 int dc_col_mapping_mask(Relation rel, List *mapping_list, int **mask);
 void cstring_tuple(Datum **tuple_as_array, bool **nulls, int *mask, int mask_len, List *values);
 
+/*
+ * Module load callback: define the configuration parameters
+ */
+void
+_PG_init(void)
+{
+    DefineCustomBoolVariable("dc_fdw.enable_simd",
+                             "Use SIMD instructions to intersect postings lists.",
+                             "The SIMD kernels are only used when the CPU supports them.",
+                             &dc_fdw_enable_simd,
+                             true,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+}
+
 /*
  * Foreign-data wrapper handler function: return a struct with pointers
  * to my callback routines.
@@ -195,6 +342,9 @@ dc_fdw_handler(PG_FUNCTION_ARGS)
 	fdwroutine->ReScanForeignScan = dcReScanForeignScan;
 	fdwroutine->EndForeignScan = dcEndForeignScan;
 	fdwroutine->AnalyzeForeignTable = dcAnalyzeForeignTable;
+#if PG_VERSION_NUM >= 90600
+	fdwroutine->GetForeignUpperPaths = dcGetForeignUpperPaths;
+#endif
 
 	PG_RETURN_POINTER(fdwroutine);
 }
@@ -214,6 +364,12 @@ dc_fdw_validator(PG_FUNCTION_ARGS)
     char        *index_dir = NULL;
     char        *index_method = NULL;
     char        *buffer_size = NULL;
+    char        *index_workers = NULL;
+    char        *merge_factor = NULL;
+    char        *pack_docs = NULL;
+    char        *compress_docs = NULL;
+    char        *recheck = NULL;
+    char        *max_doc_bytes = NULL;
     char        *id_col = NULL;
     char        *text_col = NULL;
 	List        *other_options = NIL;
@@ -319,6 +475,82 @@ dc_fdw_validator(PG_FUNCTION_ARGS)
 			buffer_size = defGetString(def);
 		}
 		
+		if (strcmp(def->defname, "index_workers") == 0)
+		{
+			if (index_workers)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("redundant options")));
+			if (atoi(defGetString(def)) <= 0)
+         		ereport(ERROR,
+         				(errcode(ERRCODE_SYNTAX_ERROR),
+         				errmsg("invalid index_workers options \"%s\"", defGetString(def)),
+         				errhint("index_workers needs to be a positive integer")));
+			index_workers = defGetString(def);
+		}
+		
+		if (strcmp(def->defname, "merge_factor") == 0)
+		{
+			if (merge_factor)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("redundant options")));
+			if (atoi(defGetString(def)) < 0 || atoi(defGetString(def)) == 1)
+         		ereport(ERROR,
+         				(errcode(ERRCODE_SYNTAX_ERROR),
+         				errmsg("invalid merge_factor options \"%s\"", defGetString(def)),
+         				errhint("merge_factor needs to be 0 or an integer above 1")));
+			merge_factor = defGetString(def);
+		}
+		
+		if (strcmp(def->defname, "pack_docs") == 0)
+		{
+			if (pack_docs)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("redundant options")));
+			/* complains about values other than a boolean */
+			(void) defGetBoolean(def);
+			pack_docs = defGetString(def);
+		}
+		
+		if (strcmp(def->defname, "compress_docs") == 0)
+		{
+			if (compress_docs)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("redundant options")));
+			/* complains about values other than a boolean */
+			(void) defGetBoolean(def);
+			compress_docs = defGetString(def);
+		}
+		
+		if (strcmp(def->defname, "recheck") == 0)
+		{
+			if (recheck)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("redundant options")));
+			/* complains about values other than a boolean */
+			(void) defGetBoolean(def);
+			recheck = defGetString(def);
+		}
+		
+		if (strcmp(def->defname, "max_doc_bytes") == 0)
+		{
+			if (max_doc_bytes)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("redundant options")));
+			if (strspn(defGetString(def), "0123456789") != strlen(defGetString(def)) ||
+			    atoi(defGetString(def)) < 0)
+         		ereport(ERROR,
+         				(errcode(ERRCODE_SYNTAX_ERROR),
+         				errmsg("invalid max_doc_bytes options \"%s\"", defGetString(def)),
+         				errhint("max_doc_bytes needs to be 0 or a positive integer")));
+			max_doc_bytes = defGetString(def);
+		}
+		
 		if (strcmp(def->defname, "id_col") == 0)
 		{
 			if (id_col)
@@ -366,28 +598,330 @@ dc_fdw_validator(PG_FUNCTION_ARGS)
                 errmsg("text_col is required for dc_fdw foreign tables")));
 	
 	/*
-	 * Start indexing procedures
-	 * Note that validate function is called when 
-	 *
-	 * 1. Creating ForeignServer 
-	 * 2. Creating ForeignTable
-	 * 3. Creating UserMapping
-	 *
-	 * Call the index function only when ForeignTable is being created.
+	 * The index is not built here: DDL only validates the options, and
+	 * the index is built by dc_fdw_build_index() afterwards.
 	 */
-	if (catalog == ForeignTableRelationId) {
-	    elog(NOTICE, "%s", "-Start indexing document collection, this may take a while...");
-	    if (strcmp(index_method, "SPIM") == 0)
-	    {
-	        spimIndex(data_dir, index_dir, atoi(buffer_size));
-        }
-	    else if (strcmp(index_method, "IM") == 0)
-	        imIndex(data_dir, index_dir);
-	}
 	
 	PG_RETURN_VOID();
 }
 
+/*
+ * Build a new index generation of a dc_fdw foreign table from the whole
+ * collection, in a background worker. Queries keep using the last
+ * complete generation until the build is over. With wait, return only
+ * once the build is over.
+ */
+Datum
+dc_fdw_build_index(PG_FUNCTION_ARGS)
+{
+#ifdef DEBUG
+    elog(NOTICE, "dc_fdw_build_index");
+#endif
+
+    start_index_build(PG_GETARG_OID(0), PG_GETARG_BOOL(1), FALSE);
+    PG_RETURN_VOID();
+}
+
+/*
+ * Like dc_fdw_build_index(), but only index the documents added or
+ * changed since the generation in use into a new segment, and tombstone
+ * deleted ones.
+ */
+Datum
+dc_fdw_update_index(PG_FUNCTION_ARGS)
+{
+#ifdef DEBUG
+    elog(NOTICE, "dc_fdw_update_index");
+#endif
+
+    start_index_build(PG_GETARG_OID(0), PG_GETARG_BOOL(1), TRUE);
+    PG_RETURN_VOID();
+}
+
+/*
+ * Start a build of the index of a dc_fdw foreign table, tokenizing with
+ * the text search configuration of this session.
+ *
+ * The build lock serializes the check that no build is running with the
+ * start of the new one: the progress file only names the build worker
+ * once written, so it is first written here, before the lock is released,
+ * and the worker waits for the lock before reporting its own progress.
+ */
+static void
+start_index_build(Oid relid, bool wait, bool incremental)
+{
+    char            *data_dir;
+    char            *index_dir;
+    char            *index_method;
+    int             buffer_size;
+    int             index_workers;
+    int             merge_factor;
+    int             pack_docs;
+    Oid             cfgId = getTSCurrentConfig(true);
+    StringInfoData  sidProgressPath;
+    IndexProgress   progress;
+    LOCKTAG         tag;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("Only superuser can build the index of a dc_fdw foreign table")));
+    
+    dcGetBuildOptions(relid, &data_dir, &index_dir, &index_method, &buffer_size, &index_workers, &merge_factor,
+                        &pack_docs);
+    
+    /* one build at a time */
+    SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, (uint32) relid, 0, BUILD_LOCK_SPACE);
+    if (LockAcquire(&tag, ExclusiveLock, false, true) == LOCKACQUIRE_NOT_AVAIL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_IN_USE),
+                 errmsg("index of \"%s\" is already being built", get_rel_name(relid))));
+    initStringInfo(&sidProgressPath);
+    appendStringInfo(&sidProgressPath, "%s/" PROGRESS_FILE, index_dir);
+    if (readProgress(sidProgressPath.data, &progress) && is_build_running(&progress))
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_IN_USE),
+                 errmsg("index of \"%s\" is already being built by process %d",
+                        get_rel_name(relid), progress.pid)));
+
+#if PG_VERSION_NUM < 90500
+    elog(NOTICE, "%s", "-Index builds need background workers of PostgreSQL 9.5 or later, building the index in this backend");
+    buildIndex(data_dir, index_dir, index_method, buffer_size, index_workers, cfgId, incremental,
+                merge_factor, pack_docs);
+#else
+    {
+        BackgroundWorker        worker;
+        BackgroundWorkerHandle  *handle;
+        BgwHandleStatus         status;
+        StringInfoData          sidTaskPath;
+        FILE                    *task;
+        pid_t                   pid;
+        
+        /* the worker only gets an int, the rest goes through a task file */
+        initStringInfo(&sidTaskPath);
+        appendStringInfo(&sidTaskPath, BUILD_TASK_FILE, MyProcPid);
+        task = AllocateFile(sidTaskPath.data, PG_BINARY_W);
+        if (task == NULL)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not create file \"%s\": %m", sidTaskPath.data)));
+        fprintf(task, "%u %d %u\n%s\n", relid, (int) incremental, cfgId,
+                get_database_name(MyDatabaseId));
+        if (FreeFile(task) != 0)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not write file \"%s\": %m", sidTaskPath.data)));
+        
+        MemSet(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+        worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+        worker.bgw_restart_time = BGW_NEVER_RESTART;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "dc_fdw");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "dc_fdw_build_worker_main");
+        snprintf(worker.bgw_name, BGW_MAXLEN, "dc_fdw index build of %u", relid);
+        worker.bgw_main_arg = Int32GetDatum(MyProcPid);
+        worker.bgw_notify_pid = MyProcPid;
+        
+        if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+        {
+            remove(sidTaskPath.data);
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                     errmsg("could not register background worker for the index build"),
+                     errhint("You may need to increase max_worker_processes.")));
+        }
+        status = WaitForBackgroundWorkerStartup(handle, &pid);
+        if (status != BGWH_STARTED)
+        {
+            remove(sidTaskPath.data);
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                     errmsg("could not start background worker for the index build")));
+        }
+        
+        /* the build is running from now on, let the worker report it */
+        MemSet(&progress, 0, sizeof(progress));
+        strlcpy(progress.phase, "starting", sizeof(progress.phase));
+        progress.pid = pid;
+        writeProgress(sidProgressPath.data, &progress);
+        LockRelease(&tag, ExclusiveLock, false);
+        
+        if (wait)
+        {
+            if (WaitForBackgroundWorkerShutdown(handle) == BGWH_POSTMASTER_DIED)
+                ereport(ERROR,
+                        (errcode(ERRCODE_ADMIN_SHUTDOWN),
+                         errmsg("postmaster died during the index build of \"%s\"",
+                                get_rel_name(relid))));
+            if (!readProgress(sidProgressPath.data, &progress) ||
+                strcmp(progress.phase, "done") != 0)
+                ereport(ERROR,
+                        (errmsg("index build of \"%s\" failed, see the server log",
+                                get_rel_name(relid))));
+        }
+    }
+#endif
+}
+
+/*
+ * Report the index generation in use and the progress of the last
+ * index build of a dc_fdw foreign table
+ */
+Datum
+dc_fdw_index_status(PG_FUNCTION_ARGS)
+{
+    Oid             relid = PG_GETARG_OID(0);
+    char            *data_dir;
+    char            *index_dir;
+    List            *col_mapping;
+    TupleDesc       tupdesc;
+    Datum           values[10];
+    bool            nulls[10];
+    StringInfoData  sidPath;
+    IndexProgress   progress;
+
+#ifdef DEBUG
+    elog(NOTICE, "dc_fdw_index_status");
+#endif
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupdesc = BlessTupleDesc(tupdesc);
+    
+    dcGetOptions(relid, &data_dir, &index_dir, &col_mapping);
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/" PROGRESS_FILE, index_dir);
+    if (!readProgress(sidPath.data, &progress))
+    {
+        MemSet(&progress, 0, sizeof(progress));
+        strlcpy(progress.phase, "none", sizeof(progress.phase));
+    }
+    else if (strcmp(progress.phase, "done") != 0 && strcmp(progress.phase, "failed") != 0)
+    {
+        if (!is_build_running(&progress))
+            /* the build died without recording it */
+            strlcpy(progress.phase, "failed", sizeof(progress.phase));
+        else if (strcmp(progress.phase, "tokenizing") == 0)
+        {
+            /* add up the progress of the index workers */
+            DIR             *dir;
+            struct dirent   *dirent;
+            
+            resetStringInfo(&sidPath);
+            appendStringInfo(&sidPath, "%s/g%d", index_dir, progress.generation);
+            dir = AllocateDir(sidPath.data);
+            while (dir != NULL && (dirent = ReadDir(dir, sidPath.data)) != NULL)
+            {
+                StringInfoData  sidWorkerPath;
+                IndexProgress   wprogress;
+                int             len = strlen(dirent->d_name);
+                
+                if (dirent->d_name[0] != 'w' || len <= strlen("." PROGRESS_FILE) ||
+                    strcmp(dirent->d_name + len - strlen("." PROGRESS_FILE), "." PROGRESS_FILE) != 0)
+                    continue;
+                initStringInfo(&sidWorkerPath);
+                appendStringInfo(&sidWorkerPath, "%s/%s", sidPath.data, dirent->d_name);
+                if (readProgress(sidWorkerPath.data, &wprogress))
+                {
+                    progress.filesDone += wprogress.filesDone;
+                    progress.bytesDone += wprogress.bytesDone;
+                    progress.runsWritten += wprogress.runsWritten;
+                }
+                pfree(sidWorkerPath.data);
+            }
+            if (dir != NULL)
+                FreeDir(dir);
+        }
+    }
+    
+    MemSet(nulls, 0, sizeof(nulls));
+    values[0] = Int32GetDatum(currentGeneration(index_dir));
+    values[1] = Int32GetDatum(progress.generation);
+    values[2] = CStringGetTextDatum(progress.phase);
+    values[3] = Int32GetDatum(progress.pid);
+    values[4] = Int32GetDatum(progress.filesTotal);
+    values[5] = Int32GetDatum(progress.filesDone);
+    values[6] = Int64GetDatum(progress.bytesDone);
+    values[7] = Int32GetDatum(progress.runsWritten);
+    values[8] = Int32GetDatum(progress.runsTotal);
+    values[9] = Int32GetDatum(progress.termsMerged);
+    nulls[1] = nulls[3] = (progress.generation == 0);
+    
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+#if PG_VERSION_NUM >= 90500
+/*
+ * Entry point of an index build worker. The main argument is the pid of
+ * the backend which started the build, naming the task file.
+ */
+void
+dc_fdw_build_worker_main(Datum main_arg)
+{
+    char            taskpath[MAXPGPATH];
+    char            dbname[NAMEDATALEN + 1];
+    FILE            *task;
+    unsigned int    relid;
+    int             incremental;
+    unsigned int    cfgId;
+    char            *data_dir;
+    char            *index_dir;
+    char            *index_method;
+    int             buffer_size;
+    int             index_workers;
+    int             merge_factor;
+    int             pack_docs;
+    int             len;
+    LOCKTAG         tag;
+    
+    BackgroundWorkerUnblockSignals();
+    
+    snprintf(taskpath, MAXPGPATH, BUILD_TASK_FILE, DatumGetInt32(main_arg));
+    task = AllocateFile(taskpath, PG_BINARY_R);
+    if (task == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\": %m", taskpath)));
+    if (fscanf(task, "%u %d %u\n", &relid, &incremental, &cfgId) != 3 ||
+        fgets(dbname, sizeof(dbname), task) == NULL)
+        elog(ERROR, "Index build task file \"%s\" corrupted!", taskpath);
+    FreeFile(task);
+    remove(taskpath);
+    len = strlen(dbname);
+    if (len > 0 && dbname[len - 1] == '\n')
+        dbname[len - 1] = '\0';
+    
+    BackgroundWorkerInitializeConnection(dbname, NULL);
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    
+    /* until the backend starting the build has recorded it */
+    SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, relid, 0, BUILD_LOCK_SPACE);
+    LockAcquire(&tag, ExclusiveLock, false, false);
+    
+    dcGetBuildOptions((Oid) relid, &data_dir, &index_dir, &index_method, &buffer_size, &index_workers, &merge_factor,
+                        &pack_docs);
+    elog(LOG, "dc_fdw: building index of \"%s\" into %s", get_rel_name((Oid) relid), index_dir);
+    buildIndex(data_dir, index_dir, index_method, buffer_size, index_workers, (Oid) cfgId,
+                (bool) incremental, merge_factor, pack_docs);
+    
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    proc_exit(0);
+}
+#endif
+
+/*
+ * Whether the build a progress file belongs to is still going on
+ */
+static bool
+is_build_running(IndexProgress *progress)
+{
+    if (strcmp(progress->phase, "done") == 0 || strcmp(progress->phase, "failed") == 0)
+        return false;
+    return (kill(progress->pid, 0) == 0);
+}
+
 /*
  * Check if the provided option is one of the valid options.
  * context is the Oid of the catalog holding the object the option is for.
@@ -509,6 +1043,90 @@ dcGetOptions(Oid foreigntableid,
 }
 
 
+/*
+ * Fetch the options needed to build the index of a dc_fdw foreign table.
+ */
+static void
+dcGetBuildOptions(Oid foreigntableid,
+                char **data_dir, char **index_dir, char **index_method,
+                int *buffer_size, int *index_workers, int *merge_factor, int *pack_docs)
+{
+	ForeignTable        *table;
+	ListCell            *lc;
+	bool                compress_docs = false;
+
+#ifdef DEBUG
+    elog(NOTICE, "dcGetBuildOptions");
+#endif
+
+	table = GetForeignTable(foreigntableid);
+	
+	*data_dir = NULL;
+    *index_dir = NULL;
+    *index_method = NULL;
+    *buffer_size = 0;
+    *index_workers = 1;
+    *merge_factor = DEFAULT_MERGE_FACTOR;
+    *pack_docs = DOCS_NOT_PACKED;
+	foreach(lc, table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+		
+		if (strcmp(def->defname, "data_dir") == 0)
+			*data_dir = defGetString(def);
+		else if (strcmp(def->defname, "index_dir") == 0)
+			*index_dir = defGetString(def);
+		else if (strcmp(def->defname, "index_method") == 0)
+			*index_method = defGetString(def);
+		else if (strcmp(def->defname, "buffer_size") == 0)
+			*buffer_size = atoi(defGetString(def));
+		else if (strcmp(def->defname, "index_workers") == 0)
+			*index_workers = atoi(defGetString(def));
+		else if (strcmp(def->defname, "merge_factor") == 0)
+			*merge_factor = atoi(defGetString(def));
+		else if (strcmp(def->defname, "pack_docs") == 0)
+			*pack_docs = defGetBoolean(def) ? DOCS_PACKED : DOCS_NOT_PACKED;
+		else if (strcmp(def->defname, "compress_docs") == 0)
+			compress_docs = defGetBoolean(def);
+	}
+	if (*pack_docs == DOCS_PACKED && compress_docs)
+	    *pack_docs = DOCS_COMPRESSED;
+	
+	/* the validator should have checked these, but check again */
+	if (*data_dir == NULL)
+		elog(ERROR, "data_dir is required for dc_fdw foreign tables");
+	if (*index_dir == NULL)
+		elog(ERROR, "index_dir is required for dc_fdw foreign tables");
+	if (*index_method == NULL)
+		elog(ERROR, "index_method is required for dc_fdw foreign tables");
+}
+
+
+/*
+ * Fetch the options of a dc_fdw foreign table used by its scans.
+ */
+static void
+dcGetScanOptions(Oid foreigntableid, bool *recheck, int *max_doc_bytes)
+{
+	ForeignTable        *table;
+	ListCell            *lc;
+
+	table = GetForeignTable(foreigntableid);
+	
+	*recheck = false;
+	*max_doc_bytes = 0;
+	foreach(lc, table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+		
+		if (strcmp(def->defname, "recheck") == 0)
+			*recheck = defGetBoolean(def);
+		else if (strcmp(def->defname, "max_doc_bytes") == 0)
+			*max_doc_bytes = atoi(defGetString(def));
+	}
+}
+
+
 /*
  * dcGetForeignRelSize
  *		Obtain relation size estimates for a foreign table
@@ -521,15 +1139,14 @@ dcGetForeignRelSize(PlannerInfo *root,
 	DcFdwPlanState      *fpstate;
     /* File handles */
     File                statFile;
-    File                dictFile;
-    File                postFile;
     /* stat info */
     CollectionStats     *stats;
-    /* dict settings */
-    HTAB                *dict;
+    /* segments of the index */
+    IndexReader         *index;
     /* qual eval */
     PushableQualNode    *qualRoot;
-    List                *allList;
+    bool                recheck;
+    int                 max_doc_bytes;
     
 #ifdef DEBUG
     elog(NOTICE, "dcGetForeignRelSize");
@@ -554,56 +1171,68 @@ dcGetForeignRelSize(PlannerInfo *root,
     /*
      * Fetch collection-wise stats
      */
-    statFile = openStat(fpstate->index_dir);
+    statFile = openStat(currentIndexPath(fpstate->index_dir));
     loadStat(&stats, statFile);
     closeStat(statFile);
     fpstate->stats = stats;
-
-    /*
-     * fill in dc size information
-     */
-	estimate_size(root, baserel, fpstate, stats);
-
-	/*
-	 * Load Dictionary. Dict is stored in memory for fast access and
-	 * postings lists are in hard disk as it may be too large to fit
-	 * into main memory.
-	 */
-    dictFile = openDict(fpstate->index_dir);
-	loadDict(&dict, dictFile);
-    closeDict(dictFile);
+    fpstate->relid = foreigntableid;
 
     /*
      * Extract Quals. We only extract quals that we can push down and 
  	 * convert them into a tree structure for evaluation.
  	 *
-     * Evaluate QualTree. Filtered doc_id list. 
+     * The tree is kept in the plan and evaluated by the scan, a doc id
+     * at a time. Here the matches are only estimated from the document
+     * frequencies in the dictionaries: only the block index of each
+     * dict is loaded into memory and no postings are read.
 	 */
-	postFile = openPost(fpstate->index_dir);
-    allList = searchTerm(ALL, dict, postFile, TRUE, FALSE);
-
 	/* no quals to push down */
-	if (extractQuals(&qualRoot, root, baserel, fpstate->mapping) == 0)
+	if (extractQuals(&qualRoot, root, baserel, fpstate->mapping,
+	                    &fpstate->pushed, &fpstate->exact) == 0)
 	{
 #ifdef DEBUG
         elog(NOTICE, "No quals to pushdown, sequential scan");
 #endif
-        fpstate->rlist = allList;
+        fpstate->qual_tree = NULL;
+        fpstate->params = NIL;
+        fpstate->quals_sel = 1.0;
     }
     /* there are quals available to pushdown */
     else
     {
-        fpstate->rlist = evalQualTree(qualRoot, dict, postFile, allList);
+        fpstate->params = extractQualParams(qualRoot, NIL);
+        index = openIndex(fpstate->index_dir);
+        estimateQualTree(qualRoot, index, stats->numOfDocs);
+        fpstate->quals_sel = qualTreeSelectivity(qualRoot, stats->numOfDocs);
+        closeIndex(index);
 #ifdef DEBUG
         printQualTree(qualRoot, 1);
 #endif
-        freeQualTree(qualRoot);
+        fpstate->qual_tree = qualRoot;
     }
 
-#ifdef DEBUG
-    elog(NOTICE, "rlist length:%d", list_length(fpstate->rlist));
-#endif
-    closePost(postFile);
+    /*
+     * The quals the index evaluates exactly as PostgreSQL does are not
+     * rechecked on the rows returned, unless the table asks for it or
+     * the session does not use the text search configuration the index
+     * was built with: query terms would not be normalized as the
+     * documents were. An index that did not record it is rechecked too.
+     */
+    dcGetScanOptions(foreigntableid, &recheck, &max_doc_bytes);
+    if (recheck || !OidIsValid(stats->cfgId) || stats->cfgId != getTSCurrentConfig(true))
+        fpstate->exact = NIL;
+    cost_qual_eval(&fpstate->recheck_cost,
+                   list_difference_ptr(baserel->baserestrictinfo, fpstate->exact),
+                   root);
+    fpstate->need_text = scan_needs_text(baserel, foreigntableid, fpstate->mapping,
+                                         extract_actual_clauses(list_difference_ptr(baserel->baserestrictinfo,
+                                                                                    fpstate->exact),
+                                                                false));
+
+    /*
+     * fill in dc size information
+     */
+	estimate_size(root, baserel, fpstate, stats);
 }
 
 
@@ -612,9 +1241,10 @@ dcGetForeignRelSize(PlannerInfo *root,
  * dcGetForeignPaths
  *		Create possible access paths for a scan on the foreign table
  *
- *		Currently we don't support any push-down feature, so there is only one
- *		possible access path, which simply returns all records in the order in
- *		the data file.
+ *		The plain path returns the docs matching the quals pushed down. For
+ *		nested loop joins, parameterized paths also push down a join clause
+ *		on id_col or text_col, whose operand is given by each outer row.
+ *		Every path returns the docs in ascending doc id order.
  */
 static void
 dcGetForeignPaths(PlannerInfo *root,
@@ -625,29 +1255,101 @@ dcGetForeignPaths(PlannerInfo *root,
     ForeignPath     *path;
 	Cost            startup_cost;
 	Cost            total_cost;
-	List            *fdw_private;
+	List            *pathkeys;
+#if PG_VERSION_NUM >= 90400
+	List            *join_clauses = NIL;
+	AttrNumber      idattno;
+	ListCell        *lc;
+#endif
 
 #ifdef DEBUG
     elog(NOTICE, "dcGetForeignPaths");
 #endif
 
 	/* Estimate costs */
-	estimate_costs(root, baserel, fpstate,
+	estimate_costs(root, baserel, fpstate, fpstate->ntuples,
 				   &startup_cost, &total_cost);
 	
-	/* result list after pushing down. */
-	fdw_private = lappend(NIL, fpstate->rlist);
-	fdw_private = lappend(fdw_private, fpstate->stats);
-	
-	/* Create a ForeignPath node and add it as only possible path */
+	/* doc ids come out of the cursors in ascending order */
+	pathkeys = id_pathkeys(root, baserel, foreigntableid, fpstate->mapping);
+
+	/* the quals are put in the plan by dcGetForeignPlan() */
 	path = create_foreignscan_path(root, baserel,
 								    baserel->rows,
 									startup_cost,
 									total_cost,
-									NIL,		/* no pathkeys */
+									pathkeys,
 									NULL,		/* no outer rel either */
-									fdw_private);
+									NIL);
 	add_path(baserel, (Path *) path);
+
+#if PG_VERSION_NUM >= 90400
+	/*
+	 * Join clauses that can be evaluated with the index once the outer
+	 * rel gives their operand: "id_col = outer" and "text_col @@ outer".
+	 * Equalities on id_col implied by equivalence classes are not in
+	 * joininfo, they are generated.
+	 */
+	foreach(lc, baserel->joininfo)
+	{
+	    RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+#if PG_VERSION_NUM >= 90500
+	    if (join_clause_is_movable_to(rinfo, baserel))
+#else
+	    if (join_clause_is_movable_to(rinfo, baserel->relid))
+#endif
+	        join_clauses = lappend(join_clauses, rinfo);
+	}
+	idattno = get_attnum(foreigntableid, (char *) list_nth(fpstate->mapping, 0));
+	if (idattno != InvalidAttrNumber)
+	    join_clauses = list_concat(join_clauses,
+	                               generate_implied_equalities_for_column(root, baserel,
+	                                                    ec_member_matches_id,
+	                                                    (void *) &idattno,
+	                                                    baserel->lateral_referencers));
+
+	foreach(lc, join_clauses)
+	{
+	    RestrictInfo        *rinfo = (RestrictInfo *) lfirst(lc);
+	    PushableQualNode    *qual;
+	    Relids              required_outer;
+	    double              rows;
+
+	    qual = extractJoinQual(rinfo, root, baserel, fpstate->mapping);
+	    if (qual == NULL)
+	        continue;
+	    required_outer = bms_union(rinfo->clause_relids, baserel->lateral_relids);
+	    required_outer = bms_del_member(required_outer, baserel->relid);
+	    if (bms_is_empty(required_outer))
+	    {
+	        freeQualTree(qual);
+	        continue;
+	    }
+
+	    /*
+	     * A doc id matches one doc at most, a query is given the default
+	     * selectivity of the operands not known at plan time, neither
+	     * needs the dictionaries. Only the docs matched are read at each
+	     * rescan.
+	     */
+	    estimateQualTree(qual, NULL, fpstate->stats->numOfDocs);
+	    rows = clamp_row_est(baserel->rows *
+	                         qualTreeSelectivity(qual, fpstate->stats->numOfDocs));
+	    freeQualTree(qual);
+
+	    estimate_costs(root, baserel, fpstate, rows,
+	                   &startup_cost, &total_cost);
+	    path = create_foreignscan_path(root, baserel,
+	                                    rows,
+	                                    startup_cost,
+	                                    total_cost,
+	                                    pathkeys,
+	                                    required_outer,
+	                                    NIL);
+	    add_path(baserel, (Path *) path);
+	}
+#endif
 }
 
 /*
@@ -665,33 +1367,187 @@ dcGetForeignPlan(PlannerInfo *root,
     DcFdwPlanState  *fpstate = (DcFdwPlanState *) baserel->fdw_private;
 	Index scan_relid = baserel->relid;
 	List *fdw_private;
+	PushableQualNode *quals = fpstate->qual_tree;
+	List *params = list_copy(fpstate->params);
+	List *joinQuals = NIL;
+	ListCell *lc;
 	
 #ifdef DEBUG
     elog(NOTICE, "dcGetForeignPlan");
 #endif
 
-    /* result list after pushing down. */
-	fdw_private = lappend(NIL, fpstate->rlist);
+#if PG_VERSION_NUM >= 90600
+    /*
+     * aggregates pushed down: no relation is scanned, the scan returns
+     * the row of the aggregates described by fdw_scan_tlist
+     */
+    if (baserel->reloptkind == RELOPT_UPPER_REL)
+    {
+        fdw_private = lappend(NIL, makeString(serializeQualTree(quals)));
+        fdw_private = lappend(fdw_private, fpstate->stats);
+        fdw_private = lappend(fdw_private, makeInteger(FALSE));
+        fdw_private = lappend(fdw_private, best_path->fdw_private);
+        fdw_private = lappend(fdw_private, makeInteger((long) fpstate->relid));
+        return make_foreignscan(tlist,
+                                NIL,
+                                0,
+                                NIL,
+                                fdw_private,
+                                add_to_flat_tlist(NIL, best_path->path.pathtarget->exprs),
+                                NIL,
+                                NULL);
+    }
+#endif
+
+    /*
+     * join clauses of a parameterized path, their outer operands are
+     * evaluated at each rescan like any other param
+     */
+    if (best_path->path.param_info != NULL)
+    {
+        foreach(lc, best_path->path.param_info->ppi_clauses)
+        {
+            PushableQualNode *qual = extractJoinQual((RestrictInfo *) lfirst(lc),
+                                                     root, baserel, fpstate->mapping);
+
+            if (qual == NULL)
+                continue;
+            params = extractQualParams(qual, params);
+            joinQuals = lappend(joinQuals, qual);
+        }
+    }
+    if (joinQuals != NIL)
+    {
+        PushableQualNode *andNode = (PushableQualNode *) palloc0(sizeof(PushableQualNode));
+
+        initStringInfo(&andNode->optype);
+        appendStringInfoString(&andNode->optype, "bool_node");
+        initStringInfo(&andNode->opname);
+        appendStringInfoString(&andNode->opname, "AND");
+        initStringInfo(&andNode->leftOperand);
+        initStringInfo(&andNode->rightOperand);
+        andNode->childNodes = (quals != NULL) ? lcons(quals, joinQuals) : joinQuals;
+        quals = andNode;
+    }
+
+    /* quals to push down. */
+	fdw_private = lappend(NIL, makeString(serializeQualTree(quals)));
 	fdw_private = lappend(fdw_private, fpstate->stats);
 	
 	/*
-	 * We have no native ability to evaluate restriction clauses, so we just
-	 * put all the scan_clauses into the plan node's qual list for the
-	 * executor to check.  So all we have to do here is strip RestrictInfo
+	 * The clauses the index evaluates exactly are left out of the plan
+	 * node's qual list, the others are put in for the executor to check:
+	 * the ones not pushed down, pushed down partly, or with operands known
+	 * at run time only. So all we have to do here is strip RestrictInfo
 	 * nodes from the clauses and ignore pseudoconstants (which will be
 	 * handled elsewhere).
 	 */
+	scan_clauses = list_difference_ptr(scan_clauses, fpstate->exact);
 	scan_clauses = extract_actual_clauses(scan_clauses, false);
 
+	/* whether the documents are read, with the join clauses rechecked */
+	fdw_private = lappend(fdw_private,
+						  makeInteger(scan_needs_text(baserel, foreigntableid,
+													  fpstate->mapping, scan_clauses)));
+
 	/* Create the ForeignScan node */
 	return make_foreignscan(tlist,
 							scan_clauses,
 							scan_relid,
-							NIL,	/* no expressions to evaluate */
+							params,
 							fdw_private);
 }
 
 
+#if PG_VERSION_NUM >= 90600
+/*
+ * dcGetForeignUpperPaths
+ *		Add a path computing the aggregates of a query from the doc ids
+ *
+ *		count(*), count(id_col), min(id_col) and max(id_col) without GROUP
+ *		BY are computed while the cursor runs through the doc ids matching
+ *		the quals, without reading any document. The index must evaluate
+ *		every qual of the table exactly, none is left to recheck.
+ */
+static void
+dcGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
+						RelOptInfo *input_rel, RelOptInfo *output_rel)
+{
+	DcFdwPlanState  *fpstate = (DcFdwPlanState *) input_rel->fdw_private;
+	Query           *parse = root->parse;
+	PathTarget      *target = root->upper_targets[UPPERREL_GROUP_AGG];
+	List            *aggs = NIL;
+	AttrNumber      idattno;
+	Oid             idtype;
+	ListCell        *lc;
+	ForeignPath     *path;
+	Cost            total_cost;
+
+#ifdef DEBUG
+    elog(NOTICE, "dcGetForeignUpperPaths");
+#endif
+
+	if (stage != UPPERREL_GROUP_AGG || input_rel->reloptkind != RELOPT_BASEREL ||
+		fpstate == NULL || output_rel->fdw_private != NULL)
+		return;
+	if (parse->groupClause != NIL || parse->groupingSets != NIL || parse->havingQual != NULL)
+		return;
+	if (list_length(fpstate->exact) != list_length(input_rel->baserestrictinfo))
+		return;
+
+	idattno = get_attnum(fpstate->relid, (char *) list_nth(fpstate->mapping, 0));
+	idtype = get_atttype(fpstate->relid, idattno);
+	foreach(lc, target->exprs)
+	{
+		Aggref  *aggref = (Aggref *) lfirst(lc);
+		Var     *var = NULL;
+		char    *aggname;
+
+		if (!IsA(aggref, Aggref) || aggref->aggdistinct != NIL || aggref->aggorder != NIL ||
+			aggref->aggfilter != NULL || aggref->aggkind != AGGKIND_NORMAL ||
+			aggref->aggsplit != AGGSPLIT_SIMPLE ||
+			strcmp(get_namespace_name(get_func_namespace(aggref->aggfnoid)), "pg_catalog") != 0)
+			return;
+		if (list_length(aggref->args) == 1)
+		{
+			var = (Var *) ((TargetEntry *) linitial(aggref->args))->expr;
+			if (!IsA(var, Var) || var->varno != input_rel->relid || var->varattno != idattno)
+				return;
+		}
+		else if (aggref->args != NIL)
+			return;
+
+		/* doc ids only sort as an integer id column does */
+		aggname = get_func_name(aggref->aggfnoid);
+		if (strcmp(aggname, "count") == 0)
+			aggs = lappend_int(aggs, DC_AGG_COUNT);
+		else if (var != NULL && (idtype == INT2OID || idtype == INT4OID || idtype == INT8OID) &&
+				 strcmp(aggname, "min") == 0)
+			aggs = lappend_int(aggs, DC_AGG_MIN);
+		else if (var != NULL && (idtype == INT2OID || idtype == INT4OID || idtype == INT8OID) &&
+				 strcmp(aggname, "max") == 0)
+			aggs = lappend_int(aggs, DC_AGG_MAX);
+		else
+			return;
+	}
+
+	/* the postings of the matches are decoded, nothing else is read */
+	total_cost = cpu_operator_cost * input_rel->rows + cpu_tuple_cost;
+
+	/* dcGetForeignPlan() finds the quals in the plan state of the table */
+	output_rel->fdw_private = fpstate;
+	path = create_foreignscan_path(root, output_rel, target,
+								   1,
+								   total_cost,
+								   total_cost,
+								   NIL,		/* no pathkeys */
+								   NULL,	/* no outer rel */
+								   NULL,	/* no outer path */
+								   aggs);
+	add_path(output_rel, (Path *) path);
+}
+#endif
+
 /*
  * dcExplainForeignScan
  *		Produce extra output for EXPLAIN
@@ -703,6 +1559,7 @@ dcExplainForeignScan(ForeignScanState *node, ExplainState *es)
     char            *index_dir;
 	List            *col_mapping;
     CollectionStats *stats;
+    PushableQualNode *quals;
 
 #ifdef DEBUG
     elog(NOTICE, "dcExplainForeignScan");
@@ -711,13 +1568,40 @@ dcExplainForeignScan(ForeignScanState *node, ExplainState *es)
     /* retrieve stats list */
     stats = (CollectionStats *) list_nth( (List *) ((ForeignScan *) node->ss.ps.plan)->fdw_private, 1);
 	/* Fetch options --- we only need data_dir at this point */
-	dcGetOptions(RelationGetRelid(node->ss.ss_currentRelation),
+	dcGetOptions(scan_table_oid(node),
 				   &data_dir, &index_dir, &col_mapping);
 				   
 	ExplainPropertyText("Foreign Document Collection", data_dir, es);
 	ExplainPropertyLong("Foreign Document Collection Size", (long) stats->numOfBytes, es);
 	ExplainPropertyLong("Number of Documents", (long) stats->numOfDocs, es);
 	ExplainPropertyText("Index Location", index_dir, es);
+	
+	/* quals evaluated with the index */
+	quals = deserializeQualTree(strVal(list_nth( (List *) ((ForeignScan *) node->ss.ps.plan)->fdw_private, 0)),
+	                            col_mapping);
+	if (quals != NULL)
+	    ExplainPropertyText("Pushed Query",
+	                        qualTreeToString(quals, ((ForeignScan *) node->ss.ps.plan)->fdw_exprs), es);
+	
+	/* aggregates computed from the doc ids */
+	if (list_length(((ForeignScan *) node->ss.ps.plan)->fdw_private) > 3)
+	{
+	    StringInfoData  aggs;
+	    ListCell        *lc;
+	    
+	    initStringInfo(&aggs);
+	    foreach(lc, (List *) list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private, 3))
+	    {
+	        if (aggs.len > 0)
+	            appendStringInfoString(&aggs, ", ");
+	        if (lfirst_int(lc) == DC_AGG_COUNT)
+	            appendStringInfoString(&aggs, "count(*)");
+	        else
+	            appendStringInfo(&aggs, "%s(%s)", (lfirst_int(lc) == DC_AGG_MIN) ? "min" : "max",
+	                             (char *) list_nth(col_mapping, 0));
+	    }
+	    ExplainPropertyText("Pushed Aggregates", aggs.data, es);
+	}
 }
 
 /*
@@ -732,8 +1616,10 @@ dcBeginForeignScan(ForeignScanState *node, int eflags)
 	DcFdwExecutionState *festate;
     int         *mask;
     List        *mappingList;
+    char        *quals;
     int         numOfColumns;
     Relation    rel;
+    bool        recheck;
 
 #ifdef DEBUG
     elog(NOTICE, "dcBeginForeignScan");
@@ -745,9 +1631,9 @@ dcBeginForeignScan(ForeignScanState *node, int eflags)
 		return;
 
 	/* Fetch options of foreign table */
-	dcGetOptions(RelationGetRelid(node->ss.ss_currentRelation),
+	dcGetOptions(scan_table_oid(node),
 				   &data_dir, &index_dir, &mappingList);
-	rel = heap_open(RelationGetRelid(node->ss.ss_currentRelation), AccessShareLock);
+	rel = heap_open(scan_table_oid(node), AccessShareLock);
     numOfColumns = dc_col_mapping_mask(rel, mappingList, &mask);
     heap_close(rel, NoLock);
     
@@ -756,15 +1642,56 @@ dcBeginForeignScan(ForeignScanState *node, int eflags)
 	 * BeginCopyFrom() again.
 	 */
 	festate = (DcFdwExecutionState *) palloc(sizeof(DcFdwExecutionState));
-	festate->rlist = (List *) list_nth( (List *) ((ForeignScan *) node->ss.ps.plan)->fdw_private, 0);
+	quals = strVal(list_nth( (List *) ((ForeignScan *) node->ss.ps.plan)->fdw_private, 0));
 	festate->stats = (CollectionStats *) list_nth( (List *) ((ForeignScan *) node->ss.ps.plan)->fdw_private, 1);
-    festate->rlistptr = 0;
 	festate->data_dir = data_dir;
-	festate->dir_state = AllocateDir(data_dir);
+	festate->index_dir = index_dir;
+	festate->need_text = intVal(list_nth( (List *) ((ForeignScan *) node->ss.ps.plan)->fdw_private, 2));
+	festate->dir_state = festate->need_text ? AllocateDir(data_dir) : NULL;
+	dcGetScanOptions(scan_table_oid(node), &recheck, &festate->max_doc_bytes);
 	festate->mask = mask;
     festate->ncols = numOfColumns;
+    /* the row of the aggregates pushed down, if any, is all a scan returns */
+    if (list_length(((ForeignScan *) node->ss.ps.plan)->fdw_private) > 3)
+        festate->aggs = (List *) list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private, 3);
+    else
+        festate->aggs = NIL;
+    festate->aggs_done = FALSE;
 	/* Store the additional state info */
-    festate->attinmeta = TupleDescGetAttInMetadata(node->ss.ss_currentRelation->rd_att);
+    festate->attinmeta = (festate->aggs == NIL) ?
+        TupleDescGetAttInMetadata(node->ss.ss_currentRelation->rd_att) : NULL;
+    
+    /*
+     * Open the segments of the index. Only the block index of each dict
+     * is loaded into memory, terms are looked up in the dict files on
+     * demand, and postings lists are decoded as the scan advances.
+     */
+    festate->index = openIndex(index_dir);
+    festate->mapping = mappingList;
+    festate->quals = deserializeQualTree(quals, mappingList);
+#if PG_VERSION_NUM >= 100000
+    festate->params = ExecInitExprList(((ForeignScan *) node->ss.ps.plan)->fdw_exprs,
+                                        (PlanState *) node);
+#else
+    festate->params = (List *) ExecInitExpr((Expr *) ((ForeignScan *) node->ss.ps.plan)->fdw_exprs,
+                                            (PlanState *) node);
+#endif
+    /*
+     * The cursor is opened by the first read: the params of a nested loop
+     * are only set once the outer plan has returned a row.
+     */
+    festate->cursor = NULL;
+    festate->bound = NULL;
+    festate->scancxt = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+                                             "dc_fdw scan",
+                                             ALLOCSET_DEFAULT_MINSIZE,
+                                             ALLOCSET_DEFAULT_INITSIZE,
+                                             ALLOCSET_DEFAULT_MAXSIZE);
+    festate->tupcxt = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+                                            "dc_fdw tuple",
+                                            ALLOCSET_DEFAULT_MINSIZE,
+                                            ALLOCSET_DEFAULT_INITSIZE,
+                                            ALLOCSET_DEFAULT_MAXSIZE);
     
 	node->fdw_state = (void *) festate;
 }
@@ -779,70 +1706,132 @@ dcIterateForeignScan(ForeignScanState *node)
 {
 	DcFdwExecutionState *festate = (DcFdwExecutionState *) node->fdw_state;
 	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
-    List *tupleItemList;
-    bool end_of_list = FALSE;
-    Datum *values;
-    bool *nulls;
+    MemoryContext oldcontext;
+    int32 doc_id;
 
 #ifdef DEBUG
     elog(NOTICE, "dcIterateForeignScan");
 #endif
     
-    if (list_length(festate->rlist) > festate->rlistptr)
+    /*
+     * The previous row, its document and the params evaluated to open the
+     * cursor are freed, so memory does not grow with the rows returned.
+     */
+    MemoryContextReset(festate->tupcxt);
+    oldcontext = MemoryContextSwitchTo(festate->tupcxt);
+    
+    if (festate->cursor == NULL)
+        open_scan_cursor(node, festate);
+    if (festate->aggs != NIL)
     {
-        StringInfoData sidDocPath;
-        StringInfoData sidFName;
-        File currFile;
-        char *buf;
-        int doc_id = list_nth_int(festate->rlist, festate->rlistptr);
-        
-        initStringInfo(&sidFName);
-        appendStringInfo(&sidFName, "%d", doc_id);
-        
-        /* get full path/name of the file */
-        initStringInfo(&sidDocPath);
-        appendStringInfo(&sidDocPath, "%s/%s", festate->data_dir, sidFName.data);
-        
-        /*
-         * load file content into buffer
-         */
-        currFile = openDoc(sidDocPath.data);
-        loadDoc(&buf, currFile);
-        closeDoc(currFile);
-        
-        tupleItemList = list_make2(sidFName.data, buf);  
-        
-        festate->rlistptr += 1;
+        slot = aggregate_scan(node, festate);
+        MemoryContextSwitchTo(oldcontext);
+        return slot;
     }
-    else
-        end_of_list = TRUE;
+
 	/*
 	 * The protocol for loading a virtual tuple into a slot is first
 	 * ExecClearTuple, then fill the values/isnull arrays, then
 	 * ExecStoreVirtualTuple.  If we don't find another row in the dc, we
 	 * just skip the last step, leaving the slot empty as required.
-	 *
-	 * We can pass ExprContext = NULL because we read all columns from the
-	 * dc, so no need to evaluate default expressions.
-	 *
-	 * We can also pass tupleOid = NULL because we don't allow oids for
-	 * foreign tables.
 	 */
     ExecClearTuple(slot);
-	if (!end_of_list)
-	{
-        HeapTuple tuple;
+    
+    /* pull the next doc id matching the quals */
+    doc_id = cursorNext(festate->cursor);
+    if (doc_id != CURSOR_END)
+    {
+        text *content = NULL;
+        int i;
         
-        values = (Datum *) palloc(festate->ncols * sizeof(Datum));
-    	nulls = (bool *) palloc(festate->ncols * sizeof(bool));
-        cstring_tuple(&values, &nulls, festate->mask, festate->ncols, tupleItemList);
-        tuple = BuildTupleFromCStrings(festate->attinmeta, (char **) values);
-        ExecStoreTuple(tuple, slot, InvalidBuffer, FALSE);
-	}
-
+        /*
+         * The text column is left NULL when no one needs it. The document
+         * is read from the document store of its segment if it has one,
+         * from its own file otherwise, straight into the text datum.
+         */
+        if (festate->need_text)
+            content = fetchPackedDoc(festate->index, doc_id, festate->max_doc_bytes);
+        if (festate->need_text && content == NULL)
+        {
+            StringInfoData sidDocPath;
+            File currFile;
+            
+            /* get full path/name of the file */
+            initStringInfo(&sidDocPath);
+            appendStringInfo(&sidDocPath, "%s/%d", festate->data_dir, doc_id);
+            
+            currFile = openDoc(sidDocPath.data);
+            if (currFile < 0)
+                elog(ERROR, "Cannot open doc %s!", sidDocPath.data);
+            content = loadDocText(currFile, festate->max_doc_bytes);
+            closeDoc(currFile);
+        }
+        
+        for (i = 0; i < festate->ncols; i++)
+        {
+            slot->tts_isnull[i] = FALSE;
+            if (festate->mask[i] == 0)
+                slot->tts_values[i] = id_datum(festate, i, doc_id);
+            else if (festate->mask[i] == 1 && content != NULL)
+                slot->tts_values[i] = text_datum(festate, i, content);
+            else
+            {
+                slot->tts_values[i] = (Datum) 0;
+                slot->tts_isnull[i] = TRUE;
+            }
+        }
+        ExecStoreVirtualTuple(slot);
+    }
+    
+    MemoryContextSwitchTo(oldcontext);
 	return slot;
 }
 
+/*
+ * Datum of column i, the id column, for a doc id. The integer types are
+ * built directly, others go through their input function.
+ */
+static Datum
+id_datum(DcFdwExecutionState *festate, int i, int32 doc_id)
+{
+    AttInMetadata   *attinmeta = festate->attinmeta;
+    char            str[16];
+    
+    switch (attinmeta->tupdesc->attrs[i]->atttypid)
+    {
+        case INT4OID:
+            return Int32GetDatum(doc_id);
+        case INT8OID:
+            return Int64GetDatum((int64) doc_id);
+        case INT2OID:
+            if (doc_id > SHRT_MAX)
+                elog(ERROR, "Doc id %d out of range for smallint!", doc_id);
+            return Int16GetDatum((int16) doc_id);
+        default:
+            snprintf(str, sizeof(str), "%d", doc_id);
+            return InputFunctionCall(&attinmeta->attinfuncs[i], str,
+                                     attinmeta->attioparams[i],
+                                     attinmeta->atttypmods[i]);
+    }
+}
+
+/*
+ * Datum of column i, the text column, for the content of a document. A
+ * text column takes the content as is, other types go through their input
+ * function.
+ */
+static Datum
+text_datum(DcFdwExecutionState *festate, int i, text *content)
+{
+    AttInMetadata   *attinmeta = festate->attinmeta;
+    
+    if (attinmeta->tupdesc->attrs[i]->atttypid == TEXTOID)
+        return PointerGetDatum(content);
+    return InputFunctionCall(&attinmeta->attinfuncs[i], text_to_cstring(content),
+                             attinmeta->attioparams[i],
+                             attinmeta->atttypmods[i]);
+}
+
 /*
  * dcEndForeignScan
  *		Finish scanning foreign table and dispose objects used for this scan
@@ -859,6 +1848,11 @@ dcEndForeignScan(ForeignScanState *node)
 	/* if festate is NULL, we are in EXPLAIN; nothing to do */
 	if (festate == NULL)
 		return;
+	
+	close_scan_cursor(festate);
+	closeIndex(festate->index);
+	if (festate->quals != NULL)
+	    freeQualTree(festate->quals);
 }
 
 /*
@@ -873,10 +1867,12 @@ dcReScanForeignScan(ForeignScanState *node)
 #ifdef DEBUG
     elog(NOTICE, "dcReScanForeignScan");
 #endif
-    /* If we haven't have valid result yet, nothing to do. */
-    if (festate->rlist == NIL)
-		return;
-
+    /*
+     * restart from the first doc id, the next read opens the cursor with
+     * the current params: a doc id looked up directly, or a query searched
+     */
+    close_scan_cursor(festate);
+    festate->aggs_done = FALSE;
 }
 
 /*
@@ -906,7 +1902,7 @@ dcAnalyzeForeignTable(Relation relation,
 	 * Get size of the collection.  (XXX if we fail here, would it be better to just
 	 * return false to skip analyzing the table?)
 	 */
-	statFile = openStat(index_dir);
+	statFile = openStat(currentIndexPath(index_dir));
     loadStat(&stats, statFile);
     closeStat(statFile);
     
@@ -925,6 +1921,174 @@ dcAnalyzeForeignTable(Relation relation,
 
 
 
+/*
+ * Open the cursor on the doc ids a scan returns: the docs matching the
+ * quals pushed down, or every live document. The operands known at run
+ * time only are evaluated first and put into the quals. The bound quals
+ * and the cursor live in the scan context, which a rescan resets.
+ */
+static void
+open_scan_cursor(ForeignScanState *node, DcFdwExecutionState *festate)
+{
+    ExprContext *econtext = node->ss.ps.ps_ExprContext;
+    MemoryContext oldcontext;
+    int         nparams = list_length(festate->params);
+    Datum       *values = NULL;
+    bool        *nulls = NULL;
+    Oid         *types = NULL;
+    ListCell    *lc;
+    int         i = 0;
+    
+    festate->bound = NULL;
+    if (festate->quals == NULL)
+    {
+        oldcontext = MemoryContextSwitchTo(festate->scancxt);
+        festate->cursor = openAllCursor(festate->index);
+        MemoryContextSwitchTo(oldcontext);
+        return;
+    }
+    
+    if (nparams > 0)
+    {
+        values = (Datum *) palloc(sizeof(Datum) * nparams);
+        nulls = (bool *) palloc(sizeof(bool) * nparams);
+        types = (Oid *) palloc(sizeof(Oid) * nparams);
+    }
+    foreach(lc, festate->params)
+    {
+        ExprState *expr_state = (ExprState *) lfirst(lc);
+        
+#if PG_VERSION_NUM >= 100000
+        values[i] = ExecEvalExpr(expr_state, econtext, &nulls[i]);
+#else
+        values[i] = ExecEvalExpr(expr_state, econtext, &nulls[i], NULL);
+#endif
+        types[i] = exprType((Node *) expr_state->expr);
+        i++;
+    }
+    
+    oldcontext = MemoryContextSwitchTo(festate->scancxt);
+    festate->bound = bindQualTree(festate->quals, values, nulls, types, festate->mapping);
+    /* the index may have changed since the plan was made */
+    estimateQualTree(festate->bound, festate->index, festate->index->ndocs);
+    festate->cursor = openQualCursor(festate->bound, festate->index);
+    MemoryContextSwitchTo(oldcontext);
+    
+    if (nparams > 0)
+    {
+        pfree(values);
+        pfree(nulls);
+        pfree(types);
+    }
+}
+
+/*
+ * Close the cursor opened by open_scan_cursor(). Resetting the scan
+ * context frees the cursor tree and the bound quals at once, so a nested
+ * loop does not grow memory with the number of outer rows.
+ */
+static void
+close_scan_cursor(DcFdwExecutionState *festate)
+{
+    MemoryContextReset(festate->scancxt);
+    festate->cursor = NULL;
+    festate->bound = NULL;
+}
+
+/*
+ * Return the row of the aggregates pushed down, computed from the doc ids
+ * the cursor returns in ascending order, then an empty slot.
+ */
+static TupleTableSlot *
+aggregate_scan(ForeignScanState *node, DcFdwExecutionState *festate)
+{
+    TupleTableSlot  *slot = node->ss.ss_ScanTupleSlot;
+    TupleDesc       tupdesc = slot->tts_tupleDescriptor;
+    int64           count = 0;
+    int32           min = 0;
+    int32           max = 0;
+    int32           doc_id;
+    ListCell        *lc;
+    int             i = 0;
+    
+    ExecClearTuple(slot);
+    if (festate->aggs_done)
+        return slot;
+    festate->aggs_done = TRUE;
+    
+    while ((doc_id = cursorNext(festate->cursor)) != CURSOR_END)
+    {
+        if (count == 0)
+            min = doc_id;
+        max = doc_id;
+        count ++;
+    }
+    
+    foreach(lc, festate->aggs)
+    {
+        Oid     typid = tupdesc->attrs[i]->atttypid;
+        int32   id = (lfirst_int(lc) == DC_AGG_MIN) ? min : max;
+        
+        slot->tts_isnull[i] = FALSE;
+        if (lfirst_int(lc) == DC_AGG_COUNT)
+            slot->tts_values[i] = Int64GetDatum(count);
+        /* min and max of no rows */
+        else if (count == 0)
+        {
+            slot->tts_values[i] = (Datum) 0;
+            slot->tts_isnull[i] = TRUE;
+        }
+        else if (typid == INT2OID)
+            slot->tts_values[i] = Int16GetDatum((int16) id);
+        else if (typid == INT8OID)
+            slot->tts_values[i] = Int64GetDatum((int64) id);
+        else
+            slot->tts_values[i] = Int32GetDatum(id);
+        i++;
+    }
+    ExecStoreVirtualTuple(slot);
+    return slot;
+}
+
+/*
+ * The foreign table of a scan. Scans of aggregates pushed down have no
+ * relation, the plan keeps the table instead.
+ */
+static Oid
+scan_table_oid(ForeignScanState *node)
+{
+    if (node->ss.ss_currentRelation == NULL)
+        return (Oid) intVal(list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private, 4));
+    return RelationGetRelid(node->ss.ss_currentRelation);
+}
+
+/*
+ * Does a scan need the text of the documents? Only if text_col is output
+ * by the scan or used by the clauses it rechecks; otherwise the tuples
+ * are made of the doc ids the cursor returns, without touching the data
+ * directory.
+ */
+static bool
+scan_needs_text(RelOptInfo *baserel, Oid foreigntableid, List *mapping, List *clauses)
+{
+	Bitmapset  *attrs_used = NULL;
+	AttrNumber	textattno;
+	int			i;
+
+	for (i = baserel->min_attr; i <= baserel->max_attr; i++)
+	{
+		if (!bms_is_empty(baserel->attr_needed[i - baserel->min_attr]))
+			attrs_used = bms_add_member(attrs_used,
+										i - FirstLowInvalidHeapAttributeNumber);
+	}
+	pull_varattnos((Node *) clauses, baserel->relid, &attrs_used);
+
+	/* a whole-row reference needs every column */
+	textattno = get_attnum(foreigntableid, (char *) list_nth(mapping, 1));
+	return bms_is_member(textattno - FirstLowInvalidHeapAttributeNumber, attrs_used) ||
+		bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs_used);
+}
+
 /*
  * Estimate size of a foreign table.
  *
@@ -938,7 +2102,7 @@ estimate_size(PlannerInfo *root, RelOptInfo *baserel,
 {   
 	BlockNumber pages;
 	double		nrows;
-    int         nbytes = stats->numOfBytes;
+    int64       nbytes = stats->numOfBytes;
 
 	/*
 	 * Convert size to pages for use in I/O cost estimate later.
@@ -955,11 +2119,13 @@ estimate_size(PlannerInfo *root, RelOptInfo *baserel,
 
 	/*
 	 * Now estimate the number of rows returned by the scan after applying the
-	 * baserestrictinfo quals.
+	 * baserestrictinfo quals: the quals pushed down from the document
+	 * frequencies of their terms, the others as usual.
 	 */
-	nrows = fpstate->ntuples *
+	nrows = fpstate->ntuples * fpstate->quals_sel *
 		clauselist_selectivity(root,
-							   baserel->baserestrictinfo,
+							   list_difference_ptr(baserel->baserestrictinfo,
+							                        fpstate->pushed),
 							   0,
 							   JOIN_INNER,
 							   NULL);
@@ -973,17 +2139,18 @@ estimate_size(PlannerInfo *root, RelOptInfo *baserel,
 
 
 /*
- * Estimate costs of scanning a foreign table.
+ * Estimate costs of scanning a foreign table, reading ndocs of its
+ * documents.
  *
  * Results are returned in *startup_cost and *total_cost.
  */
 static void
 estimate_costs(PlannerInfo *root, RelOptInfo *baserel,
-			   DcFdwPlanState *fpstate,
+			   DcFdwPlanState *fpstate, double ndocs,
 			   Cost *startup_cost, Cost *total_cost)
 {
 	BlockNumber pages = fpstate->pages;
-	double		ntuples = fpstate->ntuples;
+	double		ntuples = ndocs;
 	Cost		run_cost = 0;
 	Cost		cpu_per_tuple;
 
@@ -991,17 +2158,79 @@ estimate_costs(PlannerInfo *root, RelOptInfo *baserel,
 	 * We estimate costs almost the same way as cost_seqscan(), thus assuming
 	 * that I/O costs are equivalent to a regular table file of the same size.
 	 * However, we take per-tuple CPU costs as 10x of a seqscan, to account
-	 * for the cost of parsing records.
+	 * for the cost of parsing records. A scan reading some of the documents
+	 * only reads their share of the pages, and none without text_col.
 	 */
-	run_cost += seq_page_cost * pages;
+	if (fpstate->need_text)
+	{
+		if (fpstate->ntuples > 0 && ndocs < fpstate->ntuples)
+			run_cost += seq_page_cost * ceil(pages * ndocs / fpstate->ntuples);
+		else
+			run_cost += seq_page_cost * pages;
+	}
 
-	*startup_cost = baserel->baserestrictcost.startup;
-	cpu_per_tuple = cpu_tuple_cost * 10 + baserel->baserestrictcost.per_tuple;
+	*startup_cost = fpstate->recheck_cost.startup;
+	cpu_per_tuple = cpu_tuple_cost * 10 + fpstate->recheck_cost.per_tuple;
 	run_cost += cpu_per_tuple * ntuples;
 	*total_cost = *startup_cost + run_cost;
 }
 
 
+/*
+ * Pathkeys of a scan, in ascending order of the id column. The cursors
+ * return doc ids in ascending order whatever the quals, and take the
+ * smallest id of all segments at each step, a doc id of several segments
+ * coming out once; see cursor.c. Only an integer id column sorts as the
+ * doc ids do. NIL if the planner has no use for the order, and before
+ * 9.5, which lacks build_expression_pathkey().
+ */
+static List *
+id_pathkeys(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid, List *mapping)
+{
+#if PG_VERSION_NUM >= 90500
+	AttrNumber      attno;
+	Oid             typid;
+	int32           typmod;
+	Oid             collid;
+	TypeCacheEntry  *typentry;
+	Var             *var;
+
+	attno = get_attnum(foreigntableid, (char *) list_nth(mapping, 0));
+	if (attno == InvalidAttrNumber)
+		return NIL;
+	get_atttypetypmodcoll(foreigntableid, attno, &typid, &typmod, &collid);
+	if (typid != INT2OID && typid != INT4OID && typid != INT8OID)
+		return NIL;
+	typentry = lookup_type_cache(typid, TYPECACHE_LT_OPR);
+	if (!OidIsValid(typentry->lt_opr))
+		return NIL;
+
+	var = makeVar(baserel->relid, attno, typid, typmod, collid, 0);
+	return build_expression_pathkey(root, (Expr *) var, NULL,
+									typentry->lt_opr, baserel->relids, false);
+#else
+	return NIL;
+#endif
+}
+
+#if PG_VERSION_NUM >= 90400
+/*
+ * generate_implied_equalities_for_column() callback: is the member of an
+ * equivalence class the id column of rel, whose attno is *arg?
+ */
+static bool
+ec_member_matches_id(PlannerInfo *root, RelOptInfo *rel,
+					 EquivalenceClass *ec, EquivalenceMember *em,
+					 void *arg)
+{
+	Var *var = (Var *) em->em_expr;
+
+	return IsA(var, Var) &&
+		var->varno == rel->relid &&
+		var->varattno == *((AttrNumber *) arg);
+}
+#endif
+
 /*
  * dc_acquire_sample_rows -- acquire a random sample of rows from the table
  *
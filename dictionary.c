@@ -0,0 +1,486 @@
+/*-------------------------------------------------------------------------
+ *
+ * dictionary.c
+ *		  On-disk term dictionary for document collections foreign-data wrapper.
+ *
+ * Copyright (c) 2012, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Zheng Yang <zhengyang4k@gmail.com>
+ *
+ * IDENTIFICATION
+ *		  contrib/dc_fdw/dictionary.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "qual_pushdown.h"
+
+/*
+ * Blocked dictionary file layout (DICT_FORMAT_BLOCKED):
+ *
+ *  [ "DCDICT" | version byte | reserved byte ]  header, DICT_HEADER_SIZE bytes
+ *  [ term block ] ...
+ *  [ block index ]
+ *  [ number of blocks | offset of block index ] trailer, 2 x uint32
+ *
+ * Terms are stored in strcmp() order, DICT_BLOCK_TERMS to a block. Within
+ * a block every term is front-coded against the previous one:
+ *
+ *  varint prefix length | varint suffix length | suffix bytes |
+ *  varint postings offset | varint postings length | varint doc frequency
+ *
+ * The block index holds, for each block, its offset and length followed
+ * by its first term as a NUL terminated string. Only the block index is
+ * read into memory; a lookup binary searches it and decodes one block.
+ */
+
+static void writeUint32(StringInfo buf, uint32 val);
+static uint32 readUint32(char *buf);
+static int findBlock(TermDictionary *dict, char *term);
+static char *loadBlock(TermDictionary *dict, DictBlock *block, char **buf, uint32 *bufsize);
+static void decodeEntry(char **ptr, char *end, StringInfo term, PostingInfo *info);
+static void flushBlock(DictWriter *writer);
+
+/*
+ * fixed width little-endian helpers for the trailer
+ */
+static void
+writeUint32(StringInfo buf, uint32 val)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        appendStringInfoChar(buf, (char) ((val >> (8 * i)) & 0xFF));
+}
+
+static uint32
+readUint32(char *buf)
+{
+    unsigned char *p = (unsigned char *) buf;
+
+    return ((uint32) p[0]) | ((uint32) p[1] << 8) |
+           ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+/*
+ * open dictionary file by its full path. A blocked dictionary only has
+ * its block index loaded, and is memory mapped if possible. A legacy
+ * text dictionary is loaded into a hashtable as a whole.
+ */
+TermDictionary *
+openDictPath(char *fname)
+{
+    TermDictionary  *dict;
+    char            header[DICT_HEADER_SIZE];
+    char            trailer[DICT_TRAILER_SIZE];
+    char            *ptr;
+    char            *end;
+    Size            sz;
+    uint32          indexOffset;
+    int             i;
+
+#ifdef DEBUG
+    elog(NOTICE, "openDictPath");
+#endif
+
+    dict = (TermDictionary *) palloc0(sizeof(TermDictionary));
+    dict->file = -1;
+    dict->map = mapIndexFile(fname);
+    if (dict->map != NULL &&
+        (dict->map->len < DICT_HEADER_SIZE + DICT_TRAILER_SIZE ||
+         memcmp(dict->map->addr, DICT_MAGIC, DICT_MAGIC_LEN) != 0))
+    {
+        /* legacy dictionaries are parsed through the File API */
+        releaseMappedFile(dict->map);
+        dict->map = NULL;
+    }
+
+    if (dict->map != NULL)
+    {
+        sz = dict->map->len;
+        memcpy(header, dict->map->addr, DICT_HEADER_SIZE);
+        memcpy(trailer, dict->map->addr + sz - DICT_TRAILER_SIZE, DICT_TRAILER_SIZE);
+    }
+    else
+    {
+        dict->file = PathNameOpenFile(fname, O_RDONLY,  0666);
+        if (dict->file < 0)
+            elog(ERROR, "Cannot open dictionary file %s!", fname);
+
+        /* legacy text dictionary */
+        sz = FileSeek(dict->file, 0, SEEK_END);
+        FileSeek(dict->file, 0, SEEK_SET);
+        if (sz < DICT_HEADER_SIZE + DICT_TRAILER_SIZE ||
+            FileRead(dict->file, header, DICT_HEADER_SIZE) != DICT_HEADER_SIZE ||
+            memcmp(header, DICT_MAGIC, DICT_MAGIC_LEN) != 0)
+        {
+            dict->version = DICT_FORMAT_TEXT;
+            loadDict(&dict->legacy, dict->file);
+            FileClose(dict->file);
+            dict->file = -1;
+            return dict;
+        }
+
+        FileSeek(dict->file, sz - DICT_TRAILER_SIZE, SEEK_SET);
+        if (FileRead(dict->file, trailer, DICT_TRAILER_SIZE) != DICT_TRAILER_SIZE)
+            elog(ERROR, "Dictionary file corrupted!");
+    }
+
+    dict->version = (unsigned char) header[DICT_MAGIC_LEN];
+    if (dict->version != DICT_FORMAT_BLOCKED)
+        elog(ERROR, "Unsupported dictionary file version %d!", dict->version);
+
+    /* locate and load the block index */
+    dict->nblocks = (int) readUint32(trailer);
+    indexOffset = readUint32(trailer + 4);
+    if (indexOffset < DICT_HEADER_SIZE || indexOffset > sz - DICT_TRAILER_SIZE)
+        elog(ERROR, "Dictionary file corrupted!");
+
+    if (dict->map != NULL)
+        ptr = dict->map->addr + indexOffset;
+    else
+    {
+        dict->indexData = (char *) palloc(sz - DICT_TRAILER_SIZE - indexOffset + 1);
+        FileSeek(dict->file, indexOffset, SEEK_SET);
+        FileRead(dict->file, dict->indexData, sz - DICT_TRAILER_SIZE - indexOffset);
+        ptr = dict->indexData;
+    }
+    end = ptr + (sz - DICT_TRAILER_SIZE - indexOffset);
+
+    dict->blocks = (DictBlock *) palloc(sizeof(DictBlock) * Max(dict->nblocks, 1));
+    for (i = 0; i < dict->nblocks; i++)
+    {
+        char *nul;
+
+        dict->blocks[i].offset = readVarint(&ptr, end);
+        dict->blocks[i].len = readVarint(&ptr, end);
+        dict->blocks[i].firstTerm = ptr;
+        nul = memchr(ptr, 0, end - ptr);
+        if (nul == NULL ||
+            (Size) dict->blocks[i].offset + dict->blocks[i].len > indexOffset)
+            elog(ERROR, "Dictionary file corrupted!");
+        ptr = nul + 1;
+    }
+
+    return dict;
+}
+
+/*
+ * binary search for the last block whose first term is <= term,
+ * -1 if term sorts before every block
+ */
+static int
+findBlock(TermDictionary *dict, char *term)
+{
+    int lo = 0;
+    int hi = dict->nblocks - 1;
+    int found = -1;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (strcmp(dict->blocks[mid].firstTerm, term) <= 0)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+/*
+ * return the bytes of a block, read into *buf unless the file is mapped
+ */
+static char *
+loadBlock(TermDictionary *dict, DictBlock *block, char **buf, uint32 *bufsize)
+{
+    if (dict->map != NULL)
+        return dict->map->addr + block->offset;
+
+    if (*bufsize < block->len)
+    {
+        if (*buf)
+            pfree(*buf);
+        *buf = (char *) palloc(block->len);
+        *bufsize = block->len;
+    }
+    FileSeek(dict->file, block->offset, SEEK_SET);
+    if (FileRead(dict->file, *buf, block->len) != (int) block->len)
+        elog(ERROR, "Dictionary file corrupted!");
+    return *buf;
+}
+
+/*
+ * decode the front-coded entry at *ptr. term holds the previous term of
+ * the block on entry and the decoded term on exit.
+ */
+static void
+decodeEntry(char **ptr, char *end, StringInfo term, PostingInfo *info)
+{
+    uint32  prefix = readVarint(ptr, end);
+    uint32  suffix = readVarint(ptr, end);
+
+    if (prefix > (uint32) term->len || *ptr + suffix > end)
+        elog(ERROR, "Dictionary file corrupted!");
+    term->len = prefix;
+    appendBinaryStringInfo(term, *ptr, suffix);
+    *ptr += suffix;
+
+    info->ptr = (int64) readVarint64(ptr, end);
+    info->len = (int) readVarint(ptr, end);
+    info->df = (int) readVarint(ptr, end);
+}
+
+/*
+ * look up a term. Return TRUE and fill in info if the term is found.
+ */
+bool
+lookupTerm(TermDictionary *dict, char *term, PostingInfo *info)
+{
+    DictBlock       *block;
+    StringInfoData  sidTerm;
+    char            *ptr;
+    char            *end;
+    int             b;
+    bool            found = FALSE;
+
+    if (dict->version == DICT_FORMAT_TEXT)
+    {
+        PostingInfo *re;
+
+        re = (PostingInfo *) hash_search(dict->legacy, (void *) term, HASH_FIND, &found);
+        if (found)
+            *info = *re;
+        return found;
+    }
+
+    b = findBlock(dict, term);
+    if (b < 0)
+        return FALSE;
+    block = &dict->blocks[b];
+    ptr = loadBlock(dict, block, &dict->buf, &dict->bufsize);
+    end = ptr + block->len;
+
+    /* decode front-coded entries until term is reached */
+    initStringInfo(&sidTerm);
+    while (ptr < end)
+    {
+        int cmp;
+
+        decodeEntry(&ptr, end, &sidTerm, info);
+        cmp = strcmp(sidTerm.data, term);
+        if (cmp == 0)
+        {
+            found = TRUE;
+            break;
+        }
+        /* terms are sorted, no need to look further */
+        if (cmp > 0)
+            break;
+    }
+
+    if (found)
+        strlcpy(info->key, sidTerm.data, sizeof(info->key));
+    pfree(sidTerm.data);
+    return found;
+}
+
+/*
+ * start a scan over all entries of a blocked dictionary in term order
+ */
+DictIterator *
+dictIterBegin(TermDictionary *dict)
+{
+    DictIterator *iter;
+
+    if (dict->version != DICT_FORMAT_BLOCKED)
+        elog(ERROR, "Cannot scan a legacy dictionary in term order!");
+
+    iter = (DictIterator *) palloc0(sizeof(DictIterator));
+    iter->dict = dict;
+    iter->block = -1;
+    initStringInfo(&iter->term);
+    return iter;
+}
+
+/*
+ * advance to the next entry. Return FALSE at the end of the dictionary.
+ */
+bool
+dictIterNext(DictIterator *iter)
+{
+    TermDictionary *dict = iter->dict;
+
+    while (iter->ptr >= iter->end)
+    {
+        DictBlock *block;
+
+        if (++iter->block >= dict->nblocks)
+            return FALSE;
+        block = &dict->blocks[iter->block];
+        iter->ptr = loadBlock(dict, block, &iter->buf, &iter->bufsize);
+        iter->end = iter->ptr + block->len;
+        resetStringInfo(&iter->term);
+    }
+
+    decodeEntry(&iter->ptr, iter->end, &iter->term, &iter->info);
+    strlcpy(iter->info.key, iter->term.data, sizeof(iter->info.key));
+    return TRUE;
+}
+
+/*
+ * finish a dictionary scan
+ */
+void
+dictIterEnd(DictIterator *iter)
+{
+    if (iter->buf)
+        pfree(iter->buf);
+    pfree(iter->term.data);
+    pfree(iter);
+}
+
+/*
+ * close dictionary and free its memory
+ */
+void
+closeDict (TermDictionary *dict)
+{
+    if (dict->map != NULL)
+        releaseMappedFile(dict->map);
+    if (dict->file >= 0)
+        FileClose(dict->file);
+    if (dict->legacy)
+        hash_destroy(dict->legacy);
+    if (dict->buf)
+        pfree(dict->buf);
+    if (dict->blocks)
+        pfree(dict->blocks);
+    if (dict->indexData)
+        pfree(dict->indexData);
+    pfree(dict);
+}
+
+/*
+ * start writing a blocked dictionary into dfile
+ */
+DictWriter *
+dictWriterBegin(File dfile)
+{
+    DictWriter  *writer = (DictWriter *) palloc0(sizeof(DictWriter));
+    char        header[DICT_HEADER_SIZE];
+
+    writer->file = dfile;
+    initStringInfo(&writer->block);
+    initStringInfo(&writer->index);
+    initStringInfo(&writer->prevTerm);
+    initStringInfo(&writer->firstTerm);
+
+    MemSet(header, 0, DICT_HEADER_SIZE);
+    memcpy(header, DICT_MAGIC, DICT_MAGIC_LEN);
+    header[DICT_MAGIC_LEN] = (char) DICT_FORMAT_BLOCKED;
+    FileWrite(dfile, header, DICT_HEADER_SIZE);
+    writer->offset = DICT_HEADER_SIZE;
+
+    return writer;
+}
+
+/*
+ * append a dictionary entry. Terms must be added in strcmp() order.
+ */
+void
+dictWriterAdd(DictWriter *writer, char *term, int64 ptr, int len, int df)
+{
+    int termlen = strlen(term);
+    int prefix = 0;
+
+    if (writer->nterms > 0 || writer->nblocks > 0)
+    {
+        if (strcmp(writer->prevTerm.data, term) >= 0)
+            elog(ERROR, "Dictionary terms out of order: \"%s\" after \"%s\"",
+                 term, writer->prevTerm.data);
+    }
+
+    /* first term of a block is stored in full and goes into the index */
+    if (writer->nterms == 0)
+    {
+        resetStringInfo(&writer->firstTerm);
+        appendBinaryStringInfo(&writer->firstTerm, term, termlen);
+    }
+    else
+    {
+        while (prefix < termlen && prefix < writer->prevTerm.len &&
+               term[prefix] == writer->prevTerm.data[prefix])
+            prefix ++;
+    }
+
+    appendVarint(&writer->block, prefix);
+    appendVarint(&writer->block, termlen - prefix);
+    appendBinaryStringInfo(&writer->block, term + prefix, termlen - prefix);
+    appendVarint64(&writer->block, (uint64) ptr);
+    appendVarint(&writer->block, len);
+    appendVarint(&writer->block, df);
+
+    resetStringInfo(&writer->prevTerm);
+    appendBinaryStringInfo(&writer->prevTerm, term, termlen);
+
+    if (++writer->nterms == DICT_BLOCK_TERMS)
+        flushBlock(writer);
+}
+
+/*
+ * write out the block being filled and record its length in the index
+ */
+static void
+flushBlock(DictWriter *writer)
+{
+    if (writer->nterms == 0)
+        return;
+
+    /* block offsets and the trailer are 32 bit */
+    if ((uint64) writer->offset + writer->block.len > 0xFFFFFFFF)
+        elog(ERROR, "Dictionary file exceeds 4 GB!");
+
+    FileWrite(writer->file, writer->block.data, writer->block.len);
+
+    appendVarint(&writer->index, writer->offset);
+    appendVarint(&writer->index, writer->block.len);
+    appendBinaryStringInfo(&writer->index, writer->firstTerm.data,
+                           writer->firstTerm.len + 1);
+
+    writer->offset += writer->block.len;
+    writer->nblocks ++;
+    writer->nterms = 0;
+    resetStringInfo(&writer->block);
+}
+
+/*
+ * flush the last block, write the block index and trailer and close
+ * the dictionary file
+ */
+void
+dictWriterEnd(DictWriter *writer)
+{
+    StringInfoData sidTrailer;
+
+    flushBlock(writer);
+    FileWrite(writer->file, writer->index.data, writer->index.len);
+
+    initStringInfo(&sidTrailer);
+    writeUint32(&sidTrailer, writer->nblocks);
+    writeUint32(&sidTrailer, writer->offset);
+    FileWrite(writer->file, sidTrailer.data, sidTrailer.len);
+    FileClose(writer->file);
+
+    pfree(sidTrailer.data);
+    pfree(writer->block.data);
+    pfree(writer->index.data);
+    pfree(writer->prevTerm.data);
+    pfree(writer->firstTerm.data);
+    pfree(writer);
+}
@@ -0,0 +1,603 @@
+/*-------------------------------------------------------------------------
+ *
+ * docstore.c
+ *		  Packed document store for document collections foreign-data
+ *		  wrapper.
+ *
+ * Copyright (c) 2012, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Zheng Yang <zhengyang4k@gmail.com>
+ *
+ * IDENTIFICATION
+ *		  contrib/dc_fdw/docstore.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "qual_pushdown.h"
+
+#include <unistd.h>
+
+#if PG_VERSION_NUM >= 90500
+#include "common/pg_lzcompress.h"
+#endif
+
+/*
+ * A segment built with the pack_docs option also holds a copy of the
+ * documents it indexes, so scans read them from a file kept open instead
+ * of opening a file of the data path per row:
+ *
+ *  docs    the contents of the documents, one after the other
+ *  docidx  [ "DCDOCS" | version byte | reserved byte ]  header
+ *          [ doc id | length | offset ] ...            one DocStoreEntry
+ *                                                      per document
+ *
+ * Both are in ascending doc id order, the order in which scans return
+ * the doc ids, so the reads of a scan move forward through the docs
+ * file and benefit from the readahead of the kernel. The doc table is
+ * memory mapped and searched in place.
+ *
+ * With compress_docs (DOCIDX_FORMAT_COMPRESSED), the contents are cut
+ * into blocks of DOCS_BLOCK_SIZE bytes, whatever the document boundaries,
+ * and each block is written compressed with pglz, or as is if it does not
+ * compress. Offsets of the entries are then offsets in the uncompressed
+ * contents, and the doc table goes on with the offsets of the blocks in
+ * the docs file:
+ *
+ *          [ block offset ] ...                        one int64 per block,
+ *                                                      and the end of docs
+ *          [ number of entries | number of blocks ]    trailer
+ *
+ * A store keeps the last block it decompressed, so the documents of a
+ * scan that fall in the same block, consecutive doc ids most of the
+ * time, cost a single read and decompression.
+ *
+ * The store of a segment is never updated: documents deleted or changed
+ * afterwards are masked by the tombstones of the segment, and the live
+ * ones are copied into the store of the segment they are merged into.
+ */
+
+/*
+ * Document store being written
+ */
+typedef struct DocStoreWriter {
+    File file;                  /* docs.tmp */
+    char *indexpath;
+    bool compress;              /* write compressed blocks */
+    StringInfoData table;       /* doc table */
+    StringInfoData blocks;      /* offsets of the blocks written */
+    StringInfoData block;       /* block being filled */
+    char *compressed;           /* compressed block */
+    int64 offset;               /* offset of the next doc */
+    int64 fileOffset;           /* bytes written to docs.tmp */
+    int nentries;
+    int32 last;                 /* last doc id added */
+} DocStoreWriter;
+
+static DocStoreWriter * docWriterBegin(char *indexpath, int pack_docs);
+static void docWriterAdd(DocStoreWriter *writer, int32 id, char *buf, int len);
+static void docWriterEnd(DocStoreWriter *writer);
+static void flushDocBlock(DocStoreWriter *writer, int len);
+static File createStoreFile(char *indexpath, char *fname);
+static void writeStoreFile(File file, char *buf, int len);
+static DocStoreEntry * findDocEntry(DocStore *store, int32 id);
+static void readStoreBytes(DocStore *store, int64 offset, int len, char *dest);
+static void loadDocBlock(DocStore *store, int k);
+
+/*
+ * write the packed document store of the documents fnames of datapath,
+ * sorted by doc id, into docs.tmp and docidx.tmp of indexpath
+ */
+void
+writeDocStore(char *datapath, char *indexpath, char **fnames, int nfiles, int pack_docs)
+{
+    DocStoreWriter  *writer;
+    StringInfoData  sidDocPath;
+    int             i;
+
+#ifdef DEBUG
+    elog(NOTICE, "writeDocStore");
+#endif
+
+    writer = docWriterBegin(indexpath, pack_docs);
+    initStringInfo(&sidDocPath);
+    for (i = 0; i < nfiles; i++)
+    {
+        File    currFile;
+        off_t   fileSize;
+        char    *buf;
+        int     len;
+
+        resetStringInfo(&sidDocPath);
+        appendStringInfo(&sidDocPath, "%s/%s", datapath, fnames[i]);
+        currFile = openDoc(sidDocPath.data);
+        if (currFile < 0)
+            elog(ERROR, "Cannot open doc %s!", sidDocPath.data);
+        fileSize = FileSeek(currFile, 0, SEEK_END);
+        if (fileSize > MaxAllocSize)
+            elog(ERROR, "Doc file %s of %ld bytes is too large!", sidDocPath.data, (long) fileSize);
+        FileSeek(currFile, 0, SEEK_SET);
+        buf = (char *) palloc(Max(fileSize, 1));
+        len = FileRead(currFile, buf, (int) fileSize);
+        if (len < 0)
+            elog(ERROR, "Cannot read doc %s!", sidDocPath.data);
+        closeDoc(currFile);
+
+        docWriterAdd(writer, atoi(fnames[i]), buf, len);
+        pfree(buf);
+    }
+    docWriterEnd(writer);
+    pfree(sidDocPath.data);
+}
+
+/*
+ * Merge the packed document stores of segments into docs.tmp and
+ * docidx.tmp of indexpath, dropping the deleted documents. Doc ids of
+ * different segments interleave, so the doc tables are merged by doc id.
+ * Documents of segments without a store are left out, and are read from
+ * the data path as before. No store is written if no segment has one.
+ */
+void
+mergeDocStores(char *indexdir, List *selected, char *indexpath, int pack_docs)
+{
+    int             nsegs = list_length(selected);
+    IndexSegment    *segs;
+    int             *pos;
+    DocStoreWriter  *writer;
+    ListCell        *cell;
+    char            *buf = NULL;
+    int             bufSize = 0;
+    bool            found = FALSE;
+    int             i = 0;
+
+#ifdef DEBUG
+    elog(NOTICE, "mergeDocStores");
+#endif
+
+    segs = (IndexSegment *) palloc(sizeof(IndexSegment) * Max(nsegs, 1));
+    pos = (int *) palloc0(sizeof(int) * Max(nsegs, 1));
+    foreach(cell, selected)
+    {
+        SegmentRef      *ref = (SegmentRef *) lfirst(cell);
+        StringInfoData  sidPath;
+
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/%s", indexdir, ref->name);
+        openSegment(&segs[i], sidPath.data, ref->tombstones);
+        pfree(sidPath.data);
+        if (segs[i].docs != NULL)
+            found = TRUE;
+        i ++;
+    }
+
+    if (found)
+    {
+        writer = docWriterBegin(indexpath, pack_docs);
+        for (;;)
+        {
+            DocStoreEntry   *entry = NULL;
+            int             next = -1;
+
+            /* smallest doc id of the segments, which are few and scanned */
+            for (i = 0; i < nsegs; i++)
+            {
+                DocStore *s = segs[i].docs;
+
+                if (s != NULL && pos[i] < s->nentries &&
+                    (entry == NULL || s->entries[pos[i]].id < entry->id))
+                {
+                    entry = &s->entries[pos[i]];
+                    next = i;
+                }
+            }
+            if (entry == NULL)
+                break;
+            pos[next] ++;
+            if (IS_TOMBSTONED(&segs[next], entry->id))
+                continue;
+
+            if (entry->len > bufSize)
+            {
+                bufSize = entry->len;
+                buf = (buf == NULL) ? (char *) palloc(bufSize) : (char *) repalloc(buf, bufSize);
+            }
+            readStoreBytes(segs[next].docs, entry->offset, entry->len, buf);
+            docWriterAdd(writer, entry->id, buf, entry->len);
+        }
+        docWriterEnd(writer);
+    }
+
+    for (i = 0; i < nsegs; i++)
+        closeSegment(&segs[i]);
+    if (buf != NULL)
+        pfree(buf);
+    pfree(segs);
+    pfree(pos);
+}
+
+/*
+ * open the packed document store of a segment, NULL if it has none
+ */
+DocStore *
+openDocStore(char *indexpath)
+{
+    DocStore        *store;
+    StringInfoData  sidPath;
+    struct stat     st;
+    Size            len;
+    int             version;
+
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/" DOCIDX_FILE, indexpath);
+    if (stat(sidPath.data, &st) != 0)
+    {
+        pfree(sidPath.data);
+        return NULL;
+    }
+
+    store = (DocStore *) palloc0(sizeof(DocStore));
+    store->map = mapIndexFile(sidPath.data);
+    if (store->map != NULL)
+    {
+        store->table = store->map->addr;
+        len = store->map->len;
+    }
+    else
+    {
+        File    idxFile = PathNameOpenFile(sidPath.data, O_RDONLY,  0666);
+
+        if (idxFile < 0)
+            elog(ERROR, "Cannot open doc table %s!", sidPath.data);
+        len = (Size) st.st_size;
+        store->table = (char *) palloc(Max(len, 1));
+        if (FileRead(idxFile, store->table, (int) len) != (int) len)
+            elog(ERROR, "Cannot read doc table %s!", sidPath.data);
+        FileClose(idxFile);
+    }
+    if (len < DOCIDX_HEADER_SIZE || memcmp(store->table, DOCIDX_MAGIC, DOCIDX_MAGIC_LEN) != 0)
+        elog(ERROR, "Doc table %s corrupted!", sidPath.data);
+    version = (unsigned char) store->table[DOCIDX_MAGIC_LEN];
+    store->entries = (DocStoreEntry *) (store->table + DOCIDX_HEADER_SIZE);
+    store->cachedBlock = -1;
+    if (version == DOCIDX_FORMAT_PACKED)
+    {
+        if ((len - DOCIDX_HEADER_SIZE) % sizeof(DocStoreEntry) != 0)
+            elog(ERROR, "Doc table %s corrupted!", sidPath.data);
+        store->nentries = (int) ((len - DOCIDX_HEADER_SIZE) / sizeof(DocStoreEntry));
+    }
+#if PG_VERSION_NUM >= 90500
+    else if (version == DOCIDX_FORMAT_COMPRESSED)
+    {
+        int32 trailer[2];
+
+        if (len < DOCIDX_HEADER_SIZE + DOCIDX_TRAILER_SIZE)
+            elog(ERROR, "Doc table %s corrupted!", sidPath.data);
+        memcpy(trailer, store->table + len - DOCIDX_TRAILER_SIZE, DOCIDX_TRAILER_SIZE);
+        store->nentries = trailer[0];
+        store->nblocks = trailer[1];
+        if (store->nentries < 0 || store->nblocks < 0 ||
+            len != DOCIDX_HEADER_SIZE + sizeof(DocStoreEntry) * store->nentries +
+                    sizeof(int64) * (store->nblocks + 1) + DOCIDX_TRAILER_SIZE)
+            elog(ERROR, "Doc table %s corrupted!", sidPath.data);
+        store->blocks = (int64 *) (store->entries + store->nentries);
+        if (store->nentries > 0)
+            store->rawSize = store->entries[store->nentries - 1].offset +
+                                store->entries[store->nentries - 1].len;
+        store->block = (char *) palloc(DOCS_BLOCK_SIZE);
+        store->compressed = (char *) palloc(DOCS_BLOCK_SIZE);
+    }
+#endif
+    else
+        elog(ERROR, "Unsupported doc table version %d!", version);
+
+    resetStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/" DOCS_FILE, indexpath);
+    store->file = PathNameOpenFile(sidPath.data, O_RDONLY,  0666);
+    if (store->file < 0)
+        elog(ERROR, "Cannot open document store %s!", sidPath.data);
+    pfree(sidPath.data);
+    return store;
+}
+
+/*
+ * close a packed document store
+ */
+void
+closeDocStore(DocStore *store)
+{
+    if (store->map != NULL)
+        releaseMappedFile(store->map);
+    else
+        pfree(store->table);
+    if (store->block != NULL)
+        pfree(store->block);
+    if (store->compressed != NULL)
+        pfree(store->compressed);
+    FileClose(store->file);
+    pfree(store);
+}
+
+/*
+ * read the content of a live doc from the document store of the segment
+ * holding it into a text datum, with a single read if it is not
+ * compressed, cut as by loadDocText(). Return NULL if that segment has
+ * no document store.
+ */
+text *
+fetchPackedDoc(IndexReader *index, int32 id, int maxBytes)
+{
+    int i;
+
+    /* a changed doc is live in the newest segment having it */
+    for (i = index->nsegments - 1; i >= 0; i--)
+    {
+        IndexSegment    *seg = &index->segments[i];
+        DocStoreEntry   *entry;
+        text            *result;
+        int             len;
+
+        if (seg->docs == NULL || IS_TOMBSTONED(seg, id))
+            continue;
+        entry = findDocEntry(seg->docs, id);
+        if (entry == NULL)
+            continue;
+        len = entry->len;
+        if (maxBytes > 0 && len > maxBytes)
+            len = maxBytes;
+        result = (text *) palloc(VARHDRSZ + len);
+        readStoreBytes(seg->docs, entry->offset, len, VARDATA(result));
+        return finishDocText(result, len, maxBytes);
+    }
+    return NULL;
+}
+
+/*
+ * start writing docs.tmp and docidx.tmp in indexpath
+ */
+static DocStoreWriter *
+docWriterBegin(char *indexpath, int pack_docs)
+{
+    DocStoreWriter  *writer = (DocStoreWriter *) palloc0(sizeof(DocStoreWriter));
+    char            header[DOCIDX_HEADER_SIZE];
+
+#if PG_VERSION_NUM < 90500
+    if (pack_docs == DOCS_COMPRESSED)
+    {
+        elog(NOTICE, "%s", "-compress_docs needs PostgreSQL 9.5 or later, packing the documents uncompressed");
+        pack_docs = DOCS_PACKED;
+    }
+#endif
+    writer->file = createStoreFile(indexpath, DOCS_FILE);
+    writer->indexpath = indexpath;
+    writer->compress = (pack_docs == DOCS_COMPRESSED);
+    writer->last = -1;
+    initStringInfo(&writer->table);
+    initStringInfo(&writer->blocks);
+    initStringInfo(&writer->block);
+
+    MemSet(header, 0, DOCIDX_HEADER_SIZE);
+    memcpy(header, DOCIDX_MAGIC, DOCIDX_MAGIC_LEN);
+    header[DOCIDX_MAGIC_LEN] = (char) (writer->compress ? DOCIDX_FORMAT_COMPRESSED : DOCIDX_FORMAT_PACKED);
+    appendBinaryStringInfo(&writer->table, header, DOCIDX_HEADER_SIZE);
+#if PG_VERSION_NUM >= 90500
+    if (writer->compress)
+        writer->compressed = (char *) palloc(PGLZ_MAX_OUTPUT(DOCS_BLOCK_SIZE));
+#endif
+    return writer;
+}
+
+/*
+ * append a document, doc ids ascending
+ */
+static void
+docWriterAdd(DocStoreWriter *writer, int32 id, char *buf, int len)
+{
+    DocStoreEntry entry;
+
+    if (id < writer->last)
+        elog(ERROR, "Documents to pack are out of doc id order!");
+    writer->last = id;
+    entry.id = id;
+    entry.len = len;
+    entry.offset = writer->offset;
+    appendBinaryStringInfo(&writer->table, (char *) &entry, sizeof(DocStoreEntry));
+    writer->offset += len;
+    writer->nentries ++;
+
+    if (!writer->compress)
+    {
+        writeStoreFile(writer->file, buf, len);
+        return;
+    }
+
+    /* fill blocks, and write out the full ones */
+    while (len > 0)
+    {
+        int n = Min(len, DOCS_BLOCK_SIZE - writer->block.len);
+
+        appendBinaryStringInfo(&writer->block, buf, n);
+        buf += n;
+        len -= n;
+        if (writer->block.len == DOCS_BLOCK_SIZE)
+            flushDocBlock(writer, DOCS_BLOCK_SIZE);
+    }
+}
+
+/*
+ * write out the last block and the doc table, and close the files
+ */
+static void
+docWriterEnd(DocStoreWriter *writer)
+{
+    File idxFile;
+
+    if (writer->compress)
+    {
+        int32 trailer[2];
+
+        if (writer->block.len > 0)
+            flushDocBlock(writer, writer->block.len);
+        appendBinaryStringInfo(&writer->table, writer->blocks.data, writer->blocks.len);
+        appendBinaryStringInfo(&writer->table, (char *) &writer->fileOffset, sizeof(int64));
+        trailer[0] = writer->nentries;
+        trailer[1] = writer->blocks.len / sizeof(int64);
+        appendBinaryStringInfo(&writer->table, (char *) trailer, DOCIDX_TRAILER_SIZE);
+    }
+    FileClose(writer->file);
+
+    idxFile = createStoreFile(writer->indexpath, DOCIDX_FILE);
+    writeStoreFile(idxFile, writer->table.data, writer->table.len);
+    FileClose(idxFile);
+
+    pfree(writer->table.data);
+    pfree(writer->blocks.data);
+    pfree(writer->block.data);
+    if (writer->compressed != NULL)
+        pfree(writer->compressed);
+    pfree(writer);
+}
+
+/*
+ * write the block being filled, of len bytes, compressed if it gets
+ * smaller
+ */
+static void
+flushDocBlock(DocStoreWriter *writer, int len)
+{
+    int32 clen = -1;
+
+    appendBinaryStringInfo(&writer->blocks, (char *) &writer->fileOffset, sizeof(int64));
+#if PG_VERSION_NUM >= 90500
+    clen = pglz_compress(writer->block.data, len, writer->compressed, PGLZ_strategy_default);
+#endif
+    /* a block of the same size is read back as is */
+    if (clen > 0 && clen < len)
+    {
+        writeStoreFile(writer->file, writer->compressed, clen);
+        writer->fileOffset += clen;
+    }
+    else
+    {
+        writeStoreFile(writer->file, writer->block.data, len);
+        writer->fileOffset += len;
+    }
+    resetStringInfo(&writer->block);
+}
+
+/*
+ * create fname.tmp in indexpath
+ */
+static File
+createStoreFile(char *indexpath, char *fname)
+{
+    StringInfoData  sidPath;
+    File            file;
+
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/%s" TMP_SUFFIX, indexpath, fname);
+    file = PathNameOpenFile(sidPath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    if (file < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", sidPath.data)));
+    pfree(sidPath.data);
+    return file;
+}
+
+static void
+writeStoreFile(File file, char *buf, int len)
+{
+    if (len > 0 && FileWrite(file, buf, len) != len)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write document store: %m")));
+}
+
+/*
+ * binary search of the doc table, NULL if id is not in it
+ */
+static DocStoreEntry *
+findDocEntry(DocStore *store, int32 id)
+{
+    int lo = 0;
+    int hi = store->nentries - 1;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (store->entries[mid].id == id)
+            return &store->entries[mid];
+        if (store->entries[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/*
+ * read len bytes of contents at offset of a store into dest
+ */
+static void
+readStoreBytes(DocStore *store, int64 offset, int len, char *dest)
+{
+    if (store->blocks == NULL)
+    {
+        if (len > 0 &&
+            (FileSeek(store->file, (off_t) offset, SEEK_SET) != (off_t) offset ||
+             FileRead(store->file, dest, len) != len))
+            elog(ERROR, "Cannot read document store!");
+        return;
+    }
+
+    while (len > 0)
+    {
+        int k = (int) (offset / DOCS_BLOCK_SIZE);
+        int start = (int) (offset % DOCS_BLOCK_SIZE);
+        int n = Min(len, DOCS_BLOCK_SIZE - start);
+
+        loadDocBlock(store, k);
+        memcpy(dest, store->block + start, n);
+        dest += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/*
+ * decompress block k of a compressed store, unless it is the last one read
+ */
+static void
+loadDocBlock(DocStore *store, int k)
+{
+    int64   rlen;
+    int64   clen;
+    char    *buf;
+
+    if (store->cachedBlock == k)
+        return;
+    if (k < 0 || k >= store->nblocks)
+        elog(ERROR, "Document store block %d out of range!", k);
+    rlen = Min(DOCS_BLOCK_SIZE, store->rawSize - (int64) k * DOCS_BLOCK_SIZE);
+    clen = store->blocks[k + 1] - store->blocks[k];
+    if (clen <= 0 || clen > rlen)
+        elog(ERROR, "Document store block %d corrupted!", k);
+
+    /* the block is stored as is if it did not compress */
+    buf = (clen == rlen) ? store->block : store->compressed;
+    store->cachedBlock = -1;
+    if (FileSeek(store->file, (off_t) store->blocks[k], SEEK_SET) != (off_t) store->blocks[k] ||
+        FileRead(store->file, buf, (int) clen) != clen)
+        elog(ERROR, "Cannot read document store!");
+#if PG_VERSION_NUM >= 90500
+    if (clen < rlen)
+    {
+        if (pglz_decompress(buf, (int32) clen, store->block, (int32) rlen) != rlen)
+            elog(ERROR, "Document store block %d corrupted!", k);
+    }
+#endif
+    store->cachedBlock = k;
+}
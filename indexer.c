@@ -17,8 +17,89 @@
  
 #include "qual_pushdown.h"
 
+#include <sys/stat.h>
+#include <time.h>
+
+#include "miscadmin.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 90500
+#include "access/xact.h"
+#include "commands/dbcommands.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#endif
+
+/*
+ * A document of the data path, as recorded in the manifest of an index
+ * generation
+ */
+typedef struct ManifestEntry
+{
+    char    *name;      /* file name, the doc id */
+    long    mtime;      /* modification time when indexed */
+    long    size;       /* size in bytes when indexed */
+    int     segment;    /* generation of the segment indexing it */
+} ManifestEntry;
+
+/* task file of an index worker, relative to the data directory */
+#define INDEX_TASK_FILE "dc_fdw.%d.%d.task"
+
+/* progress of the index build running in this process */
+static IndexProgress progress;
+static char *progressPath = NULL;   /* NULL when not reporting */
+static time_t progressTime = 0;     /* last time progress was written */
+
+/*
+ * A SPIM run or an index segment being merged
+ */
+typedef struct RunReader
+{
+    TermDictionary  *dict;  /* dictionary of the run */
+    DictIterator    *iter;  /* current term of the run */
+    PostingsFile    *post;  /* postings of the run */
+} RunReader;
+
 int cmpDocIds(const void *p1, const void *p2);
+int cmpDictEntries(const void *p1, const void *p2);
+DictionaryEntry ** sortDictEntries(HTAB *dict, int *nentries);
 void dumpIndex(HTAB *dict, File dictFile, File postFile);
+void writePostings(DictWriter *dictWriter, File postFile, char *key, int *slist, int n, int64 *cursor);
+void installIndexFiles(char *indexpath);
+char ** listDataDir(char *datapath, int *nfiles);
+int cmpDocNames(const void *p1, const void *p2);
+int indexDoc(HTAB *dict, char *datapath, char *fname, Oid cfgId);
+int64 buildRuns(char *datapath, char *indexpath, char *prefix, char **fnames, int nfiles,
+                int bufThreshold, Oid cfgId, List **dictfnames, List **postfnames);
+void dumpRun(HTAB *dict, char *indexpath, char *prefix, int run, List **dictfnames, List **postfnames);
+void mergeRuns(List *dictfnames, List *postfnames, char *indexpath);
+void removeRuns(List *dictfnames, List *postfnames);
+void writeStat(char *indexpath, int ndocs, int64 nbytes, Oid cfgId);
+ManifestEntry * scanDataDir(char *datapath, int *nfiles);
+ManifestEntry * readManifest(char *path, int *nentries);
+void writeManifest(char *path, ManifestEntry *entries, int nentries);
+List * diffManifest(char *indexdir, int generation, List *prevSegments,
+                    ManifestEntry *manifest, int nmanifest, ManifestEntry *files, int nfiles,
+                    char **fnames, int *nnew, int *ntombstoned);
+int findSegment(List *segments, int generation);
+void removeUnusedSegments(char *indexdir, List *generations, List *segments);
+int mergeSegments(char *indexdir, int generation, List *segments, ManifestEntry *files, int nfiles,
+                    int64 nbytes, Oid cfgId, int merge_factor, int pack_docs, List **mergedSegments);
+int segmentTier(int64 size, int merge_factor);
+void mergeSegmentFiles(char *indexdir, List *selected, char *indexpath);
+void beginProgress(char *path, int generation);
+void reportProgress(bool force);
+void endProgress(char *phase);
+#if PG_VERSION_NUM >= 90500
+void writeIndexTask(char *taskpath, char *datapath, char *indexpath, int bufThreshold,
+                    Oid cfgId, char **fnames, int nfiles);
+void runIndexPartition(char *datapath, char *indexpath, int worker, char **fnames, int nfiles,
+                        int bufThreshold, Oid cfgId, int64 *nbytes);
+void collectWorkerRuns(char *indexpath, int worker, List **dictfnames, List **postfnames, int64 *nbytes);
+#endif
+int cmpRuns(RunReader *runs, int r1, int r2);
+void runHeapSiftUp(RunReader *runs, int *heap, int pos);
+void runHeapSiftDown(RunReader *runs, int *heap, int nheap, int pos);
 
 /*
  * function compare 2 posting entries, essentially integers
@@ -30,38 +111,65 @@ cmpDocIds(const void *p1, const void *p2)
 }
 
 /*
- * Basic (in memory) index function
+ * function compare 2 dictionary entries by term
  */
 int
-imIndex(char *datapath, char *indexpath)
+cmpDictEntries(const void *p1, const void *p2)
 {
-    /* Data directory */
-    DIR             *datadir;
-    struct dirent   *dirent;
-    char            *fileContentBuf;
-    StringInfoData  sidCurrFilePath;
+    return strcmp((*(DictionaryEntry **) p1)->key, (*(DictionaryEntry **) p2)->key);
+}
+
+/*
+ * entries of an in-memory dictionary in term order, as required by
+ * the blocked dictionary file
+ */
+DictionaryEntry **
+sortDictEntries(HTAB *dict, int *nentries)
+{
+    HASH_SEQ_STATUS status;
+    DictionaryEntry *dEntry;
+    DictionaryEntry **entries;
+    int n = 0;
+    
+    entries = (DictionaryEntry **) palloc(sizeof(DictionaryEntry *) * Max(hash_get_num_entries(dict), 1));
+    hash_seq_init(&status, dict);
+    while ((dEntry = (DictionaryEntry *) hash_seq_search(&status)) != NULL)
+        entries[n++] = dEntry;
+    qsort((void *) entries, n, sizeof(DictionaryEntry *), cmpDictEntries);
+    
+    *nentries = n;
+    return entries;
+}
+
+/*
+ * Basic (in memory) index function: index the documents fnames[0..nfiles)
+ * of the data path into the dict and post files of indexpath, with text
+ * search configuration cfgId. Return the number of bytes tokenized.
+ */
+int64
+imIndex(char *datapath, char *indexpath, Oid cfgId, char **fnames, int nfiles)
+{
+    int             i;
     StringInfoData  sidDictFilePath;
     StringInfoData  sidPostFilePath;
-    StringInfoData  sidStatFilePath;
-    File            currFile;
     File            dictFile;
     File            postFile;
-    File            statFile;
-    StringInfoData  sidStatLine;
-    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
     
     /* dictionary settings */
     HASHCTL         info;
     HTAB            *dict;
-    HASH_SEQ_STATUS status;
     DictionaryEntry *dEntry;
+    DictionaryEntry **entries;
+    DictWriter      *dictWriter;
+    int             nentries;
+    int             e;
     
     /* index file cursors */
-    int cursor = 0;
+    int64 cursor = POST_HEADER_SIZE;
     
     /* stats and of dc */
     int dcNumOfFiles = 0;
-    int dcNumOfBytes = 0;
+    int64 dcNumOfBytes = 0;
     
 #ifdef DEBUG
     elog(NOTICE, "%s", "imIndex");
@@ -73,114 +181,25 @@ imIndex(char *datapath, char *indexpath)
     info.entrysize = sizeof(DictionaryEntry);
     dict = hash_create ("dict", MAXELEM, &info, HASH_ELEM);
     
-    /* Initialize data path */
-    datadir = AllocateDir(datapath);
-    if (datadir == NULL)
-    {
-        elog(ERROR, "ERROR: Data path not found!");
-        return -1;
-    }
-    
     /* Initialize path strings */
-    initStringInfo(&sidCurrFilePath);
     initStringInfo(&sidDictFilePath);
     initStringInfo(&sidPostFilePath);
-    initStringInfo(&sidStatFilePath);
-    appendStringInfo(&sidDictFilePath, "%s/dict", indexpath);
-    appendStringInfo(&sidPostFilePath, "%s/post", indexpath);
-    appendStringInfo(&sidStatFilePath, "%s/stat", indexpath);
+    appendStringInfo(&sidDictFilePath, "%s/dict" TMP_SUFFIX, indexpath);
+    appendStringInfo(&sidPostFilePath, "%s/post" TMP_SUFFIX, indexpath);
     
     /*
      * Loop through data dir to read each of the files in the dir
      * and tokenize the content of the files.
      */
-    while( (dirent = ReadDir(datadir, datapath)) != NULL)
+    for (i = 0; i < nfiles; i++)
     {
         int             fileSize;
-        bool            found;
-        DictionaryEntry *re;
-        Oid             cfgId;
-        TSVector        tsvector;
-        int             o;
-        char            *lexemesptr;
-        WordEntry       *curentryptr;
         
 #ifdef DEBUG
-        elog(NOTICE, "-FILE NAME: %s", dirent->d_name);
+        elog(NOTICE, "-FILE NAME: %s", fnames[i]);
 #endif /* DEBUG */
         
-        /* 
-         * concat path and fname to full file name
-         * (ignore . and ..)
-         */
-        if (strcmp(".", dirent->d_name) == 0) continue;
-        if (strcmp("..", dirent->d_name) == 0) continue;
-        
-        resetStringInfo(&sidCurrFilePath);
-        appendStringInfo(&sidCurrFilePath, "%s/%s", datapath, dirent->d_name);
-
-#ifdef DEBUG
-        elog(NOTICE, "-CURR FILE NAME: %s", sidCurrFilePath.data);
-#endif
-
-        
-        /*
-         * 1. open file for processing
-         * 2. seek to the end and get the length of the file
-         * 3. rewind to the begining for reading
-         * 4. read file content into buffer
-         * 5. increase the size of total bytes in dc
-         */
-        currFile = PathNameOpenFile(sidCurrFilePath.data, O_RDONLY,  mode);
-        fileSize = FileSeek(currFile, 0, SEEK_END);
-        FileSeek(currFile, 0, SEEK_SET);
-        fileContentBuf = (char *) palloc(sizeof(char) * (fileSize + 1) );
-        FileRead(currFile, fileContentBuf, fileSize);
-        fileContentBuf[fileSize] = 0;
-        
-        /*
-         * tokenization:
-         * 1. Parse current document into a TSVector
-         * 2. Iterate the WordEntries in TSVector and add them into global Dictionary
-         */
-        cfgId = getTSCurrentConfig(true);
-        tsvector = (TSVector) DirectFunctionCall1( to_tsvector, PointerGetDatum(cstring_to_text(fileContentBuf)) );
-        lexemesptr = STRPTR(tsvector);
-        curentryptr = ARRPTR(tsvector);
-        for (o = 0; o < tsvector->size; o++) {
-            StringInfoData sidToken;
-            
-            initStringInfo (&sidToken);
-            appendBinaryStringInfo(&sidToken, lexemesptr + curentryptr->pos, curentryptr->len);
-#ifdef DEBUG
-            elog(NOTICE, "--TOKEN: %s", sidToken.data);
-#endif
-            /* search in the dictionary hash table to see if the entry already exists */
-            re = (DictionaryEntry *) hash_search(dict, (void *) sidToken.data, HASH_ENTER, &found);
-            if (found == TRUE) /* term appears in the dictionary */
-            {
-                re->plist = lappend_int(re->plist, atoi(dirent->d_name));
-            }
-            else /* term first appearing in the dictionary */
-                re->plist = list_make1_int(atoi(dirent->d_name));
-            curentryptr ++;
-        }
-        /* global entry for performing NOT */
-        re = (DictionaryEntry *) hash_search(dict, ALL, HASH_ENTER, &found);
-        if (found == TRUE)
-            re->plist = lappend_int(re->plist, atoi(dirent->d_name)); 
-        else
-            re->plist = list_make1_int( atoi(dirent->d_name) );
-
-        /*
-         *  Clean-up:
-         *  1. close paser handle
-         *  2. free buffer memory
-         *  3. close file
-         */
-        pfree(fileContentBuf);
-        pfree(tsvector);
-        FileClose(currFile);
+        fileSize = indexDoc(dict, datapath, fnames[i], cfgId);
         
         /*
          * document collection size counter
@@ -197,23 +216,26 @@ imIndex(char *datapath, char *indexpath)
     /*
      * Dumping hashtable into index file
      */
+    strlcpy(progress.phase, "writing", sizeof(progress.phase));
+    reportProgress(true);
 #ifdef DEBUG
         elog(NOTICE, "-DICT FILE NAME: %s", sidDictFilePath.data);
         elog(NOTICE, "-POST FILE NAME: %s", sidPostFilePath.data);
 #endif
-    dictFile = PathNameOpenFile(sidDictFilePath.data, O_RDWR | O_CREAT,  0666);
-    postFile = PathNameOpenFile(sidPostFilePath.data, O_RDWR | O_CREAT,  0666);
+    dictFile = PathNameOpenFile(sidDictFilePath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    postFile = PathNameOpenFile(sidPostFilePath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    writePostHeader(postFile);
+    dictWriter = dictWriterBegin(dictFile);
     
-    /* iterate keys */
-    hash_seq_init(&status, dict);
-    while ((dEntry = (DictionaryEntry *) hash_seq_search(&status)) != NULL)
+    /* iterate keys in term order */
+    entries = sortDictEntries(dict, &nentries);
+    for (e = 0; e < nentries; e++)
 	{
 	    ListCell   *cell;
-        StringInfoData sidPostList;
-        StringInfoData sidDictEntry;
         int *slist;
         int *slistCurr;
 
+        dEntry = entries[e];
 #ifdef DEBUG
         elog(NOTICE, "--DICT ENTRY:%s", dEntry->key);
 #endif		
@@ -228,409 +250,526 @@ imIndex(char *datapath, char *indexpath)
         }
         qsort((void *) slist, list_length(dEntry->plist), sizeof(int), cmpDocIds);
         
-        /* write postings list */
-        initStringInfo(&sidPostList);
-        /* serialize the list into a string of integers */
-        for (slistCurr = slist; slistCurr < slist + list_length(dEntry->plist); slistCurr ++)
-            appendStringInfo(&sidPostList, "%d ", *slistCurr);
-        
-        FileWrite (postFile, sidPostList.data, sidPostList.len);
-	    
-	     /* write dict entry */
-        initStringInfo(&sidDictEntry);
-        appendStringInfo(&sidDictEntry, "%s %d %d\n", dEntry->key, cursor, sidPostList.len);
-        FileWrite (dictFile, sidDictEntry.data, sidDictEntry.len);
-	    /* increase cursor */
-	    cursor += sidPostList.len;
-#ifdef DEBUG
-        elog(NOTICE, "%s", sidPostList.data);
-#endif
+        /* write postings list and dict entry */
+        writePostings(dictWriter, postFile, dEntry->key, slist, list_length(dEntry->plist), &cursor);
         pfree(slist);
 	}
     
-    FileClose(dictFile);
+    dictWriterEnd(dictWriter);
     FileClose(postFile);
-    FreeDir(datadir);
+    pfree(entries);
+    
+    return dcNumOfBytes;
+}
+
+
+/*
+ * Single-pass in-memory index function
+ *
+ * Documents are tokenized in doc id order into in-memory runs of about
+ * buffer_size MB. Each run is dumped to disk in term order, so every run
+ * covers a doc id range above the previous one and the runs can be
+ * combined by a streaming merge (see mergeRuns).
+ *
+ * fnames must be sorted by doc id. Return the number of bytes tokenized.
+ */
+int64
+spimIndex(char *datapath, char *indexpath, int buffer_size, Oid cfgId, char **fnames, int nfiles)
+{
+    int64   dcNumOfBytes;
+    List    *postfnames = NIL;
+    List    *dictfnames = NIL;
+    /* threshold for starting a new round (in bytes) */
+    int     bufThreshold = (buffer_size == 0 ? DEFAULT_INDEX_BUFF_SIZE : buffer_size) * 1024 * 1024;
     
-    /*
-     * Collection stats information
-     */
 #ifdef DEBUG
-        elog(NOTICE, "-STATS FILE NAME: %s", sidStatFilePath.data);
+    elog(NOTICE, "%s", "spimIndex");
+    elog(NOTICE, "DATA PATH: %s", datapath);
 #endif
-    statFile = PathNameOpenFile(sidStatFilePath.data, O_RDWR | O_CREAT,  0666);
-    
-    /* number of documents in the doc collection */
-    initStringInfo(&sidStatLine);
-    appendStringInfo(&sidStatLine, "NUM_OF_DOCS:%d\n", dcNumOfFiles);
-    FileWrite (statFile, sidStatLine.data, sidStatLine.len);
     
-    /* number of bytes in the doc collection */
-    resetStringInfo(&sidStatLine);
-    appendStringInfo(&sidStatLine, "NUM_OF_BYTES:%d", dcNumOfBytes);
-    FileWrite (statFile, sidStatLine.data, sidStatLine.len);
+    dcNumOfBytes = buildRuns(datapath, indexpath, "", fnames, nfiles, bufThreshold,
+                                cfgId, &dictfnames, &postfnames);
+    mergeRuns(dictfnames, postfnames, indexpath);
+    removeRuns(dictfnames, postfnames);
     
-    FileClose(statFile);	
-    return 0;
+    return dcNumOfBytes;
 }
 
-
 /*
- * Single-pass in-memory index function
+ * tokenize the documents fnames[0..nfiles) of the data path into runs,
+ * starting a new run whenever bufThreshold bytes of documents have been
+ * read (never if bufThreshold is 0). Runs are named after prefix and
+ * appended to the run lists. Return the number of bytes read.
  */
-int
-spimIndex(char *datapath, char *indexpath, int buffer_size)
+int64
+buildRuns(char *datapath, char *indexpath, char *prefix, char **fnames, int nfiles,
+            int bufThreshold, Oid cfgId, List **dictfnames, List **postfnames)
 {
-    /* Data directory */
-    DIR             *datadir;
-    struct dirent   *dirent;
-    char            *fileContentBuf;
-    StringInfoData  sidCurrFilePath;
-    StringInfoData  sidDictFilePath;
-    StringInfoData  sidPostFilePath;
-    StringInfoData  sidStatFilePath;
-    File            currFile;
-    File            dictFile;
-    File            postFile;
-    File            statFile;
-    StringInfoData  sidStatLine;
-    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-    
     /* dictionary settings */
     HASHCTL         info;
-    HTAB            *DICT;
     HTAB            *dict;
-    HASH_SEQ_STATUS status;
-    PostingInfo     *dEntry;
-    
-    /* List of dict and postings file */
-    List *postfnames = NIL;
-    List *dictfnames = NIL;
-    File currDict;
-    File currPost;
     
-    /* List of dictionaries in memory */
-    List *dicts = NIL;
-    
-    /* threshold for starting a new round (in bytes) */
-    int bufThreshold = (buffer_size == 0 ? DEFAULT_INDEX_BUFF_SIZE : buffer_size) * 1024 * 1024;
-    int bufCounter = 0;
+    int64 bufCounter = 0;
     /* index counter */
     int iCounter = 0;
-    StringInfoData sidTmpDictPath;
-    StringInfoData sidTmpPostPath;
-    
-    /* index file cursors */
-    int cursor = 0;
-    
-    /* stats and of dc */
-    int dcNumOfFiles = 0;
-    int dcNumOfBytes = 0;
+    int64 nbytes = 0;
     int i;
     
-#ifdef DEBUG
-    elog(NOTICE, "%s", "spimIndex");
-    elog(NOTICE, "DATA PATH: %s", datapath);
-#endif
-    
     /* initialize hash dictionary */
     info.keysize = KEYSIZE;
     info.entrysize = sizeof(DictionaryEntry);
-    DICT = hash_create ("DICT", MAXELEM, &info, HASH_ELEM);
     dict = hash_create ("dict", MAXELEM, &info, HASH_ELEM);
     
-    /* Initialize data path */
-    datadir = AllocateDir(datapath);
-    if (datadir == NULL)
-    {
-        elog(ERROR, "ERROR: Data path not found!");
-        return -1;
-    }
-    
-    /* Initialize path strings */
-    initStringInfo(&sidTmpDictPath);
-    initStringInfo(&sidTmpPostPath);
-    initStringInfo(&sidCurrFilePath);
-    initStringInfo(&sidDictFilePath);
-    initStringInfo(&sidPostFilePath);
-    initStringInfo(&sidStatFilePath);
-    appendStringInfo(&sidDictFilePath, "%s/dict", indexpath);
-    appendStringInfo(&sidPostFilePath, "%s/post", indexpath);
-    appendStringInfo(&sidStatFilePath, "%s/stat", indexpath);
-    
-    /*
-     * Loop through data dir to read each of the files in the dir
-     * and tokenize the content of the files.
-     */
-    while( (dirent = ReadDir(datadir, datapath)) != NULL)
+    for (i = 0; i < nfiles; i++)
     {
-        int             fileSize;
-        bool            found;
-        bool            foundGlobal;
-        DictionaryEntry *re;
-        Oid             cfgId;
-        TSVector        tsvector;
-        int             o;
-        char            *lexemesptr;
-        WordEntry       *curentryptr;
+        int fileSize;
         
 #ifdef DEBUG
-        elog(NOTICE, "-FILE NAME: %s", dirent->d_name);
+        elog(NOTICE, "-FILE NAME: %s", fnames[i]);
 #endif /* DEBUG */
         
-        if (bufCounter > bufThreshold)
+        if (bufThreshold > 0 && bufCounter > bufThreshold)
         {   
-            StringInfoData sidTmpDictPath;
-            StringInfoData sidTmpPostPath;
-            initStringInfo(&sidTmpDictPath);
-            initStringInfo(&sidTmpPostPath);
-            appendStringInfo(&sidTmpDictPath, "%s/%d.dict", indexpath, iCounter);
-            appendStringInfo(&sidTmpPostPath, "%s/%d.post", indexpath, iCounter);
-            elog(NOTICE, "I_DFILES:%s", sidTmpDictPath.data);
-            /* serialize current buffer */
-            currDict = PathNameOpenFile(sidTmpDictPath.data, O_RDWR | O_CREAT,  mode);
-            currPost = PathNameOpenFile(sidTmpPostPath.data, O_RDWR | O_CREAT,  mode);
-            dumpIndex(dict, currDict, currPost);
+            /* serialize current buffer and start a new round */
+            dumpRun(dict, indexpath, prefix, iCounter, dictfnames, postfnames);
             hash_destroy(dict);
-            dictfnames = lappend(dictfnames, (void *) sidTmpDictPath.data);
-            postfnames = lappend(postfnames, (void *) sidTmpPostPath.data);
-            /* start a new round */
             dict = hash_create ("dict", MAXELEM, &info, HASH_ELEM);
             /* reset counter */
             bufCounter = 0;
             iCounter ++;
         }
-        /* 
-         * concat path and fname to full file name
-         * (ignore . and ..)
-         */
-        if (strcmp(".", dirent->d_name) == 0) continue;
-        if (strcmp("..", dirent->d_name) == 0) continue;
-
-        resetStringInfo(&sidCurrFilePath);
-        appendStringInfo(&sidCurrFilePath, "%s/%s", datapath, dirent->d_name);
-
-
-        /*
-         * 1. open file for processing
-         * 2. seek to the end and get the length of the file
-         * 3. rewind to the begining for reading
-         * 4. read file content into buffer
-         * 5. increase the size of total bytes in dc
-         */
-        currFile = PathNameOpenFile(sidCurrFilePath.data, O_RDONLY,  mode);
-        fileSize = FileSeek(currFile, 0, SEEK_END);
-        FileSeek(currFile, 0, SEEK_SET);
-        fileContentBuf = (char *) palloc(sizeof(char) * (fileSize + 1) );
-        FileRead(currFile, fileContentBuf, fileSize);
-        fileContentBuf[fileSize] = 0;
-
-        /*
-         * tokenization:
-         * 1. Parse current document into a TSVector
-         * 2. Iterate the WordEntries in TSVector and add them into global Dictionary
-         */
-        cfgId = getTSCurrentConfig(true);
-        tsvector = (TSVector) DirectFunctionCall1( to_tsvector, PointerGetDatum(cstring_to_text(fileContentBuf)) );
-        lexemesptr = STRPTR(tsvector);
-        curentryptr = ARRPTR(tsvector);
-        for (o = 0; o < tsvector->size; o++) {
-            StringInfoData sidToken;
-
-            initStringInfo (&sidToken);
-            appendBinaryStringInfo(&sidToken, lexemesptr + curentryptr->pos, curentryptr->len);
-#ifdef DEBUG
-            //elog(NOTICE, "--TOKEN: %s", sidToken.data);
-#endif
-            /* search in the dictionary hash table to see if the entry already exists */
-            re = (DictionaryEntry *) hash_search(dict, (void *) sidToken.data, HASH_ENTER, &found);
-            hash_search(DICT, (void *) sidToken.data, HASH_ENTER, &foundGlobal);
-            if (found == TRUE) /* term appears in the dictionary */
-            {
-                re->plist = lappend_int(re->plist, atoi(dirent->d_name));
-            }
-            else /* term first appearing in the dictionary */
-                re->plist = list_make1_int(atoi(dirent->d_name));
-            curentryptr ++;
-        }
-        /* global entry for performing NOT */
-        re = (DictionaryEntry *) hash_search(dict, ALL, HASH_ENTER, &found);
-        if (found == TRUE)
-            re->plist = lappend_int(re->plist, atoi(dirent->d_name)); 
-        else {
-            re->plist = list_make1_int( atoi(dirent->d_name) );
-            hash_search(DICT, ALL, HASH_ENTER, &foundGlobal);
-        }
-        
-
-        /*
-         *  Clean-up:
-         *  1. close paser handle
-         *  2. free buffer memory
-         *  3. close file
-         */
-        pfree(fileContentBuf);
-        pfree(tsvector);
-        FileClose(currFile);
         
+        fileSize = indexDoc(dict, datapath, fnames[i], cfgId);
         bufCounter += fileSize;
-        
-        /*
-         * document collection size counter
-         */
-        dcNumOfBytes += fileSize;
-        dcNumOfFiles ++;
+        nbytes += fileSize;
     }
     
     /* serialize the remaining */
-    initStringInfo(&sidTmpDictPath);
-    initStringInfo(&sidTmpPostPath);
-    appendStringInfo(&sidTmpDictPath, "%s/%d.dict", indexpath, iCounter);
-    appendStringInfo(&sidTmpPostPath, "%s/%d.post", indexpath, iCounter);
-    
-    currDict = PathNameOpenFile(sidTmpDictPath.data, O_RDWR | O_CREAT,  mode);
-    currPost = PathNameOpenFile(sidTmpPostPath.data, O_RDWR | O_CREAT,  mode);
-    dumpIndex(dict, currDict, currPost);
+    dumpRun(dict, indexpath, prefix, iCounter, dictfnames, postfnames);
     hash_destroy(dict);
-    dictfnames = lappend(dictfnames, (void *) sidTmpDictPath.data);
-    postfnames = lappend(postfnames, (void *) sidTmpPostPath.data);
     
-#ifdef DEBUG
-    elog(NOTICE, "NUM OF FILES: %d", dcNumOfFiles);
-#endif
+    return nbytes;
+}
 
+/*
+ * remove the files of merged runs
+ */
+void
+removeRuns(List *dictfnames, List *postfnames)
+{
+    ListCell *cell;
     
-    /*
-     * iterate keys in global dict and retrieve the postings
-     */
-#ifdef DEBUG
-        elog(NOTICE, "-DICT FILE NAME: %s", sidDictFilePath.data);
-        elog(NOTICE, "-POST FILE NAME: %s", sidPostFilePath.data);
-#endif
-    dictFile = PathNameOpenFile(sidDictFilePath.data, O_RDWR | O_CREAT,  0666);
-    postFile = PathNameOpenFile(sidPostFilePath.data, O_RDWR | O_CREAT,  0666);
-    /* open dicts one by one */
-    for(i = 0; i < list_length(dictfnames); i++)
-    {
-        HTAB *currdict;
-        
-        char *dfname = (char *) list_nth(dictfnames, i);
-        File currdfile = PathNameOpenFile(dfname, O_RDONLY,  0666);
-        loadDict(&currdict, currdfile);
-        FileClose(currdfile);
-        dicts = lappend(dicts, currdict);
-    }
-    
-    /* iterate keys */
-    hash_seq_init(&status, DICT);
-    while ((dEntry = (PostingInfo *) hash_seq_search(&status)) != NULL)
-	{
-	    ListCell    *cell;
-        StringInfoData sidPostList;
-        StringInfoData sidDictEntry;
-        List *plist = NIL;
-        int *slist;
-        int *slistCurr;
-        int i;
+    foreach(cell, dictfnames)
+        remove((char *) lfirst(cell));
+    foreach(cell, postfnames)
+        remove((char *) lfirst(cell));
+    list_free(dictfnames);
+    list_free(postfnames);
+}
 
-#ifdef DEBUG
-        //elog(NOTICE, "--DICT ENTRY:%s", dEntry->key);
-#endif		
-        for(i = 0; i < list_length(dicts); i++)
-        {
-            char *pfname = (char *) list_nth(postfnames, i);
-            File currpfile = PathNameOpenFile(pfname, O_RDONLY,  0666);
-            plist = list_concat(plist, searchTerm(dEntry->key, (HTAB *) list_nth(dicts, i), currpfile, FALSE, TRUE));
-            FileClose(currpfile);
-        }
-            
-        /* sort postings list by doc_id */
-        slist = (int *) palloc(list_length(plist) * sizeof(int));
-        slistCurr = slist;
-        foreach(cell, plist)
-        {
-            *slistCurr = lfirst_int(cell);
-            slistCurr ++;
-        }
-        qsort((void *) slist, list_length(plist), sizeof(int), cmpDocIds);
-        
-        /* write postings list */
-        initStringInfo(&sidPostList);
-        /* serialize the list into a string of integers */
-        for (slistCurr = slist; slistCurr < slist + list_length(plist); slistCurr ++)
-            appendStringInfo(&sidPostList, "%d ", *slistCurr);
-        
-        FileWrite (postFile, sidPostList.data, sidPostList.len);
-	    
-	     /* write dict entry */
-        initStringInfo(&sidDictEntry);
-        appendStringInfo(&sidDictEntry, "%s %d %d\n", dEntry->key, cursor, sidPostList.len);
-        FileWrite (dictFile, sidDictEntry.data, sidDictEntry.len);
-	    /* increase cursor */
-	    cursor += sidPostList.len;
-#ifdef DEBUG
-        elog(NOTICE, "%s", sidPostList.data);
-#endif
-        pfree(slist);
-        list_free(plist);
-	}
+/*
+ * write collection stats information of a new index, and the text search
+ * configuration its documents were tokenized with
+ */
+void
+writeStat(char *indexpath, int ndocs, int64 nbytes, Oid cfgId)
+{
+    StringInfoData  sidStatFilePath;
+    StringInfoData  sidStatLine;
+    File            statFile;
     
-    /* clean up handles, buffer and remove tmpfiles */
-    for(i = 0; i < list_length(postfnames); i++)
-    {
-        char *pfname = (char *) list_nth(postfnames, i);
-        char *dfname = (char *) list_nth(dictfnames, i);
-        remove(pfname);
-        remove(dfname);
-    }
-    FileClose(dictFile);
-    FileClose(postFile);
-    FreeDir(datadir);
-    list_free(postfnames);
-    list_free(dictfnames);
-    /*
-     * Collection stats information
-     */
+    initStringInfo(&sidStatFilePath);
+    appendStringInfo(&sidStatFilePath, "%s/stat" TMP_SUFFIX, indexpath);
 #ifdef DEBUG
         elog(NOTICE, "-STATS FILE NAME: %s", sidStatFilePath.data);
 #endif
-    statFile = PathNameOpenFile(sidStatFilePath.data, O_RDWR | O_CREAT,  0666);
+    statFile = PathNameOpenFile(sidStatFilePath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
     
     /* number of documents in the doc collection */
     initStringInfo(&sidStatLine);
-    appendStringInfo(&sidStatLine, "NUM_OF_DOCS:%d\n", dcNumOfFiles);
+    appendStringInfo(&sidStatLine, "NUM_OF_DOCS:%d\n", ndocs);
     FileWrite (statFile, sidStatLine.data, sidStatLine.len);
     
     /* number of bytes in the doc collection */
     resetStringInfo(&sidStatLine);
-    appendStringInfo(&sidStatLine, "NUM_OF_BYTES:%d", dcNumOfBytes);
+    appendStringInfo(&sidStatLine, "NUM_OF_BYTES:" INT64_FORMAT "\n", nbytes);
+    FileWrite (statFile, sidStatLine.data, sidStatLine.len);
+    
+    /* text search configuration of the index */
+    resetStringInfo(&sidStatLine);
+    appendStringInfo(&sidStatLine, "TS_CONFIG:%u", cfgId);
     FileWrite (statFile, sidStatLine.data, sidStatLine.len);
     
-    FileClose(statFile);	
-    return 0;
+    FileClose(statFile);
+    pfree(sidStatFilePath.data);
+    pfree(sidStatLine.data);
 }
 
 /*
- * dump an in-memory hashtable to the disk
+ * list the documents of the data path, sorted by doc id
  */
-void
-dumpIndex(HTAB *dict, File dictFile, File postFile)
+char **
+listDataDir(char *datapath, int *nfiles)
+{
+    DIR             *datadir;
+    struct dirent   *dirent;
+    char            **fnames;
+    int             size = 1024;
+    int             n = 0;
+    
+    /* Initialize data path */
+    datadir = AllocateDir(datapath);
+    if (datadir == NULL)
+        elog(ERROR, "ERROR: Data path not found!");
+    
+    fnames = (char **) palloc(sizeof(char *) * size);
+    while( (dirent = ReadDir(datadir, datapath)) != NULL)
+    {
+        /* ignore . and .. */
+        if (strcmp(".", dirent->d_name) == 0) continue;
+        if (strcmp("..", dirent->d_name) == 0) continue;
+        
+        if (n == size)
+        {
+            size *= 2;
+            fnames = (char **) repalloc(fnames, sizeof(char *) * size);
+        }
+        fnames[n++] = pstrdup(dirent->d_name);
+    }
+    FreeDir(datadir);
+    
+    qsort((void *) fnames, n, sizeof(char *), cmpDocNames);
+    *nfiles = n;
+    return fnames;
+}
+
+/*
+ * function compare 2 document file names by doc id
+ */
+int
+cmpDocNames(const void *p1, const void *p2)
+{
+    int id1 = atoi(*(char **) p1);
+    int id2 = atoi(*(char **) p2);
+    
+    if (id1 != id2)
+        return (id1 < id2) ? -1 : 1;
+    return strcmp(*(char **) p1, *(char **) p2);
+}
+
+/*
+ * tokenize a document with text search configuration cfgId and add its
+ * terms to an in-memory dictionary. Return the size of the document in
+ * bytes.
+ */
+int
+indexDoc(HTAB *dict, char *datapath, char *fname, Oid cfgId)
+{
+    StringInfoData  sidCurrFilePath;
+    File            currFile;
+    char            *fileContentBuf;
+    int             fileSize;
+    int             docId = atoi(fname);
+    bool            found;
+    DictionaryEntry *re;
+    TSVector        tsvector;
+    int             o;
+    char            *lexemesptr;
+    WordEntry       *curentryptr;
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    
+    /* concat path and fname to full file name */
+    initStringInfo(&sidCurrFilePath);
+    appendStringInfo(&sidCurrFilePath, "%s/%s", datapath, fname);
+    
+#ifdef DEBUG
+    elog(NOTICE, "-CURR FILE NAME: %s", sidCurrFilePath.data);
+#endif
+    
+    /*
+     * 1. open file for processing
+     * 2. seek to the end and get the length of the file
+     * 3. rewind to the begining for reading
+     * 4. read file content into buffer
+     */
+    currFile = PathNameOpenFile(sidCurrFilePath.data, O_RDONLY,  mode);
+    fileSize = FileSeek(currFile, 0, SEEK_END);
+    FileSeek(currFile, 0, SEEK_SET);
+    fileContentBuf = (char *) palloc(sizeof(char) * (fileSize + 1) );
+    FileRead(currFile, fileContentBuf, fileSize);
+    fileContentBuf[fileSize] = 0;
+    
+    /*
+     * tokenization:
+     * 1. Parse current document into a TSVector
+     * 2. Iterate the WordEntries in TSVector and add them into global Dictionary
+     */
+    tsvector = (TSVector) DirectFunctionCall2( to_tsvector_byid, ObjectIdGetDatum(cfgId),
+                                                PointerGetDatum(cstring_to_text(fileContentBuf)) );
+    lexemesptr = STRPTR(tsvector);
+    curentryptr = ARRPTR(tsvector);
+    for (o = 0; o < tsvector->size; o++) {
+        StringInfoData sidToken;
+        
+        initStringInfo (&sidToken);
+        appendBinaryStringInfo(&sidToken, lexemesptr + curentryptr->pos, curentryptr->len);
+#ifdef DEBUG
+        elog(NOTICE, "--TOKEN: %s", sidToken.data);
+#endif
+        /* search in the dictionary hash table to see if the entry already exists */
+        re = (DictionaryEntry *) hash_search(dict, (void *) sidToken.data, HASH_ENTER, &found);
+        if (found == TRUE) /* term appears in the dictionary */
+            re->plist = lappend_int(re->plist, docId);
+        else /* term first appearing in the dictionary */
+            re->plist = list_make1_int(docId);
+        pfree(sidToken.data);
+        curentryptr ++;
+    }
+    /* global entry for performing NOT */
+    re = (DictionaryEntry *) hash_search(dict, ALL, HASH_ENTER, &found);
+    if (found == TRUE)
+        re->plist = lappend_int(re->plist, docId); 
+    else
+        re->plist = list_make1_int(docId);
+    
+    /*
+     *  Clean-up:
+     *  1. free buffer memory
+     *  2. close file
+     */
+    pfree(fileContentBuf);
+    pfree(tsvector);
+    pfree(sidCurrFilePath.data);
+    FileClose(currFile);
+    
+    progress.filesDone ++;
+    progress.bytesDone += fileSize;
+    reportProgress(false);
+    return fileSize;
+}
+
+/*
+ * dump an in-memory dictionary as the run number run of indexpath and
+ * remember the run files
+ */
+void
+dumpRun(HTAB *dict, char *indexpath, char *prefix, int run, List **dictfnames, List **postfnames)
+{
+    StringInfoData sidTmpDictPath;
+    StringInfoData sidTmpPostPath;
+    File currDict;
+    File currPost;
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    
+    initStringInfo(&sidTmpDictPath);
+    initStringInfo(&sidTmpPostPath);
+    appendStringInfo(&sidTmpDictPath, "%s/%s%d.dict", indexpath, prefix, run);
+    appendStringInfo(&sidTmpPostPath, "%s/%s%d.post", indexpath, prefix, run);
+#ifdef DEBUG
+    elog(NOTICE, "I_DFILES:%s", sidTmpDictPath.data);
+#endif
+    currDict = PathNameOpenFile(sidTmpDictPath.data, O_RDWR | O_CREAT | O_TRUNC,  mode);
+    currPost = PathNameOpenFile(sidTmpPostPath.data, O_RDWR | O_CREAT | O_TRUNC,  mode);
+    dumpIndex(dict, currDict, currPost);
+    progress.runsWritten ++;
+    reportProgress(true);
+    *dictfnames = lappend(*dictfnames, (void *) sidTmpDictPath.data);
+    *postfnames = lappend(*postfnames, (void *) sidTmpPostPath.data);
+}
+
+/*
+ * Streaming k-way merge of SPIM runs.
+ *
+ * Every run lists its terms in term order, so the runs are scanned
+ * sequentially side by side with a min-heap over the current term of
+ * each run. Runs cover ascending doc id ranges in run order (ties on a
+ * term are broken by run number), so the postings of a term are simply
+ * concatenated, without decoding into lists or sorting.
+ */
+void
+mergeRuns(List *dictfnames, List *postfnames, char *indexpath)
+{
+    int             nruns = list_length(dictfnames);
+    RunReader       *runs;
+    int             *heap;
+    int             nheap = 0;
+    File            dictFile;
+    File            postFile;
+    DictWriter      *dictWriter;
+    StringInfoData  sidDictFilePath;
+    StringInfoData  sidPostFilePath;
+    StringInfoData  sidTerm;
+    StringInfoData  sidPostList;
+    int64           cursor = POST_HEADER_SIZE;
+    int             i;
+    
+#ifdef DEBUG
+    elog(NOTICE, "mergeRuns");
+#endif
+    
+    /* open the runs and load the heap with their first terms */
+    runs = (RunReader *) palloc(sizeof(RunReader) * Max(nruns, 1));
+    heap = (int *) palloc(sizeof(int) * Max(nruns, 1));
+    for (i = 0; i < nruns; i++)
+    {
+        runs[i].dict = openDictPath((char *) list_nth(dictfnames, i));
+        runs[i].post = openPostPath((char *) list_nth(postfnames, i));
+        runs[i].iter = dictIterBegin(runs[i].dict);
+        if (dictIterNext(runs[i].iter))
+        {
+            heap[nheap] = i;
+            runHeapSiftUp(runs, heap, nheap++);
+        }
+    }
+    
+    initStringInfo(&sidDictFilePath);
+    initStringInfo(&sidPostFilePath);
+    appendStringInfo(&sidDictFilePath, "%s/dict" TMP_SUFFIX, indexpath);
+    appendStringInfo(&sidPostFilePath, "%s/post" TMP_SUFFIX, indexpath);
+#ifdef DEBUG
+    elog(NOTICE, "-DICT FILE NAME: %s", sidDictFilePath.data);
+    elog(NOTICE, "-POST FILE NAME: %s", sidPostFilePath.data);
+#endif
+    dictFile = PathNameOpenFile(sidDictFilePath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    postFile = PathNameOpenFile(sidPostFilePath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    writePostHeader(postFile);
+    dictWriter = dictWriterBegin(dictFile);
+    
+    strlcpy(progress.phase, "merging", sizeof(progress.phase));
+    progress.runsTotal = nruns;
+    reportProgress(true);
+    
+    initStringInfo(&sidTerm);
+    initStringInfo(&sidPostList);
+    while (nheap > 0)
+    {
+        int last = 0;
+        int count = 0;
+        
+        resetStringInfo(&sidTerm);
+        appendStringInfoString(&sidTerm, runs[heap[0]].iter->term.data);
+        resetStringInfo(&sidPostList);
+        
+        /* concatenate the postings of this term from every run having it */
+        while (nheap > 0 && strcmp(runs[heap[0]].iter->term.data, sidTerm.data) == 0)
+        {
+            RunReader   *run = &runs[heap[0]];
+            char        *pstr;
+            bool        copied;
+            
+            pstr = loadPostings(run->post, &run->iter->info, &copied);
+            appendPostings(&sidPostList, pstr, run->iter->info.len, &last, &count);
+            if (copied)
+                pfree(pstr);
+            
+            /* advance the run, or drop it from the heap when exhausted */
+            if (!dictIterNext(run->iter))
+                heap[0] = heap[--nheap];
+            runHeapSiftDown(runs, heap, nheap, 0);
+        }
+        
+        FileWrite (postFile, sidPostList.data, sidPostList.len);
+        dictWriterAdd(dictWriter, sidTerm.data, cursor, sidPostList.len, count);
+        cursor += sidPostList.len;
+        progress.termsMerged ++;
+        reportProgress(false);
+    }
+    
+    dictWriterEnd(dictWriter);
+    FileClose(postFile);
+    
+    for (i = 0; i < nruns; i++)
+    {
+        dictIterEnd(runs[i].iter);
+        closeDict(runs[i].dict);
+        closePost(runs[i].post);
+    }
+    pfree(runs);
+    pfree(heap);
+    pfree(sidDictFilePath.data);
+    pfree(sidPostFilePath.data);
+    pfree(sidTerm.data);
+    pfree(sidPostList.data);
+}
+
+/*
+ * order of two runs in the merge heap: current term, then run number
+ */
+int
+cmpRuns(RunReader *runs, int r1, int r2)
+{
+    int cmp = strcmp(runs[r1].iter->term.data, runs[r2].iter->term.data);
+    
+    if (cmp != 0)
+        return cmp;
+    return r1 - r2;
+}
+
+void
+runHeapSiftUp(RunReader *runs, int *heap, int pos)
+{
+    while (pos > 0)
+    {
+        int parent = (pos - 1) / 2;
+        int tmp;
+        
+        if (cmpRuns(runs, heap[parent], heap[pos]) <= 0)
+            break;
+        tmp = heap[parent];
+        heap[parent] = heap[pos];
+        heap[pos] = tmp;
+        pos = parent;
+    }
+}
+
+void
+runHeapSiftDown(RunReader *runs, int *heap, int nheap, int pos)
+{
+    for (;;)
+    {
+        int smallest = pos;
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        int tmp;
+        
+        if (left < nheap && cmpRuns(runs, heap[left], heap[smallest]) < 0)
+            smallest = left;
+        if (right < nheap && cmpRuns(runs, heap[right], heap[smallest]) < 0)
+            smallest = right;
+        if (smallest == pos)
+            break;
+        tmp = heap[smallest];
+        heap[smallest] = heap[pos];
+        heap[pos] = tmp;
+        pos = smallest;
+    }
+}
+
+/*
+ * dump an in-memory hashtable to the disk
+ */
+void
+dumpIndex(HTAB *dict, File dictFile, File postFile)
 {
-    HASH_SEQ_STATUS status;
     DictionaryEntry *dEntry;
-    int cursor = 0;
+    DictionaryEntry **entries;
+    DictWriter *dictWriter;
+    int nentries;
+    int e;
+    int64 cursor = POST_HEADER_SIZE;
 #ifdef DEBUG
     elog(NOTICE, "dumpIndex");
 #endif    
-    hash_seq_init(&status, dict);
-    while ((dEntry = (DictionaryEntry *) hash_seq_search(&status)) != NULL)
+    writePostHeader(postFile);
+    dictWriter = dictWriterBegin(dictFile);
+    entries = sortDictEntries(dict, &nentries);
+    for (e = 0; e < nentries; e++)
 	{
 	    ListCell   *cell;
-        StringInfoData sidPostList;
-        StringInfoData sidDictEntry;
         int *slist;
         int *slistCurr;
 
+        dEntry = entries[e];
 #ifdef DEBUG
         elog(NOTICE, "--DICT ENTRY:%s", dEntry->key);
 #endif
@@ -644,25 +783,1348 @@ dumpIndex(HTAB *dict, File dictFile, File postFile)
         }
         qsort((void *) slist, list_length(dEntry->plist), sizeof(int), cmpDocIds);
         
-        /* write postings list */
-        initStringInfo(&sidPostList);
-        /* serialize the list into a string of integers */
-        for (slistCurr = slist; slistCurr < slist + list_length(dEntry->plist); slistCurr ++)
-            appendStringInfo(&sidPostList, "%d ", *slistCurr);
-        
-        FileWrite (postFile, sidPostList.data, sidPostList.len);
-	    
-	     /* write dict entry */
-        initStringInfo(&sidDictEntry);
-        appendStringInfo(&sidDictEntry, "%s %d %d\n", dEntry->key, cursor, sidPostList.len);
-        FileWrite (dictFile, sidDictEntry.data, sidDictEntry.len);
-	    /* increase cursor */
-	    cursor += sidPostList.len;
-#ifdef DEBUG
-        elog(NOTICE, "plist:%s", sidPostList.data);
-#endif
+        /* write postings list and dict entry */
+        writePostings(dictWriter, postFile, dEntry->key, slist, list_length(dEntry->plist), &cursor);
         pfree(slist);
 	}
-    FileClose(dictFile);
+    dictWriterEnd(dictWriter);
     FileClose(postFile);
-}
\ No newline at end of file
+    pfree(entries);
+}
+/*
+ * serialize a sorted postings list into the postings file and write
+ * its dict entry pointing at it. cursor tracks the write position.
+ */
+void
+writePostings(DictWriter *dictWriter, File postFile, char *key, int *slist, int n, int64 *cursor)
+{
+    StringInfoData sidPostList;
+    
+    /* write postings list */
+    initStringInfo(&sidPostList);
+    encodePostings(&sidPostList, slist, n);
+    FileWrite (postFile, sidPostList.data, sidPostList.len);
+    
+    /* write dict entry */
+    dictWriterAdd(dictWriter, key, *cursor, sidPostList.len, n);
+    
+    /* increase cursor */
+    *cursor += sidPostList.len;
+#ifdef DEBUG
+    elog(NOTICE, "plist:%s %d", key, n);
+#endif
+    pfree(sidPostList.data);
+}
+
+/*
+ * move freshly written index files into place. Files are replaced by
+ * rename() rather than rewritten, so backends that still have the old
+ * files open or memory mapped keep reading a consistent copy.
+ */
+void
+installIndexFiles(char *indexpath)
+{
+    static const char *fnames[] = {"post", "dict", "stat", DOCIDX_FILE, DOCS_FILE, NULL};
+    const char  **fname;
+    
+    for (fname = fnames; *fname; fname++)
+    {
+        StringInfoData sidTmpPath;
+        StringInfoData sidPath;
+        struct stat st;
+        
+        initStringInfo(&sidTmpPath);
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidTmpPath, "%s/%s" TMP_SUFFIX, indexpath, *fname);
+        appendStringInfo(&sidPath, "%s/%s", indexpath, *fname);
+        /* the document store is optional */
+        if ((strcmp(*fname, DOCIDX_FILE) == 0 || strcmp(*fname, DOCS_FILE) == 0) &&
+            stat(sidTmpPath.data, &st) != 0)
+        {
+            pfree(sidTmpPath.data);
+            pfree(sidPath.data);
+            continue;
+        }
+        if (rename(sidTmpPath.data, sidPath.data) != 0)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not rename file \"%s\" to \"%s\": %m",
+                            sidTmpPath.data, sidPath.data)));
+        pfree(sidTmpPath.data);
+        pfree(sidPath.data);
+    }
+}
+
+/*
+ * Build a new generation of the index of a collection.
+ *
+ * Every build writes a fresh segment directory g<N> in the index dir,
+ * with the stats and the manifest of the whole collection as of
+ * generation N, and then switches the segment list in CURRENT (see
+ * segment.c), so queries keep planning with the last complete
+ * generation meanwhile.
+ *
+ * A full build indexes every document into the new segment, which
+ * replaces all others. An incremental build compares the data path with
+ * the manifest of the generation in use: only new and changed documents
+ * are indexed into the new segment, and changed and deleted ones are
+ * tombstoned in the segment holding them.
+ *
+ * With pack_docs, the new segment also gets a packed document store of
+ * the documents it indexes, compressed with compress_docs (see
+ * docstore.c).
+ *
+ * Documents are tokenized with text search configuration cfgId, the
+ * configuration of the session starting the build, which is recorded in
+ * the stats of the generation. An incremental build under another
+ * configuration than the generation in use rebuilds the whole index, so
+ * that all segments share one.
+ *
+ * With a merge_factor above 1, the merge policy then runs on the new
+ * generation (see mergeSegments()) until no size tier is full. Merges
+ * run at the end of the build, in the same background worker: queries
+ * use the new segment as soon as it is written, and each merge switches
+ * CURRENT again once done.
+ *
+ * Segments and tombstones no longer used by the generations written by
+ * this build or by the previous generation (kept for queries planned
+ * just before the switch) are removed.
+ */
+void
+buildIndex(char *datapath, char *indexdir, char *method, int buffer_size, int nworkers,
+            Oid cfgId, bool incremental, int merge_factor, int pack_docs)
+{
+    int             prevGeneration;
+    List            *prevSegments = readSegmentList(indexdir, &prevGeneration);
+    int             generation = prevGeneration + 1;
+    List            *segments = NIL;
+    SegmentRef      *newSegment;
+    List            *mergedSegments;
+    int             mergedGeneration;
+    List            *keepGenerations;
+    List            *keepSegments;
+    ManifestEntry   *files;
+    int             nfiles;
+    ManifestEntry   *manifest = NULL;
+    int             nmanifest = 0;
+    char            **fnames;
+    int             nnew = 0;
+    int             ntombstoned = 0;
+    int64           nbytes = 0;
+    StringInfoData  sidGenPath;
+    StringInfoData  sidPath;
+    struct stat     st;
+    int             i;
+    
+    initStringInfo(&sidGenPath);
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidGenPath, "%s/g%d", indexdir, generation);
+    
+    /* documents to index */
+    files = scanDataDir(datapath, &nfiles);
+    fnames = (char **) palloc(sizeof(char *) * Max(nfiles, 1));
+    if (incremental)
+    {
+        if (prevGeneration > 0)
+        {
+            appendStringInfo(&sidPath, "%s/g%d/" MANIFEST_FILE, indexdir, prevGeneration);
+            manifest = readManifest(sidPath.data, &nmanifest);
+        }
+        if (manifest == NULL)
+        {
+            elog(NOTICE, "%s", "-The index in use has no manifest, rebuilding the whole index");
+            incremental = FALSE;
+        }
+    }
+    if (incremental)
+    {
+        CollectionStats prevStats;
+        CollectionStats *pstats = &prevStats;
+        File            statFile;
+        
+        resetStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/g%d", indexdir, prevGeneration);
+        statFile = openStat(sidPath.data);
+        loadStat(&pstats, statFile);
+        closeStat(statFile);
+        if (prevStats.cfgId != cfgId)
+        {
+            elog(NOTICE, "%s", "-The index in use was built with another text search configuration, rebuilding the whole index");
+            incremental = FALSE;
+        }
+    }
+    if (incremental)
+    {
+        segments = diffManifest(indexdir, generation, prevSegments, manifest, nmanifest,
+                                files, nfiles, fnames, &nnew, &ntombstoned);
+        if (nnew == 0 && ntombstoned == 0)
+        {
+            elog(NOTICE, "%s", "-The index is up to date");
+            resetStringInfo(&sidPath);
+            appendStringInfo(&sidPath, "%s/" PROGRESS_FILE, indexdir);
+            beginProgress(sidPath.data, prevGeneration);
+            endProgress("done");
+            return;
+        }
+    }
+    else
+    {
+        for (i = 0; i < nfiles; i++)
+        {
+            files[i].segment = generation;
+            fnames[nnew++] = files[i].name;
+        }
+    }
+    
+    /* leftover of a failed build */
+    if (stat(sidGenPath.data, &st) == 0)
+        rmtree(sidGenPath.data, true);
+    if (mkdir(sidGenPath.data, S_IRWXU) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create directory \"%s\": %m", sidGenPath.data)));
+    
+    resetStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/" PROGRESS_FILE, indexdir);
+    beginProgress(sidPath.data, generation);
+    PG_TRY();
+    {
+        progress.filesTotal = nnew;
+        reportProgress(true);
+        if (nworkers > 1)
+            parallelIndex(datapath, sidGenPath.data, method, buffer_size, nworkers, cfgId, fnames, nnew);
+        else if (strcmp(method, "SPIM") == 0)
+            spimIndex(datapath, sidGenPath.data, buffer_size, cfgId, fnames, nnew);
+        else
+            imIndex(datapath, sidGenPath.data, cfgId, fnames, nnew);
+        if (pack_docs != DOCS_NOT_PACKED)
+            writeDocStore(datapath, sidGenPath.data, fnames, nnew, pack_docs);
+        
+        /* stats and manifest of the whole collection */
+        for (i = 0; i < nfiles; i++)
+            nbytes += files[i].size;
+        writeStat(sidGenPath.data, nfiles, nbytes, cfgId);
+        resetStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/" MANIFEST_FILE, sidGenPath.data);
+        writeManifest(sidPath.data, files, nfiles);
+        installIndexFiles(sidGenPath.data);
+        
+        newSegment = (SegmentRef *) palloc(sizeof(SegmentRef));
+        newSegment->name = pstrdup(sidGenPath.data + strlen(indexdir) + 1);
+        newSegment->tombstones = NULL;
+        segments = lappend(segments, newSegment);
+        writeSegmentList(indexdir, generation, segments);
+        keepGenerations = list_make2_int(generation, prevGeneration);
+        keepSegments = list_concat(list_copy(segments), list_copy(prevSegments));
+        
+        /*
+         * keep the number of segments in check, until no tier is full: a
+         * merged segment may fill the tier above
+         */
+        mergedGeneration = generation;
+        mergedSegments = segments;
+        while (merge_factor > 1)
+        {
+            int     lastGeneration = mergedGeneration;
+            
+            mergedGeneration = mergeSegments(indexdir, lastGeneration, mergedSegments, files, nfiles,
+                                                nbytes, cfgId, merge_factor, pack_docs, &mergedSegments);
+            if (mergedGeneration == lastGeneration)
+                break;
+            keepGenerations = lappend_int(keepGenerations, mergedGeneration);
+            keepSegments = list_concat(keepSegments, list_copy(mergedSegments));
+        }
+        
+        removeUnusedSegments(indexdir, keepGenerations, keepSegments);
+    }
+    PG_CATCH();
+    {
+        endProgress("failed");
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    endProgress("done");
+    
+    pfree(sidGenPath.data);
+    pfree(sidPath.data);
+}
+
+/*
+ * list the documents of the data path with their mtime and size
+ */
+ManifestEntry *
+scanDataDir(char *datapath, int *nfiles)
+{
+    char            **fnames;
+    int             n;
+    ManifestEntry   *files;
+    int             nfound = 0;
+    int             i;
+    
+    fnames = listDataDir(datapath, &n);
+    files = (ManifestEntry *) palloc(sizeof(ManifestEntry) * Max(n, 1));
+    for (i = 0; i < n; i++)
+    {
+        StringInfoData  sidPath;
+        struct stat     st;
+        
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/%s", datapath, fnames[i]);
+        /* skip files gone since listed */
+        if (stat(sidPath.data, &st) == 0)
+        {
+            files[nfound].name = fnames[i];
+            files[nfound].mtime = (long) st.st_mtime;
+            files[nfound].size = (long) st.st_size;
+            files[nfound].segment = 0;
+            nfound ++;
+        }
+        pfree(sidPath.data);
+    }
+    pfree(fnames);
+    
+    *nfiles = nfound;
+    return files;
+}
+
+/*
+ * read a manifest, return NULL if there is none. Entries are in doc id
+ * order, as written.
+ */
+ManifestEntry *
+readManifest(char *path, int *nentries)
+{
+    FILE            *mfile;
+    ManifestEntry   *entries;
+    char            name[MAXPGPATH];
+    long            mtime;
+    long            size;
+    int             segment;
+    int             n = 0;
+    int             nalloc = 1024;
+    
+    mfile = AllocateFile(path, PG_BINARY_R);
+    if (mfile == NULL)
+        return NULL;
+    entries = (ManifestEntry *) palloc(sizeof(ManifestEntry) * nalloc);
+    while (fscanf(mfile, "%1023s %ld %ld %d", name, &mtime, &size, &segment) == 4)
+    {
+        if (n == nalloc)
+        {
+            nalloc *= 2;
+            entries = (ManifestEntry *) repalloc(entries, sizeof(ManifestEntry) * nalloc);
+        }
+        entries[n].name = pstrdup(name);
+        entries[n].mtime = mtime;
+        entries[n].size = size;
+        entries[n].segment = segment;
+        n ++;
+    }
+    if (!feof(mfile))
+        elog(ERROR, "Manifest file \"%s\" corrupted!", path);
+    FreeFile(mfile);
+    
+    *nentries = n;
+    return entries;
+}
+
+/*
+ * write the manifest of a generation: name, mtime, size and segment of
+ * every document
+ */
+void
+writeManifest(char *path, ManifestEntry *entries, int nentries)
+{
+    FILE    *mfile;
+    int     i;
+    
+    mfile = AllocateFile(path, PG_BINARY_W);
+    if (mfile == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", path)));
+    for (i = 0; i < nentries; i++)
+        fprintf(mfile, "%s %ld %ld %d\n", entries[i].name, entries[i].mtime,
+                entries[i].size, entries[i].segment);
+    if (FreeFile(mfile) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", path)));
+}
+
+/*
+ * Compare the documents of the data path with the manifest of the index
+ * in use; both are sorted by doc id. Unchanged documents stay in their
+ * segment, new and changed ones are queued in fnames for the new
+ * segment, and changed and deleted ones are tombstoned in the segment
+ * holding them. Return the segment list of the new generation, without
+ * the new segment.
+ */
+List *
+diffManifest(char *indexdir, int generation, List *prevSegments,
+                ManifestEntry *manifest, int nmanifest, ManifestEntry *files, int nfiles,
+                char **fnames, int *nnew, int *ntombstoned)
+{
+    int             nsegments = list_length(prevSegments);
+    unsigned char   **bits;
+    int             *nbytes;
+    bool            *changed;
+    List            *segments = NIL;
+    ListCell        *cell;
+    int             m = 0;
+    int             f = 0;
+    int             k;
+    
+    bits = (unsigned char **) palloc0(sizeof(unsigned char *) * Max(nsegments, 1));
+    nbytes = (int *) palloc0(sizeof(int) * Max(nsegments, 1));
+    changed = (bool *) palloc0(sizeof(bool) * Max(nsegments, 1));
+    
+    /* current tombstones of each segment */
+    k = 0;
+    foreach(cell, prevSegments)
+    {
+        SegmentRef *ref = (SegmentRef *) lfirst(cell);
+        
+        if (ref->tombstones != NULL)
+        {
+            StringInfoData sidPath;
+            
+            initStringInfo(&sidPath);
+            appendStringInfo(&sidPath, "%s/%s/%s", indexdir, ref->name, ref->tombstones);
+            bits[k] = loadTombstones(sidPath.data, &nbytes[k]);
+            pfree(sidPath.data);
+        }
+        k ++;
+    }
+    
+    while (m < nmanifest || f < nfiles)
+    {
+        int cmp;
+        
+        if (m == nmanifest)
+            cmp = 1;
+        else if (f == nfiles)
+            cmp = -1;
+        else
+            cmp = cmpDocNames(&manifest[m].name, &files[f].name);
+        
+        /* unchanged */
+        if (cmp == 0 && manifest[m].mtime == files[f].mtime && manifest[m].size == files[f].size)
+        {
+            files[f].segment = manifest[m].segment;
+            m ++;
+            f ++;
+            continue;
+        }
+        
+        /* deleted or changed: tombstone the indexed copy */
+        if (cmp <= 0)
+        {
+            int id = atoi(manifest[m].name);
+            
+            k = findSegment(prevSegments, manifest[m].segment);
+            if (k < 0)
+                elog(ERROR, "Manifest refers to unknown segment g%d!", manifest[m].segment);
+            if (id >= 0)
+            {
+                if (id / 8 >= nbytes[k])
+                {
+                    int size = Max(id / 8 + 1, nbytes[k] * 2);
+                    
+                    bits[k] = (bits[k] == NULL) ? (unsigned char *) palloc(size) :
+                                (unsigned char *) repalloc(bits[k], size);
+                    MemSet(bits[k] + nbytes[k], 0, size - nbytes[k]);
+                    nbytes[k] = size;
+                }
+                bits[k][id / 8] |= (1 << (id % 8));
+                changed[k] = TRUE;
+            }
+            (*ntombstoned) ++;
+            m ++;
+        }
+        
+        /* new or changed: index into the new segment */
+        if (cmp >= 0)
+        {
+            files[f].segment = generation;
+            fnames[(*nnew)++] = files[f].name;
+            f ++;
+        }
+    }
+    
+    /* write the tombstones of this generation */
+    k = 0;
+    foreach(cell, prevSegments)
+    {
+        SegmentRef *ref = (SegmentRef *) lfirst(cell);
+        SegmentRef *newRef = (SegmentRef *) palloc(sizeof(SegmentRef));
+        
+        newRef->name = ref->name;
+        newRef->tombstones = ref->tombstones;
+        if (changed[k])
+        {
+            StringInfoData sidName;
+            StringInfoData sidPath;
+            
+            initStringInfo(&sidName);
+            initStringInfo(&sidPath);
+            appendStringInfo(&sidName, "del.%d", generation);
+            appendStringInfo(&sidPath, "%s/%s/%s", indexdir, ref->name, sidName.data);
+            writeTombstones(sidPath.data, bits[k], nbytes[k]);
+            newRef->tombstones = sidName.data;
+            pfree(sidPath.data);
+        }
+        if (bits[k] != NULL)
+            pfree(bits[k]);
+        segments = lappend(segments, newRef);
+        k ++;
+    }
+    pfree(bits);
+    pfree(nbytes);
+    pfree(changed);
+    
+    return segments;
+}
+
+/*
+ * position of segment g<generation> in a segment list, -1 if absent
+ */
+int
+findSegment(List *segments, int generation)
+{
+    ListCell    *cell;
+    int         k = 0;
+    
+    foreach(cell, segments)
+    {
+        int g;
+        
+        if (sscanf(((SegmentRef *) lfirst(cell))->name, "g%d", &g) == 1 && g == generation)
+            return k;
+        k ++;
+    }
+    return -1;
+}
+
+/*
+ * remove the segment directories and tombstone files which none of the
+ * given generations use. Generation dirs of the given generations are
+ * kept even when not segments, they hold the stats and the manifest.
+ */
+void
+removeUnusedSegments(char *indexdir, List *generations, List *segments)
+{
+    DIR             *dir;
+    struct dirent   *dirent;
+    
+    dir = AllocateDir(indexdir);
+    while (dir != NULL && (dirent = ReadDir(dir, indexdir)) != NULL)
+    {
+        StringInfoData  sidPath;
+        int             g;
+        char            c;
+        
+        if (sscanf(dirent->d_name, "g%d%c", &g, &c) != 1)
+            continue;
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/%s", indexdir, dirent->d_name);
+        
+        if (!list_member_int(generations, g) && findSegment(segments, g) < 0)
+            rmtree(sidPath.data, true);
+        else
+        {
+            /* drop stale tombstones of a kept segment */
+            DIR             *segdir = AllocateDir(sidPath.data);
+            struct dirent   *segdirent;
+            
+            while (segdir != NULL && (segdirent = ReadDir(segdir, sidPath.data)) != NULL)
+            {
+                ListCell        *cell;
+                bool            used = FALSE;
+                StringInfoData  sidDelPath;
+                
+                if (strncmp(segdirent->d_name, "del.", 4) != 0)
+                    continue;
+                foreach(cell, segments)
+                {
+                    SegmentRef *ref = (SegmentRef *) lfirst(cell);
+                    
+                    if (strcmp(ref->name, dirent->d_name) == 0 && ref->tombstones != NULL &&
+                        strcmp(ref->tombstones, segdirent->d_name) == 0)
+                        used = TRUE;
+                }
+                if (used)
+                    continue;
+                initStringInfo(&sidDelPath);
+                appendStringInfo(&sidDelPath, "%s/%s", sidPath.data, segdirent->d_name);
+                remove(sidDelPath.data);
+                pfree(sidDelPath.data);
+            }
+            if (segdir != NULL)
+                FreeDir(segdir);
+        }
+        pfree(sidPath.data);
+    }
+    if (dir != NULL)
+        FreeDir(dir);
+}
+
+/*
+ * Tiered merge policy. Each incremental build adds a segment, and every
+ * segment costs a dict lookup per query term, so small segments are
+ * merged into larger ones as they pile up.
+ *
+ * Segments are grouped into tiers by the bytes of the live documents
+ * they index: tier 0 up to MERGE_FLOOR_SIZE, each next tier merge_factor
+ * times larger. When a tier holds merge_factor segments or more, the
+ * segments of the lowest such tier are merged into a single segment of
+ * generation + 1, with the deleted documents purged, and the segment
+ * list is switched to it. Segments whose documents were all deleted
+ * fall to tier 0 and disappear with its next merge. The number of
+ * segments thus stays logarithmic in the size of the collection.
+ *
+ * files and nbytes describe the collection of generation, indexed with
+ * text search configuration cfgId; the segments of merged documents are
+ * updated in files. Return the generation in use afterwards, generation
+ * itself when no tier is full, and the segment list written in
+ * *mergedSegments. A single tier is merged per call.
+ */
+int
+mergeSegments(char *indexdir, int generation, List *segments, ManifestEntry *files, int nfiles,
+                int64 nbytes, Oid cfgId, int merge_factor, int pack_docs, List **mergedSegments)
+{
+    int             nsegments = list_length(segments);
+    int             mergedGeneration = generation + 1;
+    int64           *liveBytes;
+    int             *tiers;
+    int             *tierSegments;
+    int             maxTier = 0;
+    int             mergeTier = -1;
+    List            *selected = NIL;
+    SegmentRef      *newSegment;
+    ListCell        *cell;
+    StringInfoData  sidGenPath;
+    StringInfoData  sidPath;
+    struct stat     st;
+    int             i;
+    int             k;
+    
+    *mergedSegments = NIL;
+    if (nsegments < merge_factor)
+        return generation;
+    
+    /* size tier of every segment */
+    liveBytes = (int64 *) palloc0(sizeof(int64) * nsegments);
+    tiers = (int *) palloc(sizeof(int) * nsegments);
+    for (i = 0; i < nfiles; i++)
+    {
+        k = findSegment(segments, files[i].segment);
+        if (k >= 0)
+            liveBytes[k] += files[i].size;
+    }
+    for (k = 0; k < nsegments; k++)
+    {
+        tiers[k] = segmentTier(liveBytes[k], merge_factor);
+        maxTier = Max(maxTier, tiers[k]);
+    }
+    pfree(liveBytes);
+    
+    /* lowest full tier */
+    tierSegments = (int *) palloc0(sizeof(int) * (maxTier + 1));
+    for (k = 0; k < nsegments; k++)
+        tierSegments[tiers[k]] ++;
+    for (i = 0; i <= maxTier && mergeTier < 0; i++)
+    {
+        if (tierSegments[i] >= merge_factor)
+            mergeTier = i;
+    }
+    pfree(tierSegments);
+    if (mergeTier < 0)
+    {
+        pfree(tiers);
+        return generation;
+    }
+    
+    /* the merged segment takes the place of the oldest one it replaces */
+    initStringInfo(&sidGenPath);
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidGenPath, "%s/g%d", indexdir, mergedGeneration);
+    newSegment = (SegmentRef *) palloc(sizeof(SegmentRef));
+    newSegment->name = pstrdup(sidGenPath.data + strlen(indexdir) + 1);
+    newSegment->tombstones = NULL;
+    k = 0;
+    foreach(cell, segments)
+    {
+        SegmentRef *ref = (SegmentRef *) lfirst(cell);
+        
+        if (tiers[k++] != mergeTier)
+            *mergedSegments = lappend(*mergedSegments, ref);
+        else
+        {
+            if (selected == NIL)
+                *mergedSegments = lappend(*mergedSegments, newSegment);
+            selected = lappend(selected, ref);
+        }
+    }
+    pfree(tiers);
+#ifdef DEBUG
+    elog(NOTICE, "-Merging %d segments of tier %d into g%d", list_length(selected), mergeTier, mergedGeneration);
+#endif
+    
+    /* leftover of a failed merge */
+    if (stat(sidGenPath.data, &st) == 0)
+        rmtree(sidGenPath.data, true);
+    if (mkdir(sidGenPath.data, S_IRWXU) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create directory \"%s\": %m", sidGenPath.data)));
+    
+    strlcpy(progress.phase, "compacting", sizeof(progress.phase));
+    progress.generation = mergedGeneration;
+    progress.runsTotal = list_length(selected);
+    progress.termsMerged = 0;
+    reportProgress(true);
+    
+    mergeSegmentFiles(indexdir, selected, sidGenPath.data);
+    if (pack_docs != DOCS_NOT_PACKED)
+        mergeDocStores(indexdir, selected, sidGenPath.data, pack_docs);
+    
+    /* stats and manifest of the whole collection */
+    for (i = 0; i < nfiles; i++)
+    {
+        foreach(cell, selected)
+        {
+            int g;
+            
+            if (sscanf(((SegmentRef *) lfirst(cell))->name, "g%d", &g) == 1 && g == files[i].segment)
+                files[i].segment = mergedGeneration;
+        }
+    }
+    writeStat(sidGenPath.data, nfiles, nbytes, cfgId);
+    appendStringInfo(&sidPath, "%s/" MANIFEST_FILE, sidGenPath.data);
+    writeManifest(sidPath.data, files, nfiles);
+    installIndexFiles(sidGenPath.data);
+    writeSegmentList(indexdir, mergedGeneration, *mergedSegments);
+    
+    list_free(selected);
+    pfree(sidGenPath.data);
+    pfree(sidPath.data);
+    return mergedGeneration;
+}
+
+/*
+ * size tier of a segment indexing size bytes of live documents
+ */
+int
+segmentTier(int64 size, int merge_factor)
+{
+    int64   bound = MERGE_FLOOR_SIZE;
+    int     tier = 0;
+    
+    while (size > bound)
+    {
+        bound *= merge_factor;
+        tier ++;
+    }
+    return tier;
+}
+
+/*
+ * Merge the dict and postings of segments into dict.tmp and post.tmp of
+ * indexpath, like mergeRuns(). Doc ids of different segments interleave,
+ * so the live postings of a term are streamed through a cursor merging
+ * its lists in every segment and skipping deleted documents, and terms
+ * left without live postings are dropped. A list of a single segment
+ * without deleted documents is copied as is.
+ */
+void
+mergeSegmentFiles(char *indexdir, List *selected, char *indexpath)
+{
+    int             nsegs = list_length(selected);
+    IndexSegment    *segs;
+    RunReader       *runs;
+    int             *heap;
+    int             nheap = 0;
+    IndexSegment    **termSegs;
+    PostingInfo     *termInfos;
+    File            dictFile;
+    File            postFile;
+    DictWriter      *dictWriter;
+    StringInfoData  sidDictFilePath;
+    StringInfoData  sidPostFilePath;
+    StringInfoData  sidTerm;
+    StringInfoData  sidPostList;
+    ListCell        *cell;
+    int64           cursor = POST_HEADER_SIZE;
+    int             i = 0;
+    
+#ifdef DEBUG
+    elog(NOTICE, "mergeSegmentFiles");
+#endif
+    
+    /* open the segments and load the heap with their first terms */
+    segs = (IndexSegment *) palloc(sizeof(IndexSegment) * Max(nsegs, 1));
+    runs = (RunReader *) palloc(sizeof(RunReader) * Max(nsegs, 1));
+    heap = (int *) palloc(sizeof(int) * Max(nsegs, 1));
+    termSegs = (IndexSegment **) palloc(sizeof(IndexSegment *) * Max(nsegs, 1));
+    termInfos = (PostingInfo *) palloc(sizeof(PostingInfo) * Max(nsegs, 1));
+    foreach(cell, selected)
+    {
+        SegmentRef      *ref = (SegmentRef *) lfirst(cell);
+        StringInfoData  sidPath;
+        
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/%s", indexdir, ref->name);
+        openSegment(&segs[i], sidPath.data, ref->tombstones);
+        pfree(sidPath.data);
+        runs[i].dict = segs[i].dict;
+        runs[i].post = segs[i].post;
+        runs[i].iter = dictIterBegin(segs[i].dict);
+        if (dictIterNext(runs[i].iter))
+        {
+            heap[nheap] = i;
+            runHeapSiftUp(runs, heap, nheap++);
+        }
+        i ++;
+    }
+    
+    initStringInfo(&sidDictFilePath);
+    initStringInfo(&sidPostFilePath);
+    appendStringInfo(&sidDictFilePath, "%s/dict" TMP_SUFFIX, indexpath);
+    appendStringInfo(&sidPostFilePath, "%s/post" TMP_SUFFIX, indexpath);
+    dictFile = PathNameOpenFile(sidDictFilePath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    postFile = PathNameOpenFile(sidPostFilePath.data, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    writePostHeader(postFile);
+    dictWriter = dictWriterBegin(dictFile);
+    
+    initStringInfo(&sidTerm);
+    initStringInfo(&sidPostList);
+    while (nheap > 0)
+    {
+        int     nterm = 0;
+        int     last = 0;
+        int     count = 0;
+        
+        resetStringInfo(&sidTerm);
+        appendStringInfoString(&sidTerm, runs[heap[0]].iter->term.data);
+        
+        /* collect the dict entries of this term from every segment having it */
+        while (nheap > 0 && strcmp(runs[heap[0]].iter->term.data, sidTerm.data) == 0)
+        {
+            int r = heap[0];
+            
+            termSegs[nterm] = &segs[r];
+            termInfos[nterm++] = runs[r].iter->info;
+            
+            /* advance the segment, or drop it from the heap when exhausted */
+            if (!dictIterNext(runs[r].iter))
+                heap[0] = heap[--nheap];
+            runHeapSiftDown(runs, heap, nheap, 0);
+        }
+        
+        resetStringInfo(&sidPostList);
+        if (nterm == 1 && termSegs[0]->tombstones == NULL &&
+            termSegs[0]->post->version == POST_FORMAT_VARINT && termInfos[0].df >= 0)
+        {
+            char    *pstr;
+            bool    copied;
+            
+            pstr = loadPostings(termSegs[0]->post, &termInfos[0], &copied);
+            appendPostings(&sidPostList, pstr, termInfos[0].len, &last, &count);
+            if (copied)
+                pfree(pstr);
+        }
+        else
+        {
+            QualCursor  *c = openMergeCursor(termSegs, termInfos, nterm);
+            int32       id;
+            
+            while ((id = cursorNext(c)) != CURSOR_END)
+            {
+                appendVarint(&sidPostList, (uint32) id - (uint32) last);
+                last = id;
+                count ++;
+            }
+            closeQualCursor(c);
+        }
+        
+        if (count > 0)
+        {
+            FileWrite (postFile, sidPostList.data, sidPostList.len);
+            dictWriterAdd(dictWriter, sidTerm.data, cursor, sidPostList.len, count);
+            cursor += sidPostList.len;
+        }
+        progress.termsMerged ++;
+        reportProgress(false);
+    }
+    
+    dictWriterEnd(dictWriter);
+    FileClose(postFile);
+    
+    for (i = 0; i < nsegs; i++)
+    {
+        dictIterEnd(runs[i].iter);
+        closeSegment(&segs[i]);
+    }
+    pfree(segs);
+    pfree(runs);
+    pfree(heap);
+    pfree(termSegs);
+    pfree(termInfos);
+    pfree(sidDictFilePath.data);
+    pfree(sidPostFilePath.data);
+    pfree(sidTerm.data);
+    pfree(sidPostList.data);
+}
+
+/*
+ * generation named by CURRENT, 0 if the index dir has none
+ */
+int
+currentGeneration(char *indexdir)
+{
+    StringInfoData  sidPath;
+    FILE            *current;
+    int             generation = 0;
+    
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/" CURRENT_FILE, indexdir);
+    current = AllocateFile(sidPath.data, PG_BINARY_R);
+    if (current != NULL)
+    {
+        if (fscanf(current, "g%d", &generation) != 1)
+            elog(ERROR, "Index generation file \"%s\" corrupted!", sidPath.data);
+        FreeFile(current);
+    }
+    pfree(sidPath.data);
+    return generation;
+}
+
+/*
+ * directory of the index generation in use. An index dir without
+ * CURRENT holds an index built in place by an older version.
+ */
+char *
+currentIndexPath(char *indexdir)
+{
+    StringInfoData  sidPath;
+    int             generation = currentGeneration(indexdir);
+    
+    if (generation == 0)
+        return indexdir;
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/g%d", indexdir, generation);
+    return sidPath.data;
+}
+
+/*
+ * start reporting the progress of a build into path
+ */
+void
+beginProgress(char *path, int generation)
+{
+    MemSet(&progress, 0, sizeof(progress));
+    strlcpy(progress.phase, "tokenizing", sizeof(progress.phase));
+    progress.generation = generation;
+    progress.pid = MyProcPid;
+    progressPath = MemoryContextStrdup(TopMemoryContext, path);
+    reportProgress(true);
+}
+
+/*
+ * write out the progress of the running build, at most once a second
+ * unless forced
+ */
+void
+reportProgress(bool force)
+{
+    time_t now;
+    
+    if (progressPath == NULL)
+        return;
+    now = time(NULL);
+    if (!force && now == progressTime)
+        return;
+    progressTime = now;
+    writeProgress(progressPath, &progress);
+}
+
+/*
+ * record the outcome of the build and stop reporting
+ */
+void
+endProgress(char *phase)
+{
+    if (progressPath == NULL)
+        return;
+    strlcpy(progress.phase, phase, sizeof(progress.phase));
+    reportProgress(true);
+    pfree(progressPath);
+    progressPath = NULL;
+}
+
+/*
+ * replace a progress file
+ */
+void
+writeProgress(char *path, IndexProgress *p)
+{
+    StringInfoData  sidTmpPath;
+    FILE            *pfile;
+    
+    initStringInfo(&sidTmpPath);
+    appendStringInfo(&sidTmpPath, "%s" TMP_SUFFIX, path);
+    pfile = AllocateFile(sidTmpPath.data, PG_BINARY_W);
+    if (pfile == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", sidTmpPath.data)));
+    fprintf(pfile, "PHASE:%s\nGENERATION:%d\nPID:%d\n"
+            "FILES_TOTAL:%d\nFILES_DONE:%d\nBYTES_DONE:" INT64_FORMAT "\n"
+            "RUNS_WRITTEN:%d\nRUNS_TOTAL:%d\nTERMS_MERGED:%d\n",
+            p->phase, p->generation, p->pid,
+            p->filesTotal, p->filesDone, p->bytesDone,
+            p->runsWritten, p->runsTotal, p->termsMerged);
+    if (FreeFile(pfile) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", sidTmpPath.data)));
+    if (rename(sidTmpPath.data, path) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not rename file \"%s\" to \"%s\": %m",
+                        sidTmpPath.data, path)));
+    pfree(sidTmpPath.data);
+}
+
+/*
+ * read a progress file, return FALSE if there is none
+ */
+bool
+readProgress(char *path, IndexProgress *p)
+{
+    FILE    *pfile;
+    int     status;
+    
+    pfile = AllocateFile(path, PG_BINARY_R);
+    if (pfile == NULL)
+        return FALSE;
+    MemSet(p, 0, sizeof(IndexProgress));
+    status = fscanf(pfile, "PHASE:%15s\nGENERATION:%d\nPID:%d\n"
+            "FILES_TOTAL:%d\nFILES_DONE:%d\nBYTES_DONE:" INT64_FORMAT "\n"
+            "RUNS_WRITTEN:%d\nRUNS_TOTAL:%d\nTERMS_MERGED:%d",
+            p->phase, &p->generation, &p->pid,
+            &p->filesTotal, &p->filesDone, &p->bytesDone,
+            &p->runsWritten, &p->runsTotal, &p->termsMerged);
+    FreeFile(pfile);
+    if (status != 9)
+        elog(ERROR, "Index progress file \"%s\" corrupted!", path);
+    return TRUE;
+}
+
+/*
+ * Parallel index function
+ *
+ * The sorted document list fnames is cut into nworkers contiguous
+ * partitions. Each partition is tokenized into runs by a dynamic
+ * background worker (named w<worker>.<run>), as for SPIM, and the leader
+ * merges all runs in partition order. Partitions cover ascending doc id
+ * ranges, so the runs can be merged exactly like the runs of spimIndex.
+ *
+ * A partition whose worker cannot be registered (max_worker_processes
+ * reached) is indexed by the leader itself. Servers without dynamic
+ * background workers index serially.
+ */
+int64
+parallelIndex(char *datapath, char *indexpath, char *method, int buffer_size, int nworkers,
+                Oid cfgId, char **fnames, int nfiles)
+{
+#if PG_VERSION_NUM < 90500
+    elog(NOTICE, "%s", "-index_workers needs dynamic background workers (PostgreSQL 9.5 or later), indexing serially");
+    if (strcmp(method, "SPIM") == 0)
+        return spimIndex(datapath, indexpath, buffer_size, cfgId, fnames, nfiles);
+    return imIndex(datapath, indexpath, cfgId, fnames, nfiles);
+#else
+    int64   dcNumOfBytes = 0;
+    /* IM builds a single run per partition */
+    int     bufThreshold = 0;
+    List    *postfnames = NIL;
+    List    *dictfnames = NIL;
+    BackgroundWorkerHandle **handles;
+    int     k;
+    
+#ifdef DEBUG
+    elog(NOTICE, "%s", "parallelIndex");
+    elog(NOTICE, "DATA PATH: %s", datapath);
+#endif
+    
+    if (strcmp(method, "SPIM") == 0)
+        bufThreshold = (buffer_size == 0 ? DEFAULT_INDEX_BUFF_SIZE : buffer_size) * 1024 * 1024;
+    
+    nworkers = Max(1, Min(nworkers, nfiles));
+    handles = (BackgroundWorkerHandle **) palloc0(sizeof(BackgroundWorkerHandle *) * nworkers);
+    
+    PG_TRY();
+    {
+        /* launch a worker per partition */
+        for (k = 0; k < nworkers; k++)
+        {
+            BackgroundWorker    worker;
+            StringInfoData      sidTaskPath;
+            int                 first = (int) ((int64) nfiles * k / nworkers);
+            int                 last = (int) ((int64) nfiles * (k + 1) / nworkers);
+            
+            initStringInfo(&sidTaskPath);
+            appendStringInfo(&sidTaskPath, INDEX_TASK_FILE, MyProcPid, k);
+            writeIndexTask(sidTaskPath.data, datapath, indexpath, bufThreshold,
+                            cfgId, fnames + first, last - first);
+            
+            MemSet(&worker, 0, sizeof(worker));
+            worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+            worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+            worker.bgw_restart_time = BGW_NEVER_RESTART;
+            snprintf(worker.bgw_library_name, BGW_MAXLEN, "dc_fdw");
+            snprintf(worker.bgw_function_name, BGW_MAXLEN, "dc_fdw_index_worker_main");
+            snprintf(worker.bgw_name, BGW_MAXLEN, "dc_fdw index worker %d", k);
+            worker.bgw_main_arg = Int32GetDatum(k);
+            worker.bgw_notify_pid = MyProcPid;
+            
+            if (!RegisterDynamicBackgroundWorker(&worker, &handles[k]))
+            {
+                handles[k] = NULL;
+                remove(sidTaskPath.data);
+            }
+            pfree(sidTaskPath.data);
+        }
+        
+        /* index the partitions left without a worker */
+        for (k = 0; k < nworkers; k++)
+        {
+            int first = (int) ((int64) nfiles * k / nworkers);
+            int last = (int) ((int64) nfiles * (k + 1) / nworkers);
+            int64 nbytes;
+            
+            if (handles[k] != NULL)
+                continue;
+            elog(NOTICE, "-No background worker available for index partition %d, indexing it in this backend", k);
+            runIndexPartition(datapath, indexpath, k, fnames + first, last - first,
+                                bufThreshold, cfgId, &nbytes);
+        }
+        
+        /* wait for the workers to finish, woken up by their exit */
+        for (k = 0; k < nworkers; k++)
+        {
+            if (handles[k] == NULL)
+                continue;
+            if (WaitForBackgroundWorkerShutdown(handles[k]) == BGWH_POSTMASTER_DIED)
+                elog(ERROR, "Postmaster died while indexing!");
+        }
+    }
+    PG_CATCH();
+    {
+        for (k = 0; k < nworkers; k++)
+            if (handles[k] != NULL)
+                TerminateBackgroundWorker(handles[k]);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    
+    /* gather the runs in partition order and merge them */
+    for (k = 0; k < nworkers; k++)
+    {
+        int64 nbytes;
+        
+        collectWorkerRuns(indexpath, k, &dictfnames, &postfnames, &nbytes);
+        dcNumOfBytes += nbytes;
+    }
+    mergeRuns(dictfnames, postfnames, indexpath);
+    removeRuns(dictfnames, postfnames);
+    pfree(handles);
+    
+    return dcNumOfBytes;
+#endif
+}
+
+#if PG_VERSION_NUM >= 90500
+/*
+ * write the task of an index worker: database, ts config, paths, run
+ * size, then the documents of the partition, one per line
+ */
+void
+writeIndexTask(char *taskpath, char *datapath, char *indexpath, int bufThreshold,
+                Oid cfgId, char **fnames, int nfiles)
+{
+    FILE    *task;
+    int     i;
+    
+    task = AllocateFile(taskpath, PG_BINARY_W);
+    if (task == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", taskpath)));
+    fprintf(task, "%s\n%u\n%s\n%s\n%d\n%d\n", get_database_name(MyDatabaseId),
+            cfgId, datapath, indexpath, bufThreshold, nfiles);
+    for (i = 0; i < nfiles; i++)
+        fprintf(task, "%s\n", fnames[i]);
+    if (FreeFile(task) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", taskpath)));
+}
+
+/*
+ * read one line of a task file, without the newline
+ */
+static char *
+readTaskLine(FILE *task, char *taskpath)
+{
+    char    buf[MAXPGPATH];
+    int     len;
+    
+    if (fgets(buf, sizeof(buf), task) == NULL)
+        elog(ERROR, "Index task file \"%s\" corrupted!", taskpath);
+    len = strlen(buf);
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[len - 1] = '\0';
+    return pstrdup(buf);
+}
+
+/*
+ * tokenize a partition into runs w<worker>.<run> and record the outcome
+ * in w<worker>.done: the number of runs and of bytes read
+ */
+void
+runIndexPartition(char *datapath, char *indexpath, int worker, char **fnames, int nfiles,
+                    int bufThreshold, Oid cfgId, int64 *nbytes)
+{
+    StringInfoData  sidPrefix;
+    StringInfoData  sidDonePath;
+    List            *dictfnames = NIL;
+    List            *postfnames = NIL;
+    FILE            *done;
+    
+    initStringInfo(&sidPrefix);
+    appendStringInfo(&sidPrefix, "w%d.", worker);
+    *nbytes = buildRuns(datapath, indexpath, sidPrefix.data, fnames, nfiles, bufThreshold,
+                            cfgId, &dictfnames, &postfnames);
+    
+    initStringInfo(&sidDonePath);
+    appendStringInfo(&sidDonePath, "%s/w%d.done", indexpath, worker);
+    done = AllocateFile(sidDonePath.data, PG_BINARY_W);
+    if (done == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", sidDonePath.data)));
+    fprintf(done, "%d " INT64_FORMAT "\n", list_length(dictfnames), *nbytes);
+    if (FreeFile(done) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", sidDonePath.data)));
+    
+    list_free(dictfnames);
+    list_free(postfnames);
+    pfree(sidPrefix.data);
+    pfree(sidDonePath.data);
+}
+
+/*
+ * append the runs of a finished partition to the run lists
+ */
+void
+collectWorkerRuns(char *indexpath, int worker, List **dictfnames, List **postfnames, int64 *nbytes)
+{
+    StringInfoData  sidDonePath;
+    FILE            *done;
+    int             nruns;
+    int             r;
+    
+    initStringInfo(&sidDonePath);
+    appendStringInfo(&sidDonePath, "%s/w%d.done", indexpath, worker);
+    done = AllocateFile(sidDonePath.data, PG_BINARY_R);
+    if (done == NULL)
+        elog(ERROR, "Index worker %d failed, see the server log!", worker);
+    if (fscanf(done, "%d " INT64_FORMAT, &nruns, nbytes) != 2)
+        elog(ERROR, "Index worker %d result file corrupted!", worker);
+    FreeFile(done);
+    remove(sidDonePath.data);
+    resetStringInfo(&sidDonePath);
+    appendStringInfo(&sidDonePath, "%s/w%d." PROGRESS_FILE, indexpath, worker);
+    remove(sidDonePath.data);
+    
+    for (r = 0; r < nruns; r++)
+    {
+        StringInfoData sidDictPath;
+        StringInfoData sidPostPath;
+        
+        initStringInfo(&sidDictPath);
+        initStringInfo(&sidPostPath);
+        appendStringInfo(&sidDictPath, "%s/w%d.%d.dict", indexpath, worker, r);
+        appendStringInfo(&sidPostPath, "%s/w%d.%d.post", indexpath, worker, r);
+        *dictfnames = lappend(*dictfnames, (void *) sidDictPath.data);
+        *postfnames = lappend(*postfnames, (void *) sidPostPath.data);
+    }
+    pfree(sidDonePath.data);
+}
+
+/*
+ * Entry point of an index worker. The worker number is the main
+ * argument, and its task file is found through the pid of the leader.
+ */
+void
+dc_fdw_index_worker_main(Datum main_arg)
+{
+    int             worker = DatumGetInt32(main_arg);
+    StringInfoData  sidTaskPath;
+    FILE            *task;
+    char            *dbname;
+    Oid             cfgId;
+    char            *datapath;
+    char            *indexpath;
+    int             bufThreshold;
+    int             nfiles;
+    char            **fnames;
+    int64           nbytes;
+    int             i;
+    
+    BackgroundWorkerUnblockSignals();
+    
+    initStringInfo(&sidTaskPath);
+    appendStringInfo(&sidTaskPath, INDEX_TASK_FILE, MyBgworkerEntry->bgw_notify_pid, worker);
+    task = AllocateFile(sidTaskPath.data, PG_BINARY_R);
+    if (task == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\": %m", sidTaskPath.data)));
+    dbname = readTaskLine(task, sidTaskPath.data);
+    cfgId = (Oid) strtoul(readTaskLine(task, sidTaskPath.data), NULL, 10);
+    datapath = readTaskLine(task, sidTaskPath.data);
+    indexpath = readTaskLine(task, sidTaskPath.data);
+    bufThreshold = atoi(readTaskLine(task, sidTaskPath.data));
+    nfiles = atoi(readTaskLine(task, sidTaskPath.data));
+    fnames = (char **) palloc(sizeof(char *) * Max(nfiles, 1));
+    for (i = 0; i < nfiles; i++)
+        fnames[i] = readTaskLine(task, sidTaskPath.data);
+    FreeFile(task);
+    remove(sidTaskPath.data);
+    
+#ifdef DEBUG
+    elog(LOG, "dc_fdw index worker %d: %d documents", worker, nfiles);
+#endif
+    
+    /* the ts config cache needs catalog access */
+    BackgroundWorkerInitializeConnection(dbname, NULL);
+    StartTransactionCommand();
+    
+    /* the leader adds up the progress of its workers */
+    resetStringInfo(&sidTaskPath);
+    appendStringInfo(&sidTaskPath, "%s/w%d." PROGRESS_FILE, indexpath, worker);
+    beginProgress(sidTaskPath.data, 0);
+    progress.filesTotal = nfiles;
+    
+    runIndexPartition(datapath, indexpath, worker, fnames, nfiles, bufThreshold, cfgId, &nbytes);
+    endProgress("done");
+    CommitTransactionCommand();
+    
+    proc_exit(0);
+}
+#endif
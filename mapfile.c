@@ -0,0 +1,152 @@
+/*-------------------------------------------------------------------------
+ *
+ * mapfile.c
+ *		  Memory mapped index files for document collections foreign-data wrapper.
+ *
+ * Copyright (c) 2012, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Zheng Yang <zhengyang4k@gmail.com>
+ *
+ * IDENTIFICATION
+ *		  contrib/dc_fdw/mapfile.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "qual_pushdown.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils/memutils.h"
+
+/*
+ * Index files are mapped read-only and the mappings are cached for the
+ * life of the backend, so repeated queries decode dict blocks and
+ * postings straight from the page cache without any read() or copy.
+ *
+ * A cached mapping is only reused while the file's inode, size and mtime
+ * are unchanged. The indexer installs new files by rename(), so a mapping
+ * of a replaced file stays valid; it is retired from the cache and
+ * unmapped once the last handle using it is released. (Handles left open
+ * by an aborted query keep their mapping until backend exit.)
+ *
+ * Callers treat a NULL result as "use the File API instead".
+ */
+
+typedef struct MappedFileEntry
+{
+    char        key[MAXPGPATH];     /* path of the file */
+    dev_t       dev;                /* identity of the mapped file */
+    ino_t       ino;
+    off_t       size;
+    time_t      mtime;
+    MappedFile  *mf;                /* current mapping, NULL if none */
+} MappedFileEntry;
+
+static HTAB *mappedFiles = NULL;
+
+static void retireMappedFile(MappedFile *mf);
+
+/*
+ * map an index file, or return NULL if it cannot be mapped
+ */
+MappedFile *
+mapIndexFile(char *fname)
+{
+    MappedFileEntry *entry;
+    MappedFile      *mf;
+    struct stat     st;
+    bool            found;
+    void            *addr;
+    int             fd;
+
+    if (strlen(fname) >= MAXPGPATH)
+        return NULL;
+    /* an empty file cannot be mapped */
+    if (stat(fname, &st) != 0 || st.st_size == 0)
+        return NULL;
+
+    if (mappedFiles == NULL)
+    {
+        HASHCTL info;
+
+        MemSet(&info, 0, sizeof(info));
+        info.keysize = MAXPGPATH;
+        info.entrysize = sizeof(MappedFileEntry);
+        mappedFiles = hash_create("dc_fdw mapped files", 16, &info, HASH_ELEM);
+    }
+
+    entry = (MappedFileEntry *) hash_search(mappedFiles, (void *) fname, HASH_ENTER, &found);
+    if (!found)
+        entry->mf = NULL;
+
+    /* reuse the cached mapping if the file has not been replaced */
+    if (entry->mf != NULL)
+    {
+        if (entry->dev == st.st_dev && entry->ino == st.st_ino &&
+            entry->size == st.st_size && entry->mtime == st.st_mtime)
+        {
+            entry->mf->refcount ++;
+            return entry->mf;
+        }
+        retireMappedFile(entry->mf);
+        entry->mf = NULL;
+    }
+
+    fd = BasicOpenFile(fname, O_RDONLY | PG_BINARY, 0);
+    if (fd < 0)
+        return NULL;
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        elog(DEBUG1, "could not mmap \"%s\": %m, falling back to read", fname);
+        return NULL;
+    }
+
+    mf = (MappedFile *) MemoryContextAlloc(TopMemoryContext, sizeof(MappedFile));
+    mf->addr = (char *) addr;
+    mf->len = (Size) st.st_size;
+    mf->refcount = 1;
+    mf->retired = FALSE;
+
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->mf = mf;
+
+    return mf;
+}
+
+/*
+ * release a handle on a mapping
+ */
+void
+releaseMappedFile(MappedFile *mf)
+{
+    Assert(mf->refcount > 0);
+    mf->refcount --;
+    if (mf->retired && mf->refcount == 0)
+    {
+        munmap(mf->addr, mf->len);
+        pfree(mf);
+    }
+}
+
+/*
+ * drop a superseded mapping from the cache
+ */
+static void
+retireMappedFile(MappedFile *mf)
+{
+    mf->retired = TRUE;
+    if (mf->refcount == 0)
+    {
+        munmap(mf->addr, mf->len);
+        pfree(mf);
+    }
+}
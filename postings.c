@@ -0,0 +1,203 @@
+/*-------------------------------------------------------------------------
+ *
+ * postings.c
+ *		  Postings file codec for document collections foreign-data wrapper.
+ *
+ * Copyright (c) 2012, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Zheng Yang <zhengyang4k@gmail.com>
+ *
+ * IDENTIFICATION
+ *		  contrib/dc_fdw/postings.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "qual_pushdown.h"
+
+/*
+ * Binary postings file layout (POST_FORMAT_VARINT):
+ *
+ *  [ "DCPOST" | version byte | reserved byte ]  header, POST_HEADER_SIZE bytes
+ *  [ postings list ] ...                         one per dictionary entry
+ *
+ * A postings list is the sorted doc ids stored as gaps from the previous
+ * id (the first id is a gap from 0), each gap written as a little-endian
+ * base-128 varint. Dictionary entries point into the file by byte offset
+ * and byte length, exactly as for the legacy text layout, so the dict
+ * file format does not depend on the postings format.
+ */
+
+/*
+ * write the header of a binary postings file
+ */
+void
+writePostHeader(File pfile)
+{
+    char header[POST_HEADER_SIZE];
+
+    MemSet(header, 0, POST_HEADER_SIZE);
+    memcpy(header, POST_MAGIC, POST_MAGIC_LEN);
+    header[POST_MAGIC_LEN] = (char) POST_FORMAT_VARINT;
+    FileWrite(pfile, header, POST_HEADER_SIZE);
+}
+
+/*
+ * identify the format of a postings file. Files without the magic
+ * header are treated as the legacy text layout.
+ */
+int
+readPostHeader(File pfile)
+{
+    char header[POST_HEADER_SIZE];
+    int  len;
+
+    FileSeek(pfile, 0, SEEK_SET);
+    len = FileRead(pfile, header, POST_HEADER_SIZE);
+    return checkPostHeader(header, len);
+}
+
+/*
+ * identify the format from the first len bytes of a postings file
+ */
+int
+checkPostHeader(char *header, int len)
+{
+    int version;
+
+    if (len < POST_HEADER_SIZE ||
+        memcmp(header, POST_MAGIC, POST_MAGIC_LEN) != 0)
+        return POST_FORMAT_TEXT;
+
+    version = (unsigned char) header[POST_MAGIC_LEN];
+    if (version != POST_FORMAT_VARINT)
+        elog(ERROR, "Unsupported postings file version %d!", version);
+    return version;
+}
+
+/*
+ * append an unsigned integer as a base-128 varint
+ */
+void
+appendVarint(StringInfo buf, uint32 val)
+{
+    while (val >= 0x80)
+    {
+        appendStringInfoChar(buf, (char) ((val & 0x7F) | 0x80));
+        val >>= 7;
+    }
+    appendStringInfoChar(buf, (char) val);
+}
+
+/*
+ * read a varint at *ptr and advance *ptr past it
+ */
+uint32
+readVarint(char **ptr, char *end)
+{
+    unsigned char   *p = (unsigned char *) *ptr;
+    uint32          val = 0;
+    int             shift = 0;
+
+    for (;;)
+    {
+        if ((char *) p >= end || shift > 28)
+            elog(ERROR, "Postings file corrupted!");
+        val |= ((uint32) (*p & 0x7F)) << shift;
+        if ((*p++ & 0x80) == 0)
+            break;
+        shift += 7;
+    }
+    *ptr = (char *) p;
+    return val;
+}
+
+/*
+ * append a 64 bit unsigned integer as a base-128 varint. The encoding is
+ * the one of appendVarint, so values below 2^32 read back with readVarint.
+ */
+void
+appendVarint64(StringInfo buf, uint64 val)
+{
+    while (val >= 0x80)
+    {
+        appendStringInfoChar(buf, (char) ((val & 0x7F) | 0x80));
+        val >>= 7;
+    }
+    appendStringInfoChar(buf, (char) val);
+}
+
+/*
+ * read a 64 bit varint at *ptr and advance *ptr past it
+ */
+uint64
+readVarint64(char **ptr, char *end)
+{
+    unsigned char   *p = (unsigned char *) *ptr;
+    uint64          val = 0;
+    int             shift = 0;
+
+    for (;;)
+    {
+        if ((char *) p >= end || shift > 63)
+            elog(ERROR, "Postings file corrupted!");
+        val |= ((uint64) (*p & 0x7F)) << shift;
+        if ((*p++ & 0x80) == 0)
+            break;
+        shift += 7;
+    }
+    *ptr = (char *) p;
+    return val;
+}
+
+/*
+ * serialize a sorted array of doc ids as varint gaps
+ */
+void
+encodePostings(StringInfo buf, int *ids, int n)
+{
+    uint32  prev = 0;
+    int     i;
+
+    for (i = 0; i < n; i++)
+    {
+        appendVarint(buf, (uint32) ids[i] - prev);
+        prev = (uint32) ids[i];
+    }
+}
+
+/*
+ * append an encoded postings list to out, continuing the gap sequence
+ * of out whose last doc id is *last. Only the first gap is re-encoded,
+ * the rest of the list is copied as is. Doc ids of the appended list
+ * must not be smaller than *last.
+ */
+void
+appendPostings(StringInfo out, char *buf, int len, int *last, int *count)
+{
+    char    *ptr = buf;
+    char    *end = buf + len;
+    char    *rest;
+    uint32  curr;
+
+    if (ptr >= end)
+        return;
+
+    curr = readVarint(&ptr, end);
+    if (*count > 0 && (int) curr < *last)
+        elog(ERROR, "Postings lists to append are out of doc id order!");
+    appendVarint(out, curr - (uint32) (*count > 0 ? *last : 0));
+    (*count) ++;
+
+    /* walk the remaining gaps only to find the last doc id */
+    rest = ptr;
+    while (ptr < end)
+    {
+        curr += readVarint(&ptr, end);
+        (*count) ++;
+    }
+    appendBinaryStringInfo(out, rest, end - rest);
+    *last = (int) curr;
+}
@@ -47,20 +47,51 @@ int deparseConst(PushableQualNode *qual, Const *node, PlannerInfo *root, List *m
 int deparseBoolExpr(PushableQualNode *qual, BoolExpr *node, PlannerInfo *root, List *mapping);
 int deparseFuncExpr(PushableQualNode *qual, FuncExpr *node, PlannerInfo *root, List *mapping);
 int deparseOpExpr(PushableQualNode *qual, OpExpr *node, PlannerInfo *root, List *mapping);
-void copyTree(QTNode *qtTree, PushableQualNode *pqTree, List *mapping);
+int deparseParam(PushableQualNode *qual, Param *node, PlannerInfo *root, List *mapping);
+int copyTree(QTNode *qtTree, PushableQualNode *pqTree, List *mapping, bool approximate);
+static void appendQualTree(StringInfo buf, PushableQualNode *qualRoot);
+static PushableQualNode * parseQualTree(char **ptr, List *mapping);
+static void appendQualTreeText(StringInfo buf, PushableQualNode *qualRoot, bool nested, List *params);
+static PushableQualNode * bindQualNode(PushableQualNode *qualRoot, Datum *values, bool *nulls,
+                                        Oid *types, List *mapping);
+static void setParamKind(PushableQualNode *qual, char *kind, Expr *param);
+static char paramKindCode(char *kind);
+static bool isExactQual(PushableQualNode *qualRoot);
+static bool isSingleLexeme(char *text, bool same);
+static void setMatchAll(PushableQualNode *qual);
+
+/* kinds of param_node, and their code in serialized qual trees */
+static const struct
+{
+    char    *name;
+    char    code;
+} paramKinds[] =
+{
+    {"to_tsquery", 't'},
+    {"plainto_tsquery", 'p'},
+    {"tsquery", 'q'},
+    {"text", 's'},
+    {"=", 'i'},
+    {NULL, 0}
+};
 
 /*
  * Examine each element in the list baserestrictinfo of baserel, and constrct
- * a tree structure for utilizing the quals.
+ * a tree structure for utilizing the quals. The RestrictInfos put into the
+ * tree are returned in *pushedClauses, and those the index evaluates
+ * exactly as PostgreSQL does in *exactClauses.
  */
 int
-extractQuals(PushableQualNode **qualRoot, PlannerInfo *root, RelOptInfo *baserel, List *mapping)
+extractQuals(PushableQualNode **qualRoot, PlannerInfo *root, RelOptInfo *baserel, List *mapping,
+                List **pushedClauses, List **exactClauses)
 {
 	ListCell    *lc;
     int         pushableQualCounter = 0;
     *qualRoot = (PushableQualNode *) palloc(sizeof(PushableQualNode));
     
     MemSet(*qualRoot, 0, sizeof(PushableQualNode));
+    *pushedClauses = NIL;
+    *exactClauses = NIL;
     
 #ifdef DEBUG
     elog(NOTICE, "extractQuals");
@@ -85,7 +116,15 @@ extractQuals(PushableQualNode **qualRoot, PlannerInfo *root, RelOptInfo *baserel
              * if successful, increment counter
              */
 	        if (deparseExpr(*qualRoot, ri->clause, root, mapping) == 0)
+	        {
 	            pushableQualCounter ++;
+	            *pushedClauses = lappend(*pushedClauses, ri);
+	            if (isExactQual(*qualRoot))
+	                *exactClauses = lappend(*exactClauses, ri);
+	        }
+	        /* drop what the clause left in the root */
+	        else
+	            MemSet(*qualRoot, 0, sizeof(PushableQualNode));
         }
         /* construct ANDed tree structure and attach to tree node */
 	    else {
@@ -102,12 +141,63 @@ extractQuals(PushableQualNode **qualRoot, PlannerInfo *root, RelOptInfo *baserel
                 boolNode->childNodes = lappend(boolNode->childNodes, qualCurr);
                 *qualRoot = boolNode;
                 pushableQualCounter ++;
+                *pushedClauses = lappend(*pushedClauses, ri);
+                if (isExactQual(qualCurr))
+                    *exactClauses = lappend(*exactClauses, ri);
 	        }
 	    }
 	}
+	
+	if (pushableQualCounter > 0)
+	    flattenQualTree(*qualRoot);
     return pushableQualCounter;
 }
 
+/*
+ * Does the index match exactly the docs the clause of a qual tree does?
+ * The executor then need not recheck the clause. Operands known at run
+ * time only are not checked, they are rechecked.
+ */
+static bool
+isExactQual(PushableQualNode *qualRoot)
+{
+    ListCell *lc;
+    
+    if (strcmp(qualRoot->optype.data, "param_node") == 0)
+        return FALSE;
+    if (!qualRoot->exact)
+        return FALSE;
+    foreach(lc, qualRoot->childNodes)
+    {
+        if (!isExactQual((PushableQualNode *) lfirst(lc)))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Is text a single lexeme for the current text search configuration,
+ * and the lexeme text itself if same? A term is looked up in the index
+ * by its first lexeme only.
+ */
+static bool
+isSingleLexeme(char *text, bool same)
+{
+    TSVector    tsvector;
+    WordEntry   *entry;
+    bool        result;
+    
+    tsvector = (TSVector) DatumGetPointer(DirectFunctionCall1(to_tsvector,
+                                            PointerGetDatum(cstring_to_text(text))));
+    if (tsvector->size != 1)
+        return FALSE;
+    entry = ARRPTR(tsvector);
+    result = !same || (entry->len == strlen(text) &&
+                       strncmp(STRPTR(tsvector) + entry->pos, text, entry->len) == 0);
+    pfree(tsvector);
+    return result;
+}
+
 
 /*
  * Deparse given expression into qual.
@@ -147,7 +237,7 @@ deparseExpr(PushableQualNode *qual, Expr *node, PlannerInfo *root, List *mapping
             return -1;
 			break;
 		case T_Param:
-            return -1;
+            return deparseParam(qual, (Param *) node, root, mapping);
 			break;
 		case T_ScalarArrayOpExpr:
             return -1;
@@ -360,6 +450,20 @@ deparseConst(PushableQualNode *qual,
     			}
     			break;
     	}
+    	
+    	/*
+    	 * the index looks up the first lexeme of a text, and the doc id an
+    	 * integer is printed as
+    	 */
+    	if (strcmp(qual->opname.data, "@@") == 0 && qual->leftOperand.len != 0)
+    	    qual->exact = (node->consttype == TEXTOID && isSingleLexeme(extval, FALSE));
+    	else if (strcmp(qual->opname.data, "=") == 0)
+    	{
+    	    char id[16];
+    	    
+    	    snprintf(id, sizeof(id), "%d", atoi(extval));
+    	    qual->exact = (strcmp(id, extval) == 0);
+    	}
         return 0;
     }
     else {
@@ -405,13 +509,21 @@ deparseBoolExpr(PushableQualNode *qual,
 #ifdef DEBUG
 	elog(NOTICE, "opname:%s", qual->opname.data);
 #endif
+	/* as exact as its children */
+	qual->exact = TRUE;
 	
     /* attach subtree node to the local root */
     if (strcmp(qual->opname.data, "NOT") == 0)
     {
         PushableQualNode *subtree = (PushableQualNode *) palloc(sizeof(PushableQualNode));
         subtree->childNodes = NIL;
-        if (deparseExpr(subtree, list_nth(node->args, 0), root, mapping) == 0)
+        /*
+         * The recheck can only drop rows, so the index must not miss a
+         * match: the NOT of a clause matched only at most by the index
+         * would miss some.
+         */
+        if (deparseExpr(subtree, list_nth(node->args, 0), root, mapping) == 0 &&
+            isExactQual(subtree))
         {
             qual->childNodes = lappend(qual->childNodes, subtree);
         }
@@ -475,7 +587,16 @@ deparseFuncExpr(PushableQualNode *qual,
 	        strcmp(schemaname, "pg_catalog") == 0 && 
 	        (strcmp(funcname, "to_tsquery") == 0 || strcmp(funcname, "plainto_tsquery") == 0))
 	    {
-		    PushableQualNode *subtree = (PushableQualNode *) palloc(sizeof(PushableQualNode));
+		    PushableQualNode *subtree;
+		    
+		    /* the query string of a prepared statement, known at run time */
+		    if (list_length(node->args) == 1 && IsA(linitial(node->args), Param))
+		    {
+		        setParamKind(qual, (char *) funcname, (Expr *) linitial(node->args));
+		        return 0;
+		    }
+		    
+		    subtree = (PushableQualNode *) palloc(sizeof(PushableQualNode));
             subtree->childNodes = NIL;
             initStringInfo(&subtree->opname);
             initStringInfo(&subtree->optype);
@@ -491,7 +612,8 @@ deparseFuncExpr(PushableQualNode *qual,
 		        else
 		            tsquery = (TSQuery) DirectFunctionCall1( plainto_tsquery, PointerGetDatum(cstring_to_text(subtree->rightOperand.data)) );
 		        qtTree = QT2QTN(GETQUERY(tsquery), GETOPERAND(tsquery));
-                copyTree(qtTree, qual, mapping);
+                if (copyTree(qtTree, qual, mapping, FALSE) != 0)
+                    return -1;
 #ifdef DEBUG
                 printQualTree(qual, 4);
 #endif
@@ -517,6 +639,74 @@ deparseFuncExpr(PushableQualNode *qual,
 }
 
 
+/*
+ * Deparse a parameter into a param_node, whose operand is only known
+ * when the scan starts:
+ * 1. [text @@] tsquery or text param
+ * 2. [id =] param
+ */
+int
+deparseParam(PushableQualNode *qual,
+             Param *node,
+             PlannerInfo *root,
+             List *mapping)
+{
+#ifdef DEBUG
+    elog(NOTICE, "deparseParam");
+#endif
+
+    if (strcmp(qual->optype.data, "op_node") == 0 &&
+        qual->leftOperand.len != 0 &&
+        qual->rightOperand.len == 0)
+    {
+        if (strcmp(qual->opname.data, "@@") == 0 && node->paramtype == TSQUERYOID)
+        {
+            setParamKind(qual, "tsquery", (Expr *) node);
+            return 0;
+        }
+        if (strcmp(qual->opname.data, "@@") == 0 && node->paramtype == TEXTOID)
+        {
+            setParamKind(qual, "text", (Expr *) node);
+            return 0;
+        }
+        if (strcmp(qual->opname.data, "=") == 0)
+        {
+            setParamKind(qual, "=", (Expr *) node);
+            return 0;
+        }
+    }
+    elog(NOTICE, "Param not supported!");
+    return -1;
+}
+
+/*
+ * turn an op_node into a param_node of the given kind: to_tsquery,
+ * plainto_tsquery, tsquery, text or =
+ */
+static void
+setParamKind(PushableQualNode *qual, char *kind, Expr *param)
+{
+    resetStringInfo(&qual->optype);
+    appendStringInfo(&qual->optype, "%s", "param_node");
+    resetStringInfo(&qual->opname);
+    appendStringInfo(&qual->opname, "%s", kind);
+    qual->param = param;
+}
+
+static char
+paramKindCode(char *kind)
+{
+    int k;
+    
+    for (k = 0; paramKinds[k].name != NULL; k++)
+    {
+        if (strcmp(paramKinds[k].name, kind) == 0)
+            return paramKinds[k].code;
+    }
+    elog(ERROR, "Unknown param kind %s!", kind);
+    return 0;
+}
+
 /*
  * Deparse given operator expression into buf.  To avoid problems around
  * priority of operations, we always parenthesize the arguments.  Also we use
@@ -571,6 +761,7 @@ deparseOpExpr(PushableQualNode *qual,
         initStringInfo(&qual->leftOperand);
         initStringInfo(&qual->rightOperand);
         qual->childNodes = NIL;
+        qual->exact = FALSE;
         
         arg = list_head(node->args);
         if (deparseExpr(qual, lfirst(arg), root, mapping) != 0)
@@ -624,6 +815,440 @@ printQualTree(PushableQualNode *qualRoot, int indentLevel)
     } 
 }
 
+/*
+ * merge the children of nested AND and OR nodes into their parent of
+ * the same operator, so that the left-deep AND chain of the restriction
+ * clauses and the binary trees of tsqueries become n-ary nodes
+ */
+void
+flattenQualTree(PushableQualNode *qualRoot)
+{
+    ListCell    *lc;
+    List        *children = NIL;
+    
+    if (strcmp(qualRoot->optype.data, "bool_node") != 0)
+        return;
+    
+    foreach(lc, qualRoot->childNodes)
+    {
+        PushableQualNode *child = (PushableQualNode *) lfirst(lc);
+        
+        flattenQualTree(child);
+        if (strcmp(qualRoot->opname.data, "NOT") != 0 &&
+            strcmp(child->optype.data, "bool_node") == 0 &&
+            strcmp(child->opname.data, qualRoot->opname.data) == 0)
+        {
+            children = list_concat(children, child->childNodes);
+            pfree(child);
+        }
+        else
+            children = lappend(children, child);
+    }
+    list_free(qualRoot->childNodes);
+    qualRoot->childNodes = children;
+}
+
+/*
+ * Turn a join clause into a param_node whose operand is an expression
+ * of the outer relations, evaluated for each outer row by the rescans of
+ * a parameterized scan:
+ * 1. id = <outer expr> (or <outer expr> = id)
+ * 2. text @@ <outer tsquery or text>, text @@ [to_tsquery, plainto_tsquery](<outer text>)
+ * Returns NULL for other clauses.
+ */
+PushableQualNode *
+extractJoinQual(RestrictInfo *rinfo, PlannerInfo *root, RelOptInfo *baserel, List *mapping)
+{
+    PushableQualNode    *qual;
+    OpExpr              *op;
+    Expr                *inner;
+    Expr                *outer;
+    HeapTuple           tuple;
+    Form_pg_operator    form;
+    char                *opname;
+    char                *colname;
+    char                *kind = NULL;
+    
+    if (!IsA(rinfo->clause, OpExpr))
+        return NULL;
+    op = (OpExpr *) rinfo->clause;
+    if (list_length(op->args) != 2)
+        return NULL;
+    
+    tuple = SearchSysCache1(OPEROID, ObjectIdGetDatum(op->opno));
+    if (!HeapTupleIsValid(tuple))
+        elog(ERROR, "cache lookup failed for operator %u", op->opno);
+    form = (Form_pg_operator) GETSTRUCT(tuple);
+    opname = pstrdup(NameStr(form->oprname));
+    if (strcmp(get_namespace_name(form->oprnamespace), "pg_catalog") != 0)
+        opname[0] = '\0';
+    ReleaseSysCache(tuple);
+    
+    inner = (Expr *) linitial(op->args);
+    outer = (Expr *) lsecond(op->args);
+    if (strcmp(opname, "=") == 0 &&
+        !(IsA(inner, Var) && ((Var *) inner)->varno == baserel->relid))
+    {
+        inner = (Expr *) lsecond(op->args);
+        outer = (Expr *) linitial(op->args);
+    }
+    if (!IsA(inner, Var) || ((Var *) inner)->varno != baserel->relid ||
+        bms_is_member(baserel->relid, pull_varnos((Node *) outer)))
+        return NULL;
+    
+    colname = get_attname(root->simple_rte_array[baserel->relid]->relid, ((Var *) inner)->varattno);
+    if (strcmp(opname, "=") == 0 && strcmp(colname, (char *) list_nth(mapping, 0)) == 0)
+        kind = "=";
+    else if (strcmp(opname, "@@") == 0 && strcmp(colname, (char *) list_nth(mapping, 1)) == 0)
+    {
+        if (IsA(outer, FuncExpr) && list_length(((FuncExpr *) outer)->args) == 1 &&
+            strcmp(get_namespace_name(get_func_namespace(((FuncExpr *) outer)->funcid)), "pg_catalog") == 0 &&
+            (strcmp(get_func_name(((FuncExpr *) outer)->funcid), "to_tsquery") == 0 ||
+             strcmp(get_func_name(((FuncExpr *) outer)->funcid), "plainto_tsquery") == 0))
+        {
+            kind = get_func_name(((FuncExpr *) outer)->funcid);
+            outer = (Expr *) linitial(((FuncExpr *) outer)->args);
+        }
+        else if (exprType((Node *) outer) == TSQUERYOID)
+            kind = "tsquery";
+        else if (exprType((Node *) outer) == TEXTOID)
+            kind = "text";
+    }
+    if (kind == NULL)
+        return NULL;
+    
+    qual = (PushableQualNode *) palloc0(sizeof(PushableQualNode));
+    initStringInfo(&qual->optype);
+    initStringInfo(&qual->opname);
+    initStringInfo(&qual->leftOperand);
+    initStringInfo(&qual->rightOperand);
+    appendStringInfo(&qual->optype, "%s", "op_node");
+    appendStringInfo(&qual->leftOperand, "%s", colname);
+    setParamKind(qual, kind, outer);
+    return qual;
+}
+
+/*
+ * Number the param_nodes of a qual tree after the expressions already
+ * in params, and append their expressions, which become the fdw_exprs
+ * of the plan.
+ */
+List *
+extractQualParams(PushableQualNode *qualRoot, List *params)
+{
+    ListCell    *lc;
+    
+    if (strcmp(qualRoot->optype.data, "param_node") == 0)
+    {
+        resetStringInfo(&qualRoot->rightOperand);
+        appendStringInfo(&qualRoot->rightOperand, "%d", list_length(params));
+        return lappend(params, qualRoot->param);
+    }
+    if (strcmp(qualRoot->optype.data, "bool_node") == 0)
+    {
+        foreach(lc, qualRoot->childNodes)
+            params = extractQualParams((PushableQualNode *) lfirst(lc), params);
+    }
+    return params;
+}
+
+/*
+ * Copy a qual tree, replacing its param_nodes by the operands they get
+ * from the values of the fdw_exprs, of type types. A tsquery becomes a
+ * subtree, as for a constant one, matching every doc in place of the
+ * operands the index could miss matches of (see copyTree()), and a text
+ * is taken as plainto_tsquery does. A NULL or empty query gives an empty
+ * term, matching no document.
+ */
+PushableQualNode *
+bindQualTree(PushableQualNode *qualRoot, Datum *values, bool *nulls, Oid *types, List *mapping)
+{
+    PushableQualNode *bound = bindQualNode(qualRoot, values, nulls, types, mapping);
+    
+    flattenQualTree(bound);
+    return bound;
+}
+
+static PushableQualNode *
+bindQualNode(PushableQualNode *qualRoot, Datum *values, bool *nulls, Oid *types, List *mapping)
+{
+    PushableQualNode    *node = (PushableQualNode *) palloc0(sizeof(PushableQualNode));
+    ListCell            *lc;
+    int                 k;
+    char                *kind;
+    
+    initStringInfo(&node->optype);
+    initStringInfo(&node->opname);
+    if (strcmp(qualRoot->optype.data, "bool_node") == 0)
+    {
+        appendStringInfo(&node->optype, "%s", qualRoot->optype.data);
+        appendStringInfo(&node->opname, "%s", qualRoot->opname.data);
+        foreach(lc, qualRoot->childNodes)
+            node->childNodes = lappend(node->childNodes,
+                    bindQualNode((PushableQualNode *) lfirst(lc), values, nulls, types, mapping));
+        return node;
+    }
+    
+    initStringInfo(&node->leftOperand);
+    initStringInfo(&node->rightOperand);
+    appendStringInfo(&node->optype, "%s", "op_node");
+    appendStringInfo(&node->leftOperand, "%s", qualRoot->leftOperand.data);
+    if (strcmp(qualRoot->optype.data, "op_node") == 0)
+    {
+        appendStringInfo(&node->opname, "%s", qualRoot->opname.data);
+        appendStringInfo(&node->rightOperand, "%s", qualRoot->rightOperand.data);
+        return node;
+    }
+    
+    k = atoi(qualRoot->rightOperand.data);
+    kind = qualRoot->opname.data;
+    if (nulls[k])
+        appendStringInfo(&node->opname, "%s", "@@");
+    else if (strcmp(kind, "=") == 0)
+    {
+        Oid     typoutput;
+        bool    typIsVarlena;
+        
+        getTypeOutputInfo(types[k], &typoutput, &typIsVarlena);
+        appendStringInfo(&node->opname, "%s", "=");
+        appendStringInfo(&node->rightOperand, "%s", OidOutputFunctionCall(typoutput, values[k]));
+    }
+    else
+    {
+        TSQuery tsquery;
+        
+        if (strcmp(kind, "to_tsquery") == 0)
+            tsquery = (TSQuery) DatumGetPointer(DirectFunctionCall1(to_tsquery, values[k]));
+        else if (strcmp(kind, "tsquery") == 0)
+            tsquery = DatumGetTSQuery(values[k]);
+        else
+            tsquery = (TSQuery) DatumGetPointer(DirectFunctionCall1(plainto_tsquery, values[k]));
+        appendStringInfo(&node->opname, "%s", "@@");
+        if (tsquery->size > 0)
+            copyTree(QT2QTN(GETQUERY(tsquery), GETOPERAND(tsquery)), node, mapping, TRUE);
+    }
+    return node;
+}
+
+/*
+ * Serialize a qual tree into a compact string kept in the fdw_private
+ * of a plan, "" for no tree. In prefix form, a term is @'word', an id
+ * ='n', and a bool node &(...), |(...) or !(...) of its comma separated
+ * children; quotes in operands are doubled. A param_node is $ followed
+ * by its kind (t: to_tsquery, p: plainto_tsquery, q: tsquery, s: text,
+ * i: id) and its position in the fdw_exprs. Column names are left out,
+ * they are the id_col and text_col of the table.
+ */
+char *
+serializeQualTree(PushableQualNode *qualRoot)
+{
+    StringInfoData buf;
+    
+    initStringInfo(&buf);
+    if (qualRoot != NULL)
+        appendQualTree(&buf, qualRoot);
+    return buf.data;
+}
+
+static void
+appendQualTree(StringInfo buf, PushableQualNode *qualRoot)
+{
+    ListCell    *lc;
+    char        *ptr;
+    
+    if (strcmp(qualRoot->optype.data, "param_node") == 0)
+    {
+        appendStringInfo(buf, "$%c%s", paramKindCode(qualRoot->opname.data),
+                            qualRoot->rightOperand.data);
+        return;
+    }
+    if (strcmp(qualRoot->optype.data, "op_node") == 0)
+    {
+        appendStringInfoChar(buf, (strcmp(qualRoot->opname.data, "@@") == 0) ? '@' : '=');
+        appendStringInfoChar(buf, '\'');
+        for (ptr = qualRoot->rightOperand.data; *ptr; ptr++)
+        {
+            if (*ptr == '\'')
+                appendStringInfoChar(buf, '\'');
+            appendStringInfoChar(buf, *ptr);
+        }
+        appendStringInfoChar(buf, '\'');
+        return;
+    }
+    
+    if (strcmp(qualRoot->opname.data, "AND") == 0)
+        appendStringInfoChar(buf, '&');
+    else if (strcmp(qualRoot->opname.data, "OR") == 0)
+        appendStringInfoChar(buf, '|');
+    else
+        appendStringInfoChar(buf, '!');
+    appendStringInfoChar(buf, '(');
+    foreach(lc, qualRoot->childNodes)
+    {
+        if (lc != list_head(qualRoot->childNodes))
+            appendStringInfoChar(buf, ',');
+        appendQualTree(buf, (PushableQualNode *) lfirst(lc));
+    }
+    appendStringInfoChar(buf, ')');
+}
+
+/*
+ * rebuild a qual tree serialized by serializeQualTree(), NULL for "".
+ * mapping gives the column names of the operands.
+ */
+PushableQualNode *
+deserializeQualTree(char *str, List *mapping)
+{
+    PushableQualNode    *qualRoot;
+    char                *ptr = str;
+    
+    if (*str == '\0')
+        return NULL;
+    qualRoot = parseQualTree(&ptr, mapping);
+    if (*ptr != '\0')
+        elog(ERROR, "Pushed down quals corrupted!");
+    return qualRoot;
+}
+
+static PushableQualNode *
+parseQualTree(char **ptr, List *mapping)
+{
+    PushableQualNode    *qualRoot = (PushableQualNode *) palloc0(sizeof(PushableQualNode));
+    char                *p = *ptr;
+    
+    initStringInfo(&qualRoot->optype);
+    initStringInfo(&qualRoot->opname);
+    if (*p == '$')
+    {
+        int k;
+        
+        appendStringInfo(&qualRoot->optype, "%s", "param_node");
+        for (k = 0; paramKinds[k].name != NULL && paramKinds[k].code != p[1]; k++)
+            ;
+        if (paramKinds[k].name == NULL)
+            elog(ERROR, "Pushed down quals corrupted!");
+        appendStringInfo(&qualRoot->opname, "%s", paramKinds[k].name);
+        initStringInfo(&qualRoot->leftOperand);
+        initStringInfo(&qualRoot->rightOperand);
+        appendStringInfo(&qualRoot->leftOperand, "%s",
+                            (char *) list_nth(mapping, (p[1] == 'i') ? 0 : 1));
+        for (p += 2; *p >= '0' && *p <= '9'; p++)
+            appendStringInfoChar(&qualRoot->rightOperand, *p);
+        if (qualRoot->rightOperand.len == 0)
+            elog(ERROR, "Pushed down quals corrupted!");
+        *ptr = p;
+        return qualRoot;
+    }
+    if (*p == '@' || *p == '=')
+    {
+        appendStringInfo(&qualRoot->optype, "%s", "op_node");
+        appendStringInfo(&qualRoot->opname, "%s", (*p == '@') ? "@@" : "=");
+        initStringInfo(&qualRoot->leftOperand);
+        initStringInfo(&qualRoot->rightOperand);
+        appendStringInfo(&qualRoot->leftOperand, "%s",
+                            (char *) list_nth(mapping, (*p == '@') ? 1 : 0));
+        if (*++p != '\'')
+            elog(ERROR, "Pushed down quals corrupted!");
+        for (p++; *p != '\'' || p[1] == '\''; p++)
+        {
+            if (*p == '\0')
+                elog(ERROR, "Pushed down quals corrupted!");
+            if (*p == '\'')
+                p++;
+            appendStringInfoChar(&qualRoot->rightOperand, *p);
+        }
+        *ptr = p + 1;
+        return qualRoot;
+    }
+    
+    appendStringInfo(&qualRoot->optype, "%s", "bool_node");
+    if (*p == '&')
+        appendStringInfo(&qualRoot->opname, "%s", "AND");
+    else if (*p == '|')
+        appendStringInfo(&qualRoot->opname, "%s", "OR");
+    else if (*p == '!')
+        appendStringInfo(&qualRoot->opname, "%s", "NOT");
+    else
+        elog(ERROR, "Pushed down quals corrupted!");
+    if (*++p != '(')
+        elog(ERROR, "Pushed down quals corrupted!");
+    do
+    {
+        p++;
+        qualRoot->childNodes = lappend(qualRoot->childNodes, parseQualTree(&p, mapping));
+    } while (*p == ',');
+    if (*p != ')')
+        elog(ERROR, "Pushed down quals corrupted!");
+    *ptr = p + 1;
+    return qualRoot;
+}
+
+/*
+ * Readable form of a qual tree for EXPLAIN, e.g.
+ * content @@ 'oil' AND (content @@ to_tsquery($1) OR NOT id = 3).
+ * params are the fdw_exprs of the plan.
+ */
+char *
+qualTreeToString(PushableQualNode *qualRoot, List *params)
+{
+    StringInfoData buf;
+    
+    initStringInfo(&buf);
+    appendQualTreeText(&buf, qualRoot, FALSE, params);
+    return buf.data;
+}
+
+static void
+appendQualTreeText(StringInfo buf, PushableQualNode *qualRoot, bool nested, List *params)
+{
+    ListCell    *lc;
+    
+    if (strcmp(qualRoot->optype.data, "param_node") == 0)
+    {
+        Expr    *param = (Expr *) list_nth(params, atoi(qualRoot->rightOperand.data));
+        char    *kind = qualRoot->opname.data;
+        
+        appendStringInfo(buf, "%s %s ", qualRoot->leftOperand.data,
+                            (strcmp(kind, "=") == 0) ? "=" : "@@");
+        if (strcmp(kind, "to_tsquery") == 0 || strcmp(kind, "plainto_tsquery") == 0)
+            appendStringInfo(buf, "%s(", kind);
+        if (IsA(param, Param))
+            appendStringInfo(buf, "$%d", ((Param *) param)->paramid);
+        else
+            appendStringInfoChar(buf, '?');
+        if (strcmp(kind, "to_tsquery") == 0 || strcmp(kind, "plainto_tsquery") == 0)
+            appendStringInfoChar(buf, ')');
+        return;
+    }
+    if (strcmp(qualRoot->optype.data, "op_node") == 0)
+    {
+        appendStringInfo(buf, "%s %s ", qualRoot->leftOperand.data, qualRoot->opname.data);
+        if (strcmp(qualRoot->opname.data, "@@") == 0)
+            appendStringInfoString(buf, quote_literal_cstr(qualRoot->rightOperand.data));
+        else
+            appendStringInfoString(buf, qualRoot->rightOperand.data);
+        return;
+    }
+    
+    if (strcmp(qualRoot->opname.data, "NOT") == 0)
+    {
+        appendStringInfoString(buf, "NOT ");
+        appendQualTreeText(buf, (PushableQualNode *) linitial(qualRoot->childNodes), TRUE, params);
+        return;
+    }
+    
+    if (nested)
+        appendStringInfoChar(buf, '(');
+    foreach(lc, qualRoot->childNodes)
+    {
+        if (lc != list_head(qualRoot->childNodes))
+            appendStringInfo(buf, " %s ", qualRoot->opname.data);
+        appendQualTreeText(buf, (PushableQualNode *) lfirst(lc), TRUE, params);
+    }
+    if (nested)
+        appendStringInfoChar(buf, ')');
+}
+
 /*
  * recursively free the nodes of a qualtree
  */
@@ -641,10 +1266,15 @@ freeQualTree(PushableQualNode *qualRoot)
 }
 
 /*
- * Convert tree structure from QTNode tree (to_tsquaery) to Qual tree
+ * Convert tree structure from QTNode tree (to_tsquaery) to Qual tree.
+ * The index must match every doc the tsquery does, the recheck drops the
+ * others. A prefix operand is looked up as a whole term, and the NOT of
+ * a phrase or of a weighted operand is evaluated from the docs of its
+ * words only, so both would miss matches: return -1 for them, or if
+ * approximate, match every doc in their place.
  */
-void
-copyTree(QTNode *qtTree, PushableQualNode *pqTree, List *mapping)
+int
+copyTree(QTNode *qtTree, PushableQualNode *pqTree, List *mapping, bool approximate)
 {
     int n;
     QueryItem * queryItem = qtTree->valnode;
@@ -655,6 +1285,13 @@ copyTree(QTNode *qtTree, PushableQualNode *pqTree, List *mapping)
   
     if (queryItem->type == QI_VAL)
     {
+        if (queryItem->qoperand.prefix)
+        {
+            if (!approximate)
+                return -1;
+            setMatchAll(pqTree);
+            return 0;
+        }
         initStringInfo(&pqTree->optype);
         initStringInfo(&pqTree->opname);
         initStringInfo(&pqTree->leftOperand);
@@ -663,11 +1300,14 @@ copyTree(QTNode *qtTree, PushableQualNode *pqTree, List *mapping)
         appendStringInfo(&pqTree->opname, "%s", "@@");
         appendStringInfo(&pqTree->leftOperand, "%s", (char *) list_nth(mapping, 1));
         appendStringInfo(&pqTree->rightOperand, "%s", qtTree->word);
+        /* weights are not in the index */
+        pqTree->exact = (queryItem->qoperand.weight == 0 && isSingleLexeme(qtTree->word, TRUE));
     }
     else if (queryItem->type == QI_OPR)
     {
         initStringInfo(&pqTree->optype);
         appendStringInfo(&pqTree->optype, "%s", "bool_node");
+        pqTree->exact = TRUE;
         
         if (queryItem->qoperator.oper == OP_NOT)
         {
@@ -684,12 +1324,44 @@ copyTree(QTNode *qtTree, PushableQualNode *pqTree, List *mapping)
             initStringInfo(&pqTree->opname);
             appendStringInfo(&pqTree->opname, "%s", "OR");
         }
+        else
+        {
+            /* a phrase matches the docs of the AND of its words at most */
+            initStringInfo(&pqTree->opname);
+            appendStringInfo(&pqTree->opname, "%s", "AND");
+            pqTree->exact = FALSE;
+        }
     }
     pqTree->childNodes = NIL;
     for (n = 0; n < qtTree->nchild; n++)
     {
-        PushableQualNode *subtree = (PushableQualNode *) palloc(sizeof(PushableQualNode));
+        PushableQualNode *subtree = (PushableQualNode *) palloc0(sizeof(PushableQualNode));
         pqTree->childNodes = lappend(pqTree->childNodes, subtree);
-        copyTree(qtTree->child[n], subtree, mapping);
+        if (copyTree(qtTree->child[n], subtree, mapping, approximate) != 0)
+            return -1;
     }
-}
\ No newline at end of file
+    
+    if (queryItem->type == QI_OPR && queryItem->qoperator.oper == OP_NOT &&
+        !isExactQual((PushableQualNode *) linitial(pqTree->childNodes)))
+    {
+        if (!approximate)
+            return -1;
+        freeQualTree((PushableQualNode *) linitial(pqTree->childNodes));
+        setMatchAll(pqTree);
+    }
+    return 0;
+}
+
+/*
+ * make a node match every doc, as the AND of no qual does
+ */
+static void
+setMatchAll(PushableQualNode *qual)
+{
+    initStringInfo(&qual->optype);
+    initStringInfo(&qual->opname);
+    appendStringInfo(&qual->optype, "%s", "bool_node");
+    appendStringInfo(&qual->opname, "%s", "AND");
+    qual->childNodes = NIL;
+    qual->exact = FALSE;
+}
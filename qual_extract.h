@@ -30,18 +30,33 @@
  */
 typedef struct PushableQualNode
 {
-    StringInfoData  opname;         /* bool_node: [AND, OR, NOT] op_node: [@@, =] */
-    StringInfoData  optype;         /* [bool_node, op_node] */
-    StringInfoData  leftOperand;    /* for op_node only */
-    StringInfoData  rightOperand;   /* for op_node only */
+    StringInfoData  opname;         /* bool_node: [AND, OR, NOT] op_node: [@@, =]
+                                     * param_node: [to_tsquery, plainto_tsquery, tsquery, text, =] */
+    StringInfoData  optype;         /* [bool_node, op_node, param_node] */
+    StringInfoData  leftOperand;    /* for op_node and param_node */
+    StringInfoData  rightOperand;   /* for op_node, position in fdw_exprs for param_node */
     List            *childNodes;    /* for bool_node only */
     List            *plist;         /* postings list assoc with this qual */
+    int             df;             /* upper bound of the docs matching, see estimateQualTree() */
+    Expr            *param;         /* for param_node only, operand known at run time */
+    bool            exact;          /* the index matches the docs the operator does, and
+                                     * for a bool_node if its children do too */
 } PushableQualNode;
 
 /*
  * Extraction function
  */
-int extractQuals(PushableQualNode **qualRoot, PlannerInfo *root, RelOptInfo *baserel, List *mapping);
+int extractQuals(PushableQualNode **qualRoot, PlannerInfo *root, RelOptInfo *baserel, List *mapping,
+                List **pushedClauses, List **exactClauses);
+void flattenQualTree(PushableQualNode *qualRoot);
+char * serializeQualTree(PushableQualNode *qualRoot);
+PushableQualNode * deserializeQualTree(char *str, List *mapping);
+char * qualTreeToString(PushableQualNode *qualRoot, List *params);
+PushableQualNode * extractJoinQual(RestrictInfo *rinfo, PlannerInfo *root, RelOptInfo *baserel,
+                                    List *mapping);
+List * extractQualParams(PushableQualNode *qualRoot, List *params);
+PushableQualNode * bindQualTree(PushableQualNode *qualRoot, Datum *values, bool *nulls, Oid *types,
+                                List *mapping);
 void freeQualTree(PushableQualNode *qualRoot);
 void printQualTree(PushableQualNode *qualRoot, int indentLevel);
 
@@ -22,8 +22,10 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <sys/stat.h>
 
 #include "funcapi.h"
+#include "mb/pg_wchar.h"
 #include "storage/fd.h"
 #include "tsearch/ts_utils.h"
 #include "tsearch/ts_locale.h"
@@ -42,8 +44,51 @@
 
 #define KEYSIZE 100000  /* hash key length in bytes */
 #define MAXELEM 100     /* maximum number of elements expected */
+#define DEFAULT_PARAM_SEL 0.005 /* selectivity of a tsquery known at run time only */
+#define POSTINGS_SIMD_SLACK 8 /* doc ids vector stores may write past a result */
 #define DEFAULT_INDEX_BUFF_SIZE 1 /* 1MB for default buffer size */
+#define DEFAULT_MERGE_FACTOR 4  /* segments of a size tier merged together */
+#define MERGE_FLOOR_SIZE (1024 * 1024) /* segments below 1MB share the lowest tier */
 #define ALL "ALL"       /* term representing a global posting list */
+#define CURSOR_END 0x7FFFFFFF   /* doc id of an exhausted qual cursor */
+#define CURSOR_BLOCK 128        /* doc ids a cursor decodes or intersects at once */
+#define TMP_SUFFIX ".tmp"   /* index files being written */
+#define CURRENT_FILE "CURRENT"      /* names the index generation in use */
+#define PROGRESS_FILE "progress"    /* progress of the last index build */
+#define MANIFEST_FILE "manifest"    /* documents covered by an index generation */
+#define NO_TOMBSTONES "-"           /* segment list entry without deletions */
+
+/* postings file formats */
+#define POST_MAGIC "DCPOST"         /* signature of a binary postings file */
+#define POST_MAGIC_LEN 6
+#define POST_HEADER_SIZE 8          /* magic, version byte, reserved byte */
+#define POST_FORMAT_TEXT 0          /* legacy space separated "%d " lists */
+#define POST_FORMAT_VARINT 1        /* doc id gaps as base-128 varints */
+
+/* dictionary file formats */
+#define DICT_MAGIC "DCDICT"         /* signature of a blocked dictionary file */
+#define DICT_MAGIC_LEN 6
+#define DICT_HEADER_SIZE 8          /* magic, version byte, reserved byte */
+#define DICT_TRAILER_SIZE 8         /* number of blocks, block index offset */
+#define DICT_BLOCK_TERMS 32         /* front-coded terms per dictionary block */
+#define DICT_FORMAT_TEXT 0          /* legacy "term ptr len" lines */
+#define DICT_FORMAT_BLOCKED 1       /* sorted, front-coded term blocks */
+
+/* packed document store files */
+#define DOCS_FILE "docs"            /* contents of the documents of a segment */
+#define DOCIDX_FILE "docidx"        /* doc table of the docs file */
+#define DOCIDX_MAGIC "DCDOCS"       /* signature of a doc table */
+#define DOCIDX_MAGIC_LEN 6
+#define DOCIDX_HEADER_SIZE 8        /* magic, version byte, reserved byte */
+#define DOCIDX_TRAILER_SIZE 8       /* number of entries, number of blocks */
+#define DOCIDX_FORMAT_PACKED 1      /* fixed size entries by ascending doc id */
+#define DOCIDX_FORMAT_COMPRESSED 2  /* entries, then offsets of pglz blocks */
+#define DOCS_BLOCK_SIZE (64 * 1024) /* bytes of documents per compressed block */
+
+/* documents copied into the index by a build */
+#define DOCS_NOT_PACKED 0           /* read from the data path */
+#define DOCS_PACKED 1               /* packed document store */
+#define DOCS_COMPRESSED 2           /* packed and compressed in blocks */
 
 /*
  * In-memory structure when indexing collection
@@ -59,43 +104,299 @@ typedef struct DictionaryEntry
  */
 typedef struct PostingInfo {
     char key[100]; /* dictionary key */
-    int ptr; /* point to the posting file position */
+    int64 ptr; /* point to the posting file position */
     int len; /* length of the bytes to read */
+    int df;  /* number of postings, -1 if unknown (legacy dict) */
 } PostingInfo;
 
+/*
+ * Entry of the in-memory block index of a blocked dictionary
+ */
+typedef struct DictBlock {
+    char *firstTerm;    /* first term in the block */
+    uint32 offset;      /* position of the block in the dict file */
+    uint32 len;         /* length of the block in bytes */
+} DictBlock;
+
+/*
+ * Memory mapped index file, shared by all handles on the file
+ */
+typedef struct MappedFile {
+    char *addr;     /* start of the mapping */
+    Size len;       /* length of the file */
+    int refcount;   /* number of open handles using the mapping */
+    bool retired;   /* file was replaced, unmap on last release */
+} MappedFile;
+
+/*
+ * Open dictionary
+ */
+typedef struct TermDictionary {
+    int version;        /* dictionary format of the file (DICT_FORMAT_*) */
+    HTAB *legacy;       /* whole legacy dict loaded into a hashtable */
+    File file;          /* blocked dict file, kept open for lookups */
+    MappedFile *map;    /* memory mapped dict file, NULL if not mapped */
+    int nblocks;        /* number of term blocks */
+    DictBlock *blocks;  /* block index */
+    char *indexData;    /* copy of the block index when not mapped */
+    char *buf;          /* buffer of the last decoded block */
+    uint32 bufsize;     /* size of buf */
+} TermDictionary;
+
+/*
+ * Scan over a blocked dictionary in term order
+ */
+typedef struct DictIterator {
+    TermDictionary *dict;   /* dictionary being scanned */
+    int block;              /* block being decoded */
+    char *ptr;              /* next entry in the block */
+    char *end;              /* end of the block */
+    char *buf;              /* block buffer when the dict is not mapped */
+    uint32 bufsize;         /* size of buf */
+    StringInfoData term;    /* current term */
+    PostingInfo info;       /* current entry */
+} DictIterator;
+
+/*
+ * State of a blocked dictionary being written
+ */
+typedef struct DictWriter {
+    File file;                  /* dict file being written */
+    StringInfoData block;       /* entries of the block being filled */
+    StringInfoData index;       /* serialized block index */
+    StringInfoData prevTerm;    /* last term added, for front coding */
+    StringInfoData firstTerm;   /* first term of the block being filled */
+    int nterms;                 /* number of terms in the current block */
+    int nblocks;                /* number of blocks written */
+    uint32 offset;              /* file position of the current block */
+} DictWriter;
+
 /*
  * Collection-wise stats
  */
 typedef struct CollectionStats {
     int numOfDocs;  /* number of documents in the collection */
-    int numOfBytes; /* total number of bytes of the collection */
+    int64 numOfBytes; /* total number of bytes of the collection */
     double bytesPerDoc;/* average size of doc */
+    Oid cfgId;      /* text search config of the index, InvalidOid if unknown */
 } CollectionStats;
 
+/*
+ * Progress of an index build, kept in the progress file of the index dir
+ */
+typedef struct IndexProgress
+{
+    char    phase[16];      /* tokenizing, writing, merging, done, failed */
+    int     generation;     /* index generation being built */
+    int     pid;            /* process running the build */
+    int     filesTotal;     /* documents to tokenize */
+    int     filesDone;      /* documents tokenized */
+    int64   bytesDone;      /* bytes tokenized */
+    int     runsWritten;    /* runs dumped to disk */
+    int     runsTotal;      /* runs being merged */
+    int     termsMerged;    /* terms written by the merge */
+} IndexProgress;
+
+/*
+ * Open postings file
+ */
+typedef struct PostingsFile {
+    File file;          /* file handle, -1 when the file is mapped */
+    MappedFile *map;    /* memory mapped file, NULL if not mapped */
+    int version;        /* postings format of the file (POST_FORMAT_*) */
+} PostingsFile;
+
+/*
+ * Entry of a segment list: a segment directory of the index dir, and
+ * the tombstone file of the doc ids deleted from it, if any
+ */
+typedef struct SegmentRef {
+    char *name;         /* segment directory, g<generation> */
+    char *tombstones;   /* tombstone file in the segment, NULL if none */
+} SegmentRef;
+
+/*
+ * Entry of the doc table of a packed document store
+ */
+typedef struct DocStoreEntry {
+    int32 id;       /* doc id */
+    int32 len;      /* length of its content */
+    int64 offset;   /* offset of its content in the docs file */
+} DocStoreEntry;
+
+/*
+ * Open packed document store of a segment
+ */
+typedef struct DocStore {
+    File file;                  /* docs file */
+    MappedFile *map;            /* memory mapped doc table, NULL if read */
+    char *table;                /* doc table file contents */
+    DocStoreEntry *entries;     /* doc table, by ascending doc id */
+    int nentries;
+    /* compressed stores only */
+    int64 *blocks;              /* offsets of the blocks in the docs file, and of its end */
+    int nblocks;
+    int64 rawSize;              /* size of the documents uncompressed */
+    char *block;                /* last block read, decompressed */
+    int cachedBlock;            /* block in block, -1 if none */
+    char *compressed;           /* block being read */
+} DocStore;
+
+/*
+ * Open segment of an index
+ */
+typedef struct IndexSegment {
+    TermDictionary *dict;
+    PostingsFile *post;
+    DocStore *docs;             /* packed document store, NULL if none */
+    unsigned char *tombstones;  /* bitmap of deleted doc ids, NULL if none */
+    int ntombstoneBytes;        /* size of the bitmap */
+} IndexSegment;
+
+/*
+ * Open index: the segments of the generation in use, oldest first
+ */
+typedef struct IndexReader {
+    int nsegments;
+    IndexSegment *segments;
+    int ndocs;                  /* documents of the generation, from its stats */
+    struct QualCursor *allCursor;   /* ALL postings for isLiveDoc(), NULL until needed */
+    MemoryContext cxt;          /* context of the reader and of allCursor */
+} IndexReader;
+
+/* kinds of qual cursors */
+#define CURSOR_POSTINGS 0   /* postings list of a term in one segment */
+#define CURSOR_CONST 1      /* a single doc id, if live */
+#define CURSOR_AND 2        /* docs of every child and of no negated child */
+#define CURSOR_OR 3         /* docs of any child, none if there is no child */
+
+/*
+ * Cursor over the doc ids matched by a qual tree node, in ascending
+ * order. Postings are decoded only as far as the scan advances.
+ */
+typedef struct QualCursor {
+    int type;                       /* CURSOR_* */
+    int32 doc;                      /* current doc id, -1 before the first */
+    /* CURSOR_POSTINGS */
+    IndexSegment *seg;
+    int version;                    /* postings format (POST_FORMAT_*) */
+    char *ptr;                      /* next posting to decode */
+    char *end;
+    char *copy;                     /* postings read in memory, NULL if mapped */
+    uint32 prev;                    /* last doc id decoded */
+    int32 *ids;                     /* live doc ids of the block decoded, or
+                                     * for an AND the doc ids of both blocks */
+    int nids;
+    int pos;                        /* next doc id of the block */
+    /* CURSOR_CONST */
+    int32 id;
+    /* CURSOR_AND, CURSOR_OR */
+    struct QualCursor **children;
+    int nchildren;
+    struct QualCursor **negated;    /* CURSOR_AND only */
+    int nnegated;
+    /* CURSOR_AND of two children or more */
+    int32 *blocks[2];               /* next doc ids of the first two children */
+    int nblocks[2];
+    int iblocks[2];                 /* first doc id of each block left */
+} QualCursor;
+
+/* doc id deleted from a segment since it was written */
+#define IS_TOMBSTONED(seg, id) \
+    ((seg)->tombstones != NULL && (id) >= 0 && (id) / 8 < (seg)->ntombstoneBytes && \
+     ((seg)->tombstones[(id) / 8] & (1 << ((id) % 8))) != 0)
+
 /* index utility */
-int imIndex(char *datapath, char *indexpath);
-int spimIndex(char *datapath, char *indexpath, int buffer_size);
+int64 imIndex(char *datapath, char *indexpath, Oid cfgId, char **fnames, int nfiles);
+int64 spimIndex(char *datapath, char *indexpath, int buffer_size, Oid cfgId, char **fnames, int nfiles);
+int64 parallelIndex(char *datapath, char *indexpath, char *method, int buffer_size, int nworkers,
+                    Oid cfgId, char **fnames, int nfiles);
+void buildIndex(char *datapath, char *indexdir, char *method, int buffer_size, int nworkers,
+                    Oid cfgId, bool incremental, int merge_factor, int pack_docs);
+int currentGeneration(char *indexdir);
+char * currentIndexPath(char *indexdir);
+bool readProgress(char *path, IndexProgress *p);
+void writeProgress(char *path, IndexProgress *p);
+#if PG_VERSION_NUM >= 90500
+extern PGDLLEXPORT void dc_fdw_index_worker_main(Datum main_arg);
+#endif
 
 /* search utility */
 File openStat (char *indexpath);
-File openDict (char *indexpath);
-File openPost (char *indexpath);
+TermDictionary * openDict (char *indexpath);
+TermDictionary * openDictPath (char *fname);
+PostingsFile * openPost (char *indexpath);
+PostingsFile * openPostPath (char *fname);
 File openDoc (char *fname);
 
 void closeStat (File sfile);
-void closeDict (File dfile);
-void closePost (File pfile);
+void closeDict (TermDictionary *dict);
+void closePost (PostingsFile *pfile);
 void closeDoc (File file);
 
 int loadDict(HTAB **dict, File dfile);
 int loadStat(CollectionStats **stats, File sfile);
 int loadDoc(char **buf, File file);
+text * loadDocText(File file, int maxBytes);
+text * finishDocText(text *result, int len, int maxBytes);
+
+int estimateQualTree(PushableQualNode *node, IndexReader *index, int ndocs);
+double qualTreeSelectivity(PushableQualNode *node, int ndocs);
+char * normalizeTerm(char *text);
+char * loadPostings(PostingsFile *pfile, PostingInfo *info, bool *copied);
+
+/* qual cursors */
+QualCursor * openQualCursor(PushableQualNode *node, IndexReader *index);
+QualCursor * openAllCursor(IndexReader *index);
+QualCursor * openMergeCursor(IndexSegment **segs, PostingInfo *infos, int n);
+bool isLiveDoc(IndexReader *index, int32 id);
+int32 cursorNext(QualCursor *c);
+int32 cursorAdvance(QualCursor *c, int32 target);
+void closeQualCursor(QualCursor *c);
+
+/* postings kernels */
+extern bool dc_fdw_enable_simd;
+int intersectPostings(int32 *a, int na, int32 *b, int nb, int32 *out);
+
+/* dictionary */
+bool lookupTerm(TermDictionary *dict, char *term, PostingInfo *info);
+DictIterator * dictIterBegin(TermDictionary *dict);
+bool dictIterNext(DictIterator *iter);
+void dictIterEnd(DictIterator *iter);
+DictWriter * dictWriterBegin(File dfile);
+void dictWriterAdd(DictWriter *writer, char *term, int64 ptr, int len, int df);
+void dictWriterEnd(DictWriter *writer);
+
+/* index segments */
+List * readSegmentList(char *indexdir, int *generation);
+void writeSegmentList(char *indexdir, int generation, List *segments);
+IndexReader * openIndex(char *indexdir);
+void closeIndex(IndexReader *index);
+void openSegment(IndexSegment *seg, char *path, char *tombstones);
+void closeSegment(IndexSegment *seg);
+unsigned char * loadTombstones(char *fname, int *nbytes);
+void writeTombstones(char *fname, unsigned char *bits, int nbytes);
+
+/* packed document stores */
+void writeDocStore(char *datapath, char *indexpath, char **fnames, int nfiles, int pack_docs);
+void mergeDocStores(char *indexdir, List *selected, char *indexpath, int pack_docs);
+DocStore * openDocStore(char *indexpath);
+void closeDocStore(DocStore *store);
+text * fetchPackedDoc(IndexReader *index, int32 id, int maxBytes);
+
+/* memory mapped index files */
+MappedFile * mapIndexFile(char *fname);
+void releaseMappedFile(MappedFile *mf);
 
-List * evalQualTree(PushableQualNode *node, HTAB *dict, File pfile, List *allList);
-List * searchTerm(char *term, HTAB *dict, File pfile, bool isALL, bool indexing);
-List * pIntersect(List *list1, List *list2);
-List * pIntersectNot(List *list1, List *list2);
-List * pUnion(List *list1, List *list2);
-List * pNegate(List *list, List *allList);
+/* postings codec */
+void writePostHeader(File pfile);
+int readPostHeader(File pfile);
+int checkPostHeader(char *header, int len);
+void appendVarint(StringInfo buf, uint32 val);
+uint32 readVarint(char **ptr, char *end);
+void appendVarint64(StringInfo buf, uint64 val);
+uint64 readVarint64(char **ptr, char *end);
+void encodePostings(StringInfo buf, int *ids, int n);
+void appendPostings(StringInfo out, char *buf, int len, int *last, int *count);
 
 #endif   /* QUAL_PUSHDOWN_H */
\ No newline at end of file
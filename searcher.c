@@ -17,8 +17,10 @@
 
 #include "qual_pushdown.h"
 
-bool hasSkip(int curr, int interval, int total);
-int skip(int curr, int interval);
+#include <unistd.h>
+
+static int termDocFreq(char *text, IndexReader *index, int ndocs);
+static int cmpQualDocFreq(const void *p1, const void *p2);
 
 /*
  * open stats file
@@ -27,17 +29,21 @@ File
 openStat (char *indexpath)
 {
     StringInfoData sid_stat_dir;
+    File sfile;
     
     initStringInfo(&sid_stat_dir);
     appendStringInfo(&sid_stat_dir, "%s/stat", indexpath);
     
-    return PathNameOpenFile(sid_stat_dir.data, O_RDONLY,  0666);
+    sfile = PathNameOpenFile(sid_stat_dir.data, O_RDONLY,  0666);
+    if (sfile < 0)
+        elog(ERROR, "No index found in %s, run dc_fdw_build_index() first!", indexpath);
+    return sfile;
 }
 
 /*
  * open dict file
  */
-File
+TermDictionary *
 openDict (char *indexpath)
 {
     StringInfoData sid_dict_dir;
@@ -45,13 +51,13 @@ openDict (char *indexpath)
     initStringInfo(&sid_dict_dir);
     appendStringInfo(&sid_dict_dir, "%s/dict", indexpath);
     
-    return PathNameOpenFile(sid_dict_dir.data, O_RDONLY,  0666);
+    return openDictPath(sid_dict_dir.data);
 }
 
 /*
  * open postings file
  */
-File
+PostingsFile *
 openPost (char *indexpath)
 {
     StringInfoData sid_post_dir;
@@ -59,7 +65,33 @@ openPost (char *indexpath)
     initStringInfo(&sid_post_dir);
     appendStringInfo(&sid_post_dir, "%s/post", indexpath);
     
-    return PathNameOpenFile(sid_post_dir.data, O_RDONLY,  0666);
+    return openPostPath(sid_post_dir.data);
+}
+
+/*
+ * open a postings file by its full path and identify its format.
+ * The file is memory mapped if possible, otherwise read through the
+ * File API.
+ */
+PostingsFile *
+openPostPath (char *fname)
+{
+    PostingsFile *pfile = (PostingsFile *) palloc(sizeof(PostingsFile));
+    
+    pfile->map = mapIndexFile(fname);
+    if (pfile->map != NULL)
+    {
+        pfile->file = -1;
+        pfile->version = checkPostHeader(pfile->map->addr, (int) Min(pfile->map->len, POST_HEADER_SIZE));
+        return pfile;
+    }
+    
+    pfile->file = PathNameOpenFile(fname, O_RDONLY,  0666);
+    if (pfile->file < 0)
+        elog(ERROR, "Cannot open postings file %s!", fname);
+    pfile->version = readPostHeader(pfile->file);
+    
+    return pfile;
 }
 
 /*
@@ -80,22 +112,17 @@ closeStat (File sfile)
     FileClose(sfile);
 }
 
-/*
- * close dict file
- */
-void
-closeDict (File dfile)
-{
-    FileClose(dfile);
-}
-
 /*
  * close post file
  */
 void
-closePost (File pfile)
+closePost (PostingsFile *pfile)
 {
-    FileClose(pfile);
+    if (pfile->map != NULL)
+        releaseMappedFile(pfile->map);
+    else
+        FileClose(pfile->file);
+    pfree(pfile);
 }
 
 /*
@@ -117,7 +144,8 @@ loadStat(CollectionStats **stats, File sfile)
     char    *buf;       /* buffer for stats file content */
     int     status;     /* sscanf status */
     int     dcNumOfFiles;
-    int     dcNumOfBytes;
+    int64   dcNumOfBytes;
+    Oid     cfgId = InvalidOid;
     
 #ifdef DEBUG
      elog(NOTICE, "loadStat");
@@ -131,21 +159,23 @@ loadStat(CollectionStats **stats, File sfile)
     buf[sz] = 0;
     
     /* number of documents in the doc collection */
+    /* older indexes do not record their text search configuration */
     status = sscanf(buf,
-            "NUM_OF_DOCS:%d\nNUM_OF_BYTES:%d",
-			 &dcNumOfFiles, &dcNumOfBytes);
-	if (status != 2)
+            "NUM_OF_DOCS:%d\nNUM_OF_BYTES:" INT64_FORMAT "\nTS_CONFIG:%u",
+			 &dcNumOfFiles, &dcNumOfBytes, &cfgId);
+	if (status != 2 && status != 3)
 		elog(ERROR, "Cannot read stats file!");
 	
     (*stats)->numOfDocs = dcNumOfFiles;
     (*stats)->numOfBytes = dcNumOfBytes;
     (*stats)->bytesPerDoc = ((double) dcNumOfBytes) / dcNumOfFiles;
+    (*stats)->cfgId = cfgId;
 	
     return 0;
 }
 
 /*
- * load dict into memory from file
+ * load a legacy text dict into memory from file
  */
 int
 loadDict(HTAB **dict, File dfile)
@@ -200,6 +230,7 @@ loadDict(HTAB **dict, File dfile)
             {
                 re->ptr = ptr;
                 re->len = atoi(token);
+                re->df = -1;
             }
             resetStringInfo(&sidTerm);
         }
@@ -223,308 +254,251 @@ loadDoc(char **buf, File file)
     return 0;
 }
 
-
 /*
- * skip list functions
+ * load the content of a doc straight into a text datum, sized once from
+ * the size of the file. Only the first maxBytes are read if maxBytes is
+ * positive, cut back to a character boundary. As for a C string, the
+ * content stops at a NUL byte.
  */
-bool
-hasSkip(int curr, int interval, int total)
+text *
+loadDocText(File file, int maxBytes)
 {
-    if (total == curr)
-        return FALSE;
-    else {
-        if (curr % interval == 0) {
-            if (curr + interval < total)
-                return TRUE;
-            else
-                return FALSE;
-        }
-        else
-            return FALSE;
+    text        *result;
+    off_t       sz;
+    int         len = 0;
+    
+    sz = FileSeek(file, 0, SEEK_END);
+    if (sz < 0)
+        elog(ERROR, "Cannot seek doc file!");
+    if (maxBytes > 0 && sz > maxBytes)
+        sz = maxBytes;
+    if (sz > MaxAllocSize - VARHDRSZ)
+        elog(ERROR, "Doc file of %ld bytes is too large!", (long) sz);
+    
+    /* FileRead() may return less than asked for, read on until sz */
+    result = (text *) palloc(VARHDRSZ + sz);
+    FileSeek(file, 0, SEEK_SET);
+    while (len < sz)
+    {
+        int n = FileRead(file, VARDATA(result) + len, (int) sz - len);
+        
+        if (n < 0)
+            elog(ERROR, "Cannot read doc file!");
+        if (n == 0)
+            elog(ERROR, "Doc file shrank while being read!");
+        len += n;
     }
+    return finishDocText(result, len, maxBytes);
 }
 
-int
-skip(int curr, int interval)
+/*
+ * finish a text datum whose len bytes of content have been read from a
+ * document, with at most maxBytes read if maxBytes is positive
+ */
+text *
+finishDocText(text *result, int len, int maxBytes)
 {
-    return curr + interval;
+    char *nul;
+    
+    nul = memchr(VARDATA(result), '\0', len);
+    if (nul != NULL)
+        len = nul - VARDATA(result);
+    else if (len == maxBytes)
+        len = pg_mbcliplen(VARDATA(result), len, len);
+    pg_verifymbstr(VARDATA(result), len, false);
+    SET_VARSIZE(result, VARHDRSZ + len);
+    return result;
 }
 
 
 /*
- * return (list1 AND list2)
+ * normalize a query term to its root form, NULL for a stop word
  */
-List *
-pIntersect(List *list1, List *list2)
+char *
+normalizeTerm(char *text)
 {
-    List *rList = NIL;
-    int list1len = list_length(list1);
-    int list2len = list_length(list2);
-    int skipInterval1 = (int) sqrt((double) list1len);
-    int skipInterval2 = (int) sqrt((double) list2len);
-    int list1curr = 0;
-    int list2curr = 0;
-    /*
-    elog(NOTICE, "%s", "pIntersect");
-    elog(NOTICE, "List1:%d", list1len);
-    elog(NOTICE, "List2:%d", list2len);
-    */
-    while (list1curr < list1len && list2curr < list2len)
-    {
-        int entry1 = list_nth_int(list1, list1curr);
-        int entry2 = list_nth_int(list2, list2curr);
-        /*
-        elog(NOTICE, "ListCurr1:%d:%d", list1curr, entry1);
-        elog(NOTICE, "ListCurr2:%d:%d", list2curr, entry2);
-        */
-        if (entry1 == entry2)
-        {
-            rList = lappend_int(rList, entry1);
-            list1curr ++;
-            list2curr ++;
-        }
-        else if (entry1 < entry2) {
-            if (hasSkip(list1curr, skipInterval1, list1len) && 
-                list_nth_int(list1, skip(list1curr, skipInterval1)) <= entry2 ) 
-            {
-                while (hasSkip(list1curr, skipInterval1, list1len) && 
-                    list_nth_int(list1, skip(list1curr, skipInterval1)) <= entry2)
-                    list1curr = skip(list1curr, skipInterval1);
-            }
-            else
-                list1curr ++;
-        }
-        else {
-            if (hasSkip(list2curr, skipInterval2, list2len) && 
-                list_nth_int(list2, skip(list2curr, skipInterval2)) <= entry1)
-            {
-                while (hasSkip(list2curr, skipInterval2, list2len)  && 
-                    list_nth_int(list2, skip(list2curr, skipInterval2)) <= entry1 )
-                    list2curr = skip(list2curr, skipInterval2);
-            }
-            else
-                list2curr ++;
-        }
-    }
+    TSVector tsvector;
+    char *lexemesptr;
+    WordEntry *curentryptr;
+    StringInfoData str;
     
-    return rList;
+    tsvector = (TSVector) DirectFunctionCall1( to_tsvector, PointerGetDatum(cstring_to_text(text)) );
+    if (tsvector->size == 0)
+        return NULL;
+    lexemesptr = STRPTR(tsvector);
+    curentryptr = ARRPTR(tsvector);
+    initStringInfo (&str);
+    appendBinaryStringInfo (&str, lexemesptr + curentryptr->pos, curentryptr->len);
+    return str.data;
 }
 
-
 /*
- * return (list1 AND NOT list2)
+ * document frequency of a query term: the number of postings of its
+ * root form in all segments, counting deleted documents. ndocs when the
+ * dictionary does not record it.
  */
-List *
-pIntersectNot(List *list1, List *list2)
+static int
+termDocFreq(char *text, IndexReader *index, int ndocs)
 {
-    List *rList = NIL;
-    int list1len = list_length(list1);
-    int list2len = list_length(list2);
-    int list1curr = 0;
-    int list2curr = 0;
+    char    *term = normalizeTerm(text);
+    int     df = 0;
+    int     i;
     
-    while (list1curr < list1len)
+    if (term == NULL)
+        return 0;
+    for (i = 0; i < index->nsegments; i++)
     {
-        int entry1 = list_nth_int(list1, list1curr);
+        PostingInfo info;
         
-        if (list2curr < list2len)
-        {
-            int entry2 = list_nth_int(list2, list2curr);
-            if (entry1 == entry2)
-            {
-                list1curr ++;
-                list2curr ++;
-            }
-            else if (entry1 < entry2)
-            {
-                rList = lappend_int(rList, entry1);
-                list1curr ++;
-            }
-            else if (entry1 > entry2)
-            {
-                list2curr ++;
-            }
-        }
-        else {
-            rList = lappend_int(rList, entry1);
-            list1curr ++;
-        }    
+        if (lookupTerm(index->segments[i].dict, term, &info))
+            df += (info.df >= 0) ? info.df : ndocs;
     }
-    
-    return rList;
+    pfree(term);
+    return Min(df, ndocs);
 }
 
-
 /*
- * return (list1 OR list2)
+ * return the bytes of the postings list described by info. A varint
+ * list in a mapped file is returned in place, otherwise it is read into
+ * a NUL terminated palloc'd copy and *copied is set.
  */
-List *
-pUnion(List *list1, List *list2)
+char *
+loadPostings(PostingsFile *pfile, PostingInfo *info, bool *copied)
 {
-    List *rList = NIL;
-    int list1len = list_length(list1);
-    int list2len = list_length(list2);
-    int list1curr = 0;
-    int list2curr = 0;
-
-    while (list1curr < list1len || list2curr < list2len)
+    char *pstr;
+    
+    if (pfile->map != NULL &&
+        (info->ptr < 0 || info->len < 0 || (Size) info->ptr + info->len > pfile->map->len))
+        elog(ERROR, "Postings file corrupted!");
+    
+    if (pfile->map != NULL && pfile->version == POST_FORMAT_VARINT)
     {
-        if (list1curr < list1len && list2curr < list2len)
-        {
-            int entry1 = list_nth_int(list1, list1curr);
-            int entry2 = list_nth_int(list2, list2curr);
-            if ( entry1 == entry2 )
-            {
-                rList = lappend_int(rList, entry1);
-            }
-            else {
-                rList = lappend_int(rList, entry1);
-                rList = lappend_int(rList, entry2);
-            }
-            list1curr ++;
-            list2curr ++;
-        }
-        else if (list1curr < list1len) {
-            int entry1 = list_nth_int(list1, list1curr);
-            rList = lappend_int(rList, entry1);
-            list1curr ++;
-        }
-        else if (list2curr < list2len) {
-            int entry2 = list_nth_int(list2, list2curr);
-            rList = lappend_int(rList, entry2);
-            list2curr ++;
-        }
+        *copied = FALSE;
+        return pfile->map->addr + info->ptr;
     }
-    return rList;
-}
-
-
-/*
- * return (NOT list)
- */
-List *
-pNegate(List *list, List *allList)
-{
-    return pIntersectNot(allList, list);
+    
+    pstr = (char *) palloc(sizeof(char) * (info->len + 1) );
+    if (pfile->map != NULL)
+        memcpy(pstr, pfile->map->addr + info->ptr, info->len);
+    else
+    {
+        FileSeek(pfile->file, info->ptr, SEEK_SET);
+        if (FileRead(pfile->file, pstr, info->len) != info->len)
+            elog(ERROR, "Postings file corrupted!");
+    }
+    pstr[info->len] = 0;
+    *copied = TRUE;
+    return pstr;
 }
 
-
 /*
- * retrive postings list by searching a term
+ * Set the df of every node of a qual tree to an upper bound of the
+ * number of documents it matches, from the dictionaries only, and sort
+ * the children of AND nodes by ascending df so that the AND cursor
+ * starts with the rarest. ndocs is the number of documents indexed.
+ *
+ * A NOT matches up to every document and comes last in its AND. A df of
+ * 0 is exact, it only comes from terms not in the dictionary.
  */
-List *
-searchTerm(char *text, HTAB * dict, File pfile, bool isALL, bool indexing)
+int
+estimateQualTree(PushableQualNode *node, IndexReader *index, int ndocs)
 {
-    List *rList = NIL;
-    bool found;
-    char *pstr;
-    char *token;
-    Oid  cfgId;
-    TSVector tsvector;
-    char *lexemesptr;
-    WordEntry *curentryptr;
-    StringInfoData str;
-    PostingInfo *re;
-    char *term = text;
-
-#ifdef DEBUG
-    elog(NOTICE, "searchTerm");
-    elog(NOTICE, "Term:%s", term);
-#endif
+    ListCell *cell;
     
-    if (!isALL && !indexing)
+    if (strcmp(node->optype.data, "op_node") == 0)
     {
-        /* normalize term to root form */
-        cfgId = getTSCurrentConfig(true);
-        tsvector = (TSVector) DirectFunctionCall1( to_tsvector, PointerGetDatum(cstring_to_text(term)) );
-        lexemesptr = STRPTR(tsvector);
-        curentryptr = ARRPTR(tsvector);
-        initStringInfo (&str);
-        appendBinaryStringInfo (&str, lexemesptr + curentryptr->pos, curentryptr->len);
-        term = str.data;
+        if (strcmp(node->opname.data, "@@") == 0)
+            node->df = termDocFreq(node->rightOperand.data, index, ndocs);
+        else
+            node->df = Min(1, ndocs);
     }
-    /* search term in the dictionary */
-    re = (PostingInfo *) hash_search(dict, (void *) term, HASH_FIND, &found);   
-    if (found)
+    /* a query known at run time only may match any document */
+    else if (strcmp(node->optype.data, "param_node") == 0)
+        node->df = (strcmp(node->opname.data, "=") == 0) ? Min(1, ndocs) : ndocs;
+    else if (strcmp(node->opname.data, "AND") == 0)
     {
-        /* load postings file */
-        FileSeek(pfile, re->ptr, SEEK_SET);
-        pstr = (char *) palloc(sizeof(char) * (re->len + 1) );
-        FileRead(pfile, pstr, re->len);
-        pstr[re->len] = 0;
+        int                 nchildren = list_length(node->childNodes);
+        PushableQualNode    **children;
+        int                 k = 0;
         
-        /* unserialize postings string */
-        token = strtok(pstr, " ");
-        while ( token != NULL )
+        children = (PushableQualNode **) palloc(sizeof(PushableQualNode *) * Max(nchildren, 1));
+        node->df = ndocs;
+        foreach(cell, node->childNodes)
         {
-            rList = lappend_int(rList, atoi(token));
-            token = strtok(NULL, " ");
+            children[k] = (PushableQualNode *) lfirst(cell);
+            node->df = Min(node->df, estimateQualTree(children[k], index, ndocs));
+            k ++;
         }
+        qsort((void *) children, nchildren, sizeof(PushableQualNode *), cmpQualDocFreq);
+        list_free(node->childNodes);
+        node->childNodes = NIL;
+        for (k = 0; k < nchildren; k++)
+            node->childNodes = lappend(node->childNodes, children[k]);
+        pfree(children);
+    }
+    else if (strcmp(node->opname.data, "OR") == 0)
+    {
+        node->df = 0;
+        foreach(cell, node->childNodes)
+            node->df += estimateQualTree((PushableQualNode *) lfirst(cell), index, ndocs);
+        node->df = Min(node->df, ndocs);
     }
     else
-        rList = NIL;
-    return rList;
+    {
+        /* NOT */
+        foreach(cell, node->childNodes)
+            estimateQualTree((PushableQualNode *) lfirst(cell), index, ndocs);
+        node->df = ndocs;
+    }
+    return node->df;
 }
 
 /*
- * evaluate the qual tree
+ * fraction of the documents matched by a qual tree whose df have been
+ * set by estimateQualTree(), taking the terms as independent
  */
-List *
-evalQualTree(PushableQualNode *node, HTAB *dict, File pfile, List *allList)
+double
+qualTreeSelectivity(PushableQualNode *node, int ndocs)
 {
-    List *rList = NIL;
+    ListCell    *cell;
+    double      sel;
     
-#ifdef DEBUG
-    elog(NOTICE, "evalQualTree");
-#endif
-    
-    /*
-     * if op_node (leaf node)
-     * then retrieve postings
-     */
+    if (ndocs <= 0)
+        return 0.0;
     if (strcmp(node->optype.data, "op_node") == 0)
+        return (double) node->df / ndocs;
+    if (strcmp(node->optype.data, "param_node") == 0)
+        return (strcmp(node->opname.data, "=") == 0) ? (double) node->df / ndocs :
+                DEFAULT_PARAM_SEL;
+    
+    if (strcmp(node->opname.data, "AND") == 0)
     {
-        if ( strcmp( node->opname.data, "@@" ) == 0)
-            rList = searchTerm(node->rightOperand.data, dict, pfile, FALSE, FALSE);
-        else if ( strcmp( node->opname.data, "=" ) == 0)
-            rList = list_make1_int( atoi(node->rightOperand.data) );
+        sel = 1.0;
+        foreach(cell, node->childNodes)
+            sel *= qualTreeSelectivity((PushableQualNode *) lfirst(cell), ndocs);
     }
-    /*
-     * else bool_node (internal node)
-     * perform boolean operations
-     */
-    else if (strcmp((node->optype).data, "bool_node") == 0) 
+    else if (strcmp(node->opname.data, "OR") == 0)
     {
-        ListCell *cell;
-        if (strcmp((node->opname).data, "AND") == 0)
-        {
-            bool firstNode = TRUE;
-            foreach(cell, node->childNodes)
-            {
-                PushableQualNode *childNode = (PushableQualNode *) lfirst(cell);
-                
-                if (firstNode)
-                {
-                    rList = evalQualTree(childNode, dict, pfile, allList);
-                    firstNode = FALSE;
-                }
-                else
-                    rList = pIntersect(rList, evalQualTree(childNode, dict, pfile, allList));
-            }
-        }
-        else if (strcmp((node->opname).data, "OR") == 0)
-        {
-            foreach(cell, node->childNodes)
-            {
-                PushableQualNode *childNode = (PushableQualNode *) lfirst(cell);
-                rList = pUnion(rList, evalQualTree(childNode, dict, pfile, allList));
-            }
-        }
-        else if (strcmp((node->opname).data, "NOT") == 0)
-        {
-            PushableQualNode *childNode = (PushableQualNode *) list_nth (node->childNodes, 0);
-            rList = pNegate(evalQualTree(childNode, dict, pfile, allList), allList);
-        }
+        sel = 1.0;
+        foreach(cell, node->childNodes)
+            sel *= 1.0 - qualTreeSelectivity((PushableQualNode *) lfirst(cell), ndocs);
+        sel = 1.0 - sel;
     }
-    return rList;
-}
\ No newline at end of file
+    else
+        sel = 1.0 - qualTreeSelectivity((PushableQualNode *) linitial(node->childNodes), ndocs);
+    return sel;
+}
+
+/*
+ * order of qual nodes by df
+ */
+static int
+cmpQualDocFreq(const void *p1, const void *p2)
+{
+    int df1 = (*(PushableQualNode * const *) p1)->df;
+    int df2 = (*(PushableQualNode * const *) p2)->df;
+    
+    if (df1 == df2)
+        return 0;
+    return (df1 < df2) ? -1 : 1;
+}
@@ -0,0 +1,277 @@
+/*-------------------------------------------------------------------------
+ *
+ * segment.c
+ *		  Index segments for document collections foreign-data wrapper.
+ *
+ * Copyright (c) 2012, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Zheng Yang <zhengyang4k@gmail.com>
+ *
+ * IDENTIFICATION
+ *		  contrib/dc_fdw/segment.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "qual_pushdown.h"
+
+/*
+ * An index generation is a list of segments, kept in the CURRENT file
+ * of the index dir:
+ *
+ *  g<generation>
+ *  <segment> <tombstone file or "-">      one line per segment, oldest first
+ *
+ * A segment is a directory g<M> holding the dict and post files written
+ * by generation M, and its packed document store if any, which are
+ * never modified afterwards. Documents
+ * deleted or changed after M are masked by a tombstone file del.<N> in
+ * the segment, a bitmap of doc ids written by generation N. Generation
+ * dirs also hold the stats and the manifest of their generation.
+ *
+ * An index dir without CURRENT holds a single segment built in place by
+ * an older version.
+ */
+
+/*
+ * read the segment list of the generation in use, NIL if there is none
+ */
+List *
+readSegmentList(char *indexdir, int *generation)
+{
+    StringInfoData  sidPath;
+    FILE            *current;
+    char            line[MAXPGPATH];
+    List            *segments = NIL;
+    
+    *generation = 0;
+    initStringInfo(&sidPath);
+    appendStringInfo(&sidPath, "%s/" CURRENT_FILE, indexdir);
+    current = AllocateFile(sidPath.data, PG_BINARY_R);
+    if (current == NULL)
+        return NIL;
+    
+    if (fgets(line, sizeof(line), current) == NULL ||
+        sscanf(line, "g%d", generation) != 1)
+        elog(ERROR, "Index generation file \"%s\" corrupted!", sidPath.data);
+    while (fgets(line, sizeof(line), current) != NULL)
+    {
+        char        name[64];
+        char        tombstones[64];
+        SegmentRef  *ref;
+        
+        if (sscanf(line, "%63s %63s", name, tombstones) != 2)
+            elog(ERROR, "Index generation file \"%s\" corrupted!", sidPath.data);
+        ref = (SegmentRef *) palloc(sizeof(SegmentRef));
+        ref->name = pstrdup(name);
+        ref->tombstones = (strcmp(tombstones, NO_TOMBSTONES) == 0) ? NULL : pstrdup(tombstones);
+        segments = lappend(segments, ref);
+    }
+    FreeFile(current);
+    
+    /* a generation written without a segment list is its own segment */
+    if (segments == NIL)
+    {
+        SegmentRef  *ref = (SegmentRef *) palloc(sizeof(SegmentRef));
+        
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "g%d", *generation);
+        ref->name = sidPath.data;
+        ref->tombstones = NULL;
+        segments = list_make1(ref);
+    }
+    return segments;
+}
+
+/*
+ * make a segment list the generation in use. CURRENT is replaced by
+ * rename(), so readers see either the old or the new generation.
+ */
+void
+writeSegmentList(char *indexdir, int generation, List *segments)
+{
+    StringInfoData  sidPath;
+    StringInfoData  sidTmpPath;
+    FILE            *current;
+    ListCell        *cell;
+    
+    initStringInfo(&sidPath);
+    initStringInfo(&sidTmpPath);
+    appendStringInfo(&sidPath, "%s/" CURRENT_FILE, indexdir);
+    appendStringInfo(&sidTmpPath, "%s/" CURRENT_FILE TMP_SUFFIX, indexdir);
+    
+    current = AllocateFile(sidTmpPath.data, PG_BINARY_W);
+    if (current == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", sidTmpPath.data)));
+    fprintf(current, "g%d\n", generation);
+    foreach(cell, segments)
+    {
+        SegmentRef *ref = (SegmentRef *) lfirst(cell);
+        
+        fprintf(current, "%s %s\n", ref->name,
+                ref->tombstones != NULL ? ref->tombstones : NO_TOMBSTONES);
+    }
+    if (FreeFile(current) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", sidTmpPath.data)));
+    if (rename(sidTmpPath.data, sidPath.data) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not rename file \"%s\" to \"%s\": %m",
+                        sidTmpPath.data, sidPath.data)));
+    pfree(sidPath.data);
+    pfree(sidTmpPath.data);
+}
+
+/*
+ * open the segments of the generation in use, and take its number of
+ * documents from its stats
+ */
+IndexReader *
+openIndex(char *indexdir)
+{
+    IndexReader     *index = (IndexReader *) palloc0(sizeof(IndexReader));
+    CollectionStats stats;
+    CollectionStats *pstats = &stats;
+    StringInfoData  sidGenPath;
+    File            statFile;
+    List            *segments;
+    ListCell        *cell;
+    int             generation;
+    int             i = 0;
+    
+    index->cxt = CurrentMemoryContext;
+    
+    segments = readSegmentList(indexdir, &generation);
+    
+    initStringInfo(&sidGenPath);
+    if (segments == NIL)
+        appendStringInfoString(&sidGenPath, indexdir);
+    else
+        appendStringInfo(&sidGenPath, "%s/g%d", indexdir, generation);
+    statFile = openStat(sidGenPath.data);
+    loadStat(&pstats, statFile);
+    closeStat(statFile);
+    index->ndocs = stats.numOfDocs;
+    pfree(sidGenPath.data);
+    
+    if (segments == NIL)
+    {
+        /* index built in place by an older version */
+        index->nsegments = 1;
+        index->segments = (IndexSegment *) palloc(sizeof(IndexSegment));
+        openSegment(&index->segments[0], indexdir, NULL);
+        return index;
+    }
+    
+    index->nsegments = list_length(segments);
+    index->segments = (IndexSegment *) palloc(sizeof(IndexSegment) * index->nsegments);
+    foreach(cell, segments)
+    {
+        SegmentRef      *ref = (SegmentRef *) lfirst(cell);
+        StringInfoData  sidPath;
+        
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/%s", indexdir, ref->name);
+        openSegment(&index->segments[i++], sidPath.data, ref->tombstones);
+        pfree(sidPath.data);
+    }
+    return index;
+}
+
+/*
+ * open the dict and postings of a segment and load its tombstones
+ */
+void
+openSegment(IndexSegment *seg, char *path, char *tombstones)
+{
+    seg->dict = openDict(path);
+    seg->post = openPost(path);
+    seg->docs = openDocStore(path);
+    seg->tombstones = NULL;
+    seg->ntombstoneBytes = 0;
+    if (tombstones != NULL)
+    {
+        StringInfoData sidPath;
+        
+        initStringInfo(&sidPath);
+        appendStringInfo(&sidPath, "%s/%s", path, tombstones);
+        seg->tombstones = loadTombstones(sidPath.data, &seg->ntombstoneBytes);
+        pfree(sidPath.data);
+    }
+}
+
+/*
+ * close all segments of an index
+ */
+void
+closeIndex(IndexReader *index)
+{
+    int i;
+    
+    for (i = 0; i < index->nsegments; i++)
+        closeSegment(&index->segments[i]);
+    if (index->allCursor != NULL)
+        closeQualCursor(index->allCursor);
+    pfree(index->segments);
+    pfree(index);
+}
+
+/*
+ * close the files of a segment
+ */
+void
+closeSegment(IndexSegment *seg)
+{
+    closeDict(seg->dict);
+    closePost(seg->post);
+    if (seg->docs != NULL)
+        closeDocStore(seg->docs);
+    if (seg->tombstones != NULL)
+        pfree(seg->tombstones);
+}
+
+/*
+ * load a tombstone bitmap
+ */
+unsigned char *
+loadTombstones(char *fname, int *nbytes)
+{
+    File            tfile;
+    unsigned char   *bits;
+    int             sz;
+    
+    tfile = PathNameOpenFile(fname, O_RDONLY,  0666);
+    if (tfile < 0)
+        elog(ERROR, "Cannot open tombstone file %s!", fname);
+    sz = FileSeek(tfile, 0, SEEK_END);
+    FileSeek(tfile, 0, SEEK_SET);
+    bits = (unsigned char *) palloc(Max(sz, 1));
+    if (FileRead(tfile, (char *) bits, sz) != sz)
+        elog(ERROR, "Cannot read tombstone file %s!", fname);
+    FileClose(tfile);
+    
+    *nbytes = sz;
+    return bits;
+}
+
+/*
+ * write a tombstone bitmap
+ */
+void
+writeTombstones(char *fname, unsigned char *bits, int nbytes)
+{
+    File tfile;
+    
+    tfile = PathNameOpenFile(fname, O_RDWR | O_CREAT | O_TRUNC,  0666);
+    if (tfile < 0)
+        elog(ERROR, "Cannot create tombstone file %s!", fname);
+    if (FileWrite(tfile, (char *) bits, nbytes) != nbytes)
+        elog(ERROR, "Cannot write tombstone file %s!", fname);
+    FileClose(tfile);
+}
@@ -0,0 +1,351 @@
+/*-------------------------------------------------------------------------
+ *
+ * simd.c
+ *		  Postings list kernels for document collections foreign-data wrapper.
+ *
+ * Copyright (c) 2012, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Zheng Yang <zhengyang4k@gmail.com>
+ *
+ * IDENTIFICATION
+ *		  contrib/dc_fdw/simd.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "qual_pushdown.h"
+
+/*
+ * Linear intersection of sorted, duplicate free doc id arrays: AND
+ * cursors intersect blocks of the postings of their children.
+ *
+ * On x86 the intersection compares blocks of 4 (SSE4.2) or 8 (AVX2) doc
+ * ids of each array all against all. The kernels are compiled with target
+ * attributes and picked at run time from CPUID, so the module still
+ * loads on CPUs without them; the scalar kernels are used otherwise, or
+ * when dc_fdw.enable_simd is off. All kernels produce the same arrays.
+ *
+ * Vector stores may write up to POSTINGS_SIMD_SLACK doc ids past the
+ * result, the output arrays must have room for them.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SIMD_KERNELS
+#include <immintrin.h>
+#endif
+
+/* dc_fdw.enable_simd */
+bool dc_fdw_enable_simd = true;
+
+#define SIMD_UNKNOWN -1     /* CPU not checked yet */
+#define SIMD_NONE 0
+#define SIMD_SSE42 1
+#define SIMD_AVX2 2
+
+static int simdLevel = SIMD_UNKNOWN;
+
+static int intersectScalar(int32 *a, int na, int32 *b, int nb, int32 *out);
+static void fillPostings(int32 *ids, int n, int32 start, int32 step);
+
+/* SQL function of the regression test */
+extern Datum dc_fdw_check_postings_kernels(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(dc_fdw_check_postings_kernels);
+
+/* longest array checked by dc_fdw_check_postings_kernels() */
+#define KERNEL_CHECK_LEN 20
+
+#ifdef USE_SIMD_KERNELS
+/* shuffles packing the selected lanes of a vector to its front */
+static unsigned char sseCompress[16][16];
+static int32 avx2Compress[256][8];
+
+static void initCompressTables(void);
+static int intersectSSE42(int32 *a, int na, int32 *b, int nb, int32 *out);
+static int intersectAVX2(int32 *a, int na, int32 *b, int nb, int32 *out);
+#endif
+
+/*
+ * SIMD instructions usable for postings kernels
+ */
+static int
+getSimdLevel(void)
+{
+    if (simdLevel != SIMD_UNKNOWN)
+        return simdLevel;
+
+    simdLevel = SIMD_NONE;
+#ifdef USE_SIMD_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        simdLevel = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        simdLevel = SIMD_SSE42;
+    if (simdLevel != SIMD_NONE)
+        initCompressTables();
+#endif
+#ifdef DEBUG
+    elog(NOTICE, "-SIMD level: %d", simdLevel);
+#endif
+    return simdLevel;
+}
+
+/*
+ * intersect two sorted doc id arrays into out, return the number of
+ * doc ids written
+ */
+int
+intersectPostings(int32 *a, int na, int32 *b, int nb, int32 *out)
+{
+    if (!dc_fdw_enable_simd)
+        return intersectScalar(a, na, b, nb, out);
+#ifdef USE_SIMD_KERNELS
+    switch (getSimdLevel())
+    {
+        case SIMD_AVX2:
+            return intersectAVX2(a, na, b, nb, out);
+        case SIMD_SSE42:
+            return intersectSSE42(a, na, b, nb, out);
+    }
+#endif
+    return intersectScalar(a, na, b, nb, out);
+}
+
+/*
+ * check the kernels the CPU runs against the scalar ones on crafted
+ * arrays: every pair of lengths up to KERNEL_CHECK_LEN, so the blocks of
+ * 4 and 8 end on every tail and arrays of unequal length meet, with
+ * disjoint, interleaved, identical and partly shared doc ids. The scalar
+ * result is checked against a merge of the two arrays first. Raise an
+ * error on the first difference, return true otherwise.
+ */
+Datum
+dc_fdw_check_postings_kernels(PG_FUNCTION_ARGS)
+{
+    /* start and step of the doc ids of a, then of b */
+    static const int32 patterns[][4] = {
+        {0, 2, 1, 2},       /* interleaved, nothing shared */
+        {0, 1, 0, 1},       /* identical prefixes */
+        {5, 1, 0, 1},       /* shared after the first 5 doc ids of b */
+        {0, 2, 0, 3},       /* multiples of 6 shared */
+        {0, 1, 100, 1},     /* a before b */
+        {100, 1, 0, 1},     /* b before a */
+        {0, 5, 1, 1}        /* sparse a over dense b */
+    };
+    int32   a[KERNEL_CHECK_LEN];
+    int32   b[KERNEL_CHECK_LEN];
+    int32   both[KERNEL_CHECK_LEN];
+    int32   result[KERNEL_CHECK_LEN + POSTINGS_SIMD_SLACK];
+    int     p;
+    int     na;
+    int     nb;
+
+    for (p = 0; p < lengthof(patterns); p++)
+    {
+        for (na = 0; na <= KERNEL_CHECK_LEN; na++)
+        {
+            for (nb = 0; nb <= KERNEL_CHECK_LEN; nb++)
+            {
+                int nboth = 0;
+                int i = 0;
+                int j = 0;
+
+                fillPostings(a, na, patterns[p][0], patterns[p][1]);
+                fillPostings(b, nb, patterns[p][2], patterns[p][3]);
+
+                /* reference: a merge of the two arrays */
+                while (i < na || j < nb)
+                {
+                    if (j == nb || (i < na && a[i] < b[j]))
+                        i ++;
+                    else if (i == na || b[j] < a[i])
+                        j ++;
+                    else
+                    {
+                        both[nboth++] = a[i];
+                        i ++;
+                        j ++;
+                    }
+                }
+
+                if (intersectScalar(a, na, b, nb, result) != nboth ||
+                    memcmp(result, both, sizeof(int32) * nboth) != 0)
+                    elog(ERROR, "Scalar intersection of %d and %d doc ids (pattern %d) is wrong!",
+                         na, nb, p);
+
+#ifdef USE_SIMD_KERNELS
+                if (getSimdLevel() >= SIMD_SSE42 &&
+                    (intersectSSE42(a, na, b, nb, result) != nboth ||
+                     memcmp(result, both, sizeof(int32) * nboth) != 0))
+                    elog(ERROR, "SSE4.2 intersection of %d and %d doc ids (pattern %d) differs from the scalar one!",
+                         na, nb, p);
+                if (getSimdLevel() >= SIMD_AVX2 &&
+                    (intersectAVX2(a, na, b, nb, result) != nboth ||
+                     memcmp(result, both, sizeof(int32) * nboth) != 0))
+                    elog(ERROR, "AVX2 intersection of %d and %d doc ids (pattern %d) differs from the scalar one!",
+                         na, nb, p);
+#endif
+            }
+        }
+    }
+    PG_RETURN_BOOL(true);
+}
+
+static void
+fillPostings(int32 *ids, int n, int32 start, int32 step)
+{
+    int k;
+
+    for (k = 0; k < n; k++)
+        ids[k] = start + k * step;
+}
+
+static int
+intersectScalar(int32 *a, int na, int32 *b, int nb, int32 *out)
+{
+    int i = 0;
+    int j = 0;
+    int n = 0;
+
+    while (i < na && j < nb)
+    {
+        if (a[i] == b[j])
+        {
+            out[n++] = a[i++];
+            j ++;
+        }
+        else if (a[i] < b[j])
+            i ++;
+        else
+            j ++;
+    }
+    return n;
+}
+
+#ifdef USE_SIMD_KERNELS
+
+static void
+initCompressTables(void)
+{
+    int mask;
+
+    for (mask = 0; mask < 256; mask++)
+    {
+        int lane;
+        int k = 0;
+
+        MemSet(avx2Compress[mask], 0, sizeof(avx2Compress[mask]));
+        for (lane = 0; lane < 8; lane++)
+        {
+            if (mask & (1 << lane))
+                avx2Compress[mask][k++] = lane;
+        }
+
+        if (mask < 16)
+        {
+            k = 0;
+            memset(sseCompress[mask], 0x80, sizeof(sseCompress[mask]));
+            for (lane = 0; lane < 4; lane++)
+            {
+                if (mask & (1 << lane))
+                {
+                    int byte;
+
+                    for (byte = 0; byte < 4; byte++)
+                        sseCompress[mask][k * 4 + byte] = lane * 4 + byte;
+                    k ++;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Block intersection: the doc ids of a 4 block of a matching any of a 4
+ * block of b are stored, then the block with the smaller last doc id is
+ * advanced. Doc ids are unique, so nothing is stored twice.
+ */
+__attribute__((target("sse4.2")))
+static int
+intersectSSE42(int32 *a, int na, int32 *b, int nb, int32 *out)
+{
+    int i = 0;
+    int j = 0;
+    int n = 0;
+
+    while (i + 4 <= na && j + 4 <= nb)
+    {
+        __m128i va = _mm_loadu_si128((__m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *) (b + j));
+        __m128i cmp;
+        int     mask;
+        int32   amax = a[i + 3];
+        int32   bmax = b[j + 3];
+
+        cmp = _mm_cmpeq_epi32(va, vb);
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, vb));
+        mask = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+
+        _mm_storeu_si128((__m128i *) (out + n),
+                         _mm_shuffle_epi8(va, _mm_loadu_si128((__m128i *) sseCompress[mask])));
+        n += __builtin_popcount(mask);
+
+        if (amax <= bmax)
+            i += 4;
+        if (bmax <= amax)
+            j += 4;
+    }
+    return n + intersectScalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+/*
+ * Same as intersectSSE42() with blocks of 8
+ */
+__attribute__((target("avx2")))
+static int
+intersectAVX2(int32 *a, int na, int32 *b, int nb, int32 *out)
+{
+    int     i = 0;
+    int     j = 0;
+    int     n = 0;
+    __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+
+    while (i + 8 <= na && j + 8 <= nb)
+    {
+        __m256i va = _mm256_loadu_si256((__m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((__m256i *) (b + j));
+        __m256i cmp = _mm256_cmpeq_epi32(va, vb);
+        int     mask;
+        int     r;
+        int32   amax = a[i + 7];
+        int32   bmax = b[j + 7];
+
+        for (r = 1; r < 8; r++)
+        {
+            vb = _mm256_permutevar8x32_epi32(vb, rotate);
+            cmp = _mm256_or_si256(cmp, _mm256_cmpeq_epi32(va, vb));
+        }
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+
+        _mm256_storeu_si256((__m256i *) (out + n),
+                            _mm256_permutevar8x32_epi32(va,
+                                _mm256_loadu_si256((__m256i *) avx2Compress[mask])));
+        n += __builtin_popcount(mask);
+
+        if (amax <= bmax)
+            i += 8;
+        if (bmax <= amax)
+            j += 8;
+    }
+    return n + intersectScalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+#endif   /* USE_SIMD_KERNELS */
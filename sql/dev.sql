@@ -28,4 +28,6 @@ CREATE FOREIGN TABLE dc_table (id int, content text)
     	buffer_size '10',
     	id_col 'id',
     	text_col 'content'
-    );
\ No newline at end of file
+    );
+
+SELECT dc_fdw_build_index('dc_table', true);